@@ -1,7 +1,10 @@
 ﻿
 #pragma once
 
+#include <future>
 #include <stdexcept>
+#include <string>
+#include <utility>
 
 #include "libencoder_api.hpp"
 
@@ -25,27 +28,144 @@ struct RECT
 	int right;
 };
 
+enum feed_status
+{
+	feed_error = ENCODER_FEED_ERROR,
+	feed_ok = ENCODER_FEED_OK,
+	feed_dropped = ENCODER_FEED_DROPPED,
+	feed_busy = ENCODER_FEED_BUSY,
+};
+
+// 一帧视频的视图, 只记指针和行宽, 不拷贝也不持有数据.
+struct video_frame_view
+{
+	video_frame_view()
+	{
+		frame.format = ENCODER_PIXEL_BGR0;
+		for (int i = 0; i < 3; i++)
+		{
+			frame.planes[i] = NULL;
+			frame.linesize[i] = 0;
+		}
+		frame.width = frame.height = 0;
+		frame.timestamp = 0;
+		frame.flip = 0;
+	}
+
+	static video_frame_view bgr0(const uint8_t* data, int width, int height, int linesize, int64_t timestamp, bool flip = false)
+	{
+		video_frame_view v;
+		v.frame.planes[0] = data;
+		v.frame.linesize[0] = linesize;
+		v.frame.width = width;
+		v.frame.height = height;
+		v.frame.timestamp = timestamp;
+		v.frame.flip = flip;
+		return v;
+	}
+
+	static video_frame_view i420(const uint8_t* y, int y_linesize, const uint8_t* u, int u_linesize, const uint8_t* v_, int v_linesize,
+		int width, int height, int64_t timestamp)
+	{
+		video_frame_view v;
+		v.frame.format = ENCODER_PIXEL_I420;
+		v.frame.planes[0] = y;
+		v.frame.planes[1] = u;
+		v.frame.planes[2] = v_;
+		v.frame.linesize[0] = y_linesize;
+		v.frame.linesize[1] = u_linesize;
+		v.frame.linesize[2] = v_linesize;
+		v.frame.width = width;
+		v.frame.height = height;
+		v.frame.timestamp = timestamp;
+		return v;
+	}
+
+	encoder_video_frame frame;
+};
+
+// 一帧 16 位交错 PCM 的视图.
+struct audio_frame_view
+{
+	audio_frame_view(const uint8_t* data, int size, int64_t timestamp)
+	{
+		frame.data = data;
+		frame.size = size;
+		frame.timestamp = timestamp;
+	}
+
+	encoder_audio_frame frame;
+};
+
+// 编码器句柄, 只能移动不能拷贝, 析构时关闭编码器 (不写文件尾, 需要时先调用 flush_encoded).
 class CEncoder
 {
 public:
+	// video_quality 取 0-10, 越大画质越好, 换算成 crf (5 对应 x264 默认的 23); 小于 0 表示按默认的码率控制.
+	static int quality_to_crf(int video_quality)
+	{
+		if (video_quality < 0)
+			return -1;
+		if (video_quality > 10)
+			video_quality = 10;
+		return 33 - video_quality * 2;
+	}
+
+	explicit CEncoder(const encoder_config& config)
+		: m_filename(config.outputfilename ? config.outputfilename : "")
+		, m_encoder(create_encoder_ex(&config))
+	{
+		if (!m_encoder)
+			throw std::runtime_error(encoder_last_error());
+	}
+
 	CEncoder(const std::string& filename, RECT do_clip, int fps, int video_width, int video_height, bool keep_ratio, int video_quality, int samplerate)
 		: m_filename(filename)
-		, m_encoder(create_encoder(filename.c_str(), 2, samplerate, fps, video_width, video_height, keep_ratio, do_clip.top, do_clip.bottom, do_clip.left, do_clip.right))
-		, m_is_capturing(false)
+		, m_encoder(NULL)
 	{
-		if(!m_encoder)
-			throw std::bad_alloc();
-		m_is_capturing = true;
+		encoder_config config;
+		encoder_config_init(&config);
+		config.outputfilename = m_filename.c_str();
+		config.audio_sample_rate = samplerate;
+		config.fps = fps;
+		config.video_width = video_width;
+		config.video_height = video_height;
+		config.keep_ratio = keep_ratio;
+		config.clip_top = do_clip.top;
+		config.clip_bottom = do_clip.bottom;
+		config.clip_left = do_clip.left;
+		config.clip_right = do_clip.right;
+		open(config, video_quality);
 	}
 
 	CEncoder(const char* filename, int fps = 15, int video_quality = 5)
 		: m_filename(filename)
-		, m_encoder(create_encoder(filename, 2, 48000, 15, 1280, 720, true, 0, 0, 0, 0))
-		, m_is_capturing(false)
+		, m_encoder(NULL)
 	{
-		if (!m_encoder)
-			throw std::bad_alloc();
-		m_is_capturing = true;
+		encoder_config config;
+		encoder_config_init(&config);
+		config.outputfilename = m_filename.c_str();
+		config.fps = fps;
+		open(config, video_quality);
+	}
+
+	CEncoder(CEncoder&& other)
+		: m_filename(std::move(other.m_filename))
+		, m_encoder(other.m_encoder)
+	{
+		other.m_encoder = NULL;
+	}
+
+	CEncoder& operator=(CEncoder&& other)
+	{
+		if (this != &other)
+		{
+			clean_up();
+			m_filename = std::move(other.m_filename);
+			m_encoder = other.m_encoder;
+			other.m_encoder = NULL;
+		}
+		return *this;
 	}
 
 	~CEncoder()
@@ -58,8 +178,58 @@ public:
 		return m_filename;
 	}
 
+	// 移走之后为 NULL.
+	encoder_t* native_handle() const
+	{
+		return m_encoder;
+	}
+
 public:
 
+	// 输入一帧视频, 在调用线程上转换和编码.
+	feed_status feed(const video_frame_view& frame)
+	{
+		return static_cast<feed_status>(encoder_feed_video(m_encoder, &frame.frame));
+	}
+
+	// 输入一帧视频, 立即返回. future 就绪之前不能释放或者改写帧数据;
+	// 排队已满 (feed_busy) 或者参数不合法时 future 立即就绪, 数据没有被读过.
+	std::future<feed_status> feed_async(const video_frame_view& frame)
+	{
+		std::promise<feed_status>* done = new std::promise<feed_status>;
+		std::future<feed_status> result = done->get_future();
+
+		int status = encoder_feed_video_async(m_encoder, &frame.frame, &CEncoder::fulfil, done);
+		if (status != ENCODER_FEED_OK)
+		{
+			done->set_value(static_cast<feed_status>(status));
+			delete done;
+		}
+		return result;
+	}
+
+	// 输入一帧音频, 数据拷走之后就返回.
+	feed_status feed(const audio_frame_view& frame)
+	{
+		return static_cast<feed_status>(encoder_feed_audio_frame(m_encoder, &frame.frame));
+	}
+
+	// 画中画的额外视频源, 见 encoder_pip_set_layout.
+	bool set_pip_layout(int id, const encoder_pip_layout& layout)
+	{
+		return encoder_pip_set_layout(m_encoder, id, &layout) == 0;
+	}
+
+	void remove_pip(int id)
+	{
+		encoder_pip_remove(m_encoder, id);
+	}
+
+	feed_status feed_pip(int id, const video_frame_view& frame)
+	{
+		return static_cast<feed_status>(encoder_pip_feed(m_encoder, id, &frame.frame));
+	}
+
 	// 向视频编码器输入一帧视频.
 	void feed_video_frame(uint8_t* data, int width, int height, int line_size, int64_t timestamp, bool flip_picture = false)
 	{
@@ -76,18 +246,56 @@ public:
 		encoder_flush_frames(m_encoder);
 	}
 
+	// 暂停和恢复, 编码器保持打开, 恢复后输出是连续的.
+	void pause()
+	{
+		encoder_pause(m_encoder);
+	}
+
+	void resume()
+	{
+		encoder_resume(m_encoder);
+	}
+
+	encoder_stats stats() const
+	{
+		encoder_stats s;
+		encoder_get_stats(m_encoder, &s);
+		return s;
+	}
+
 private:
+	CEncoder(const CEncoder&);
+	CEncoder& operator=(const CEncoder&);
+
+	void open(encoder_config& config, int video_quality)
+	{
+		config.crf = quality_to_crf(video_quality);
+		if (config.crf >= 0)
+			config.rc_mode = ENCODER_RC_CRF;
+
+		m_encoder = create_encoder_ex(&config);
+		if (!m_encoder)
+			throw std::runtime_error(encoder_last_error());
+	}
+
+	static void fulfil(int status, void* user)
+	{
+		std::promise<feed_status>* done = static_cast<std::promise<feed_status>*>(user);
+		done->set_value(static_cast<feed_status>(status));
+		delete done;
+	}
+
 	void clean_up()
 	{
-		//if(m_is_capturing)
-			//encoder_stop_capture(m_encoder);
-		destory_encoder(m_encoder);
+		if (m_encoder)
+			destory_encoder(m_encoder);
+		m_encoder = NULL;
 	}
 
 private:
 	std::string m_filename;
 	encoder_t* m_encoder;
-	bool m_is_capturing;
 };
 
 }
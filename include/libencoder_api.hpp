@@ -22,14 +22,507 @@
 #define ENCODER_API_EXPORT
 #endif
 
+// 延迟分布的区间数, 每个区间的上限见 encoder_latency_bucket_limit_us.
+#define ENCODER_LATENCY_BUCKETS 16
+
 extern "C"
 {
 	struct encoder_t;
+
+	enum encoder_latency_mode
+	{
+		ENCODER_LATENCY_NORMAL = 0,
+		// 直播用的低延迟模式: 片级多线程, zerolatency, 无 B 帧, 周期帧内刷新, 一帧大小的 VBV.
+		// crf 模式下需要 max_bitrate_kbps 作为 VBV 的码率, 给了 tune 时在后面加上 zerolatency.
+		ENCODER_LATENCY_LOW = 1,
+	};
+
+	enum encoder_rc_mode
+	{
+		// 平均码率, 由 qmin/qmax 限制画质范围, 和以前的行为一致.
+		ENCODER_RC_DEFAULT = 0,
+		// 恒定码率, 需要 bitrate_kbps, VBV 默认一秒.
+		ENCODER_RC_CBR = 1,
+		// 平均码率, 峰值由 max_bitrate_kbps 限制, 默认两倍.
+		ENCODER_RC_VBR = 2,
+		// 恒定质量, 需要 crf, 设置了 max_bitrate_kbps 时加 VBV 限制.
+		ENCODER_RC_CRF = 3,
+	};
+
+	struct encoder_config
+	{
+		// 结构体大小, 由 encoder_config_init 填写, 库据此判断调用方使用的版本.
+		int struct_size;
+
+		// 文件名或者 ffmpeg 支持的 URL. "paced-udp://host:port" (IPv6 写成 [addr]:port) 和
+		// "paced-unix:///path" 把 TS 按 7 个包一个数据报发到 UDP 地址或者 Unix 数据报套接字,
+		// 按 PCR 均匀发送, 不会突发; 这两种输出不支持文件切分.
+		const char* outputfilename;
+		int audio_channel;
+		int audio_sample_rate;
+		int fps;
+		int video_width;
+		int video_height;
+		bool keep_ratio;
+		int clip_top;
+		int clip_bottom;
+		int clip_left;
+		int clip_right;
+
+		// 会话优先级, 默认 100, 决定从全局核预算里分到的编码线程数.
+		int priority;
+
+		// 会话线程和 x264 工作线程绑定的 cpu, 例如 "0-7,16-23", NULL 表示不绑定.
+		// 帧缓冲会分配在这组 cpu 所在的 NUMA 节点上.
+		const char* cpu_set;
+
+		// encoder_latency_mode, 默认 ENCODER_LATENCY_NORMAL.
+		int latency_mode;
+
+		// 命名的参数组合: "archive" (存档), "live" (推流), "low-cpu" (省 CPU), NULL 表示不用.
+		// 先应用 profile, 再应用下面明确设置的字段, 最后应用 options.
+		const char* profile;
+
+		// encoder_rc_mode, 码率单位 kbps, VBV 大小单位 kbit. 0 表示默认.
+		int rc_mode;
+		int bitrate_kbps;
+		int max_bitrate_kbps;
+		int vbv_buffer_kbits;
+		// 0-51, -1 表示默认.
+		int crf;
+
+		// GOP 长度 (帧), 0 表示默认. bframes 和 lookahead 为 -1 表示由 preset 决定.
+		int gop;
+		int bframes;
+		int lookahead;
+		// x264 线程数, 0 表示由全局核预算分配.
+		int threads;
+
+		// x264 的 preset / tune, H.264 的 profile, NULL 表示默认.
+		const char* preset;
+		const char* tune;
+		const char* h264_profile;
+
+		// 0 表示默认 64kbps.
+		int audio_bitrate_kbps;
+
+		// 直接交给编码器的参数, 例如 "aq-mode=2:x264-params=keyint_min=30".
+		const char* codec_options;
+
+		// 用 "key=value:key=value" 设置上面的字段, 名字和字段名一致,
+		// 例如 "profile=live:bitrate_kbps=4000:codec.aq-mode=2", rc_mode 取 cbr/vbr/crf.
+		const char* options;
+
+		// 任意比例缩放时的滤镜: "fast_bilinear", "bilinear", "bicubic" (默认), "lanczos", NULL 表示默认.
+		// 尺寸不变和正好 2 倍, 4 倍缩小时不经过 swscale, 用盒式滤波直接转换.
+		const char* scale_filter;
+
+		// MP4 分片: 0 表示普通 MP4 (默认), -1 表示每个 GOP 一个分片,
+		// 大于 0 时超过这个间隔 (毫秒) 之后的第一个关键帧开始新的分片.
+		// 分片模式下内存不随录制时长增长, 停止时不用写整个 moov, 中途崩溃时已经写出的分片仍然可以播放.
+		int mp4_fragment_ms;
+
+		// 文件切分: 当前文件超过 rotate_size_mb 或者 rotate_seconds 之后, 在下一个关键帧换到新文件,
+		// 编码器不重新打开, 不丢帧, 新文件的时间戳从 0 开始. 0 表示不限.
+		// rotate_template 是新文件名, "%N" 换成序号 (从 1 开始), 其余按 strftime 展开,
+		// 例如 "/rec/cam1-%Y%m%d-%H%M%S.mp4", 百分号本身写成 "%%"; 没有任何 "%" 转换的模板每次展开都一样, 会被拒绝.
+		// NULL 表示在 outputfilename 后面加 "-序号".
+		int rotate_size_mb;
+		int rotate_seconds;
+		const char* rotate_template;
+
+		// 不为 0 时按相邻两帧的变化区域自动调整画质: 变化的区域提高画质, 不变的区域降低,
+		// 适合屏幕录制. 偏移量可以用 options 的 roi_dirty_qoffset / roi_static_qoffset 调整.
+		int roi_auto;
+
+		// 输出是管道或者网络, 写出比编码慢的时候, 在这个范围 (kbps) 内自动调整视频码率和 VBV,
+		// 每次调整都从一个关键帧开始. adaptive_max_kbps 为 0 表示不调整, adaptive_min_kbps 为 0 表示不设下限.
+		// crf 模式下调整的是 max_bitrate_kbps. 调整的情况见 encoder_stats.
+		int adaptive_min_kbps;
+		int adaptive_max_kbps;
+	};
+
+	// 感兴趣区域, 坐标是输出画面上的像素, right/bottom 不含.
+	// qoffset 取 -100 到 100, 负数表示提高画质, 正数表示降低, 重叠时数组里靠前的优先.
+	struct encoder_roi
+	{
+		int left;
+		int top;
+		int right;
+		int bottom;
+		int qoffset;
+	};
+
+	struct encoder_stats
+	{
+		// 复用队列里等待写入的包数, 以及出现过的最大值.
+		int video_queue_depth;
+		int video_queue_max;
+		int audio_queue_depth;
+		int audio_queue_max;
+
+		int64_t packets_written;
+		int64_t bytes_written;
+		// 因为超过最大交织间隔而不再等待另一路流的次数.
+		int64_t interleave_forced;
+
+		// 会话的线程绑定: cpu 集合 (空字符串表示没有绑定), NUMA 节点 (-1 表示未知), x264 线程数.
+		char cpu_set[128];
+		int numa_node;
+		int codec_threads;
+
+		// 视频帧从 encoder_feed_video_frame 进入到包写出的延迟分布.
+		int64_t latency_histogram[ENCODER_LATENCY_BUCKETS];
+		int64_t latency_samples;
+		int64_t latency_avg_us;
+		int64_t latency_max_us;
+
+		// 对齐到帧率网格时丢掉的多余帧, 以及为了填补空档重复编码的帧.
+		int64_t frames_dropped;
+		int64_t frames_duplicated;
+
+		// 帧, 包和缓冲池不够用时新分配的次数, 预热之后应该保持不变.
+		int64_t pool_allocations;
+
+		// 分片 MP4 已经写出的分片数.
+		int64_t fragments_written;
+
+		// 切换过的文件数, 以及当前正在写的文件名.
+		int64_t rotations;
+		char current_file[1024];
+
+		// 是否处于暂停状态.
+		int paused;
+
+		// encoder_state, 异步创建时还没打开好或者打开失败时其余字段都为 0.
+		int state;
+
+		// 编码器是否支持按区域调整画质 (需要 libavcodec 支持 AVRegionOfInterest),
+		// 以及带着区域信息编码的帧数.
+		int roi_supported;
+		int64_t roi_frames;
+
+		// 自适应码率: 当前的视频码率 (没有打开时是配置的码率), 估计的输出能力 (0 表示输出不是瓶颈),
+		// 复用队列里积压的字节数以及按当前码率折算的时长, 降低和提高码率的次数.
+		int adaptive_bitrate_kbps;
+		int adaptive_drain_kbps;
+		int64_t adaptive_queued_bytes;
+		int64_t adaptive_queue_delay_ms;
+		int64_t adaptive_step_downs;
+		int64_t adaptive_step_ups;
+
+		// paced-udp:// 和 paced-unix:// 输出: 发出的数据报数, sendmmsg 的批数, 发送失败丢掉的数据报数.
+		int64_t paced_datagrams;
+		int64_t paced_batches;
+		int64_t paced_send_errors;
+
+		// 预热 (300 帧视频) 之后音视频帧缓冲池, 包池和音频输入缓冲又新分配的次数.
+		// 不为 0 多半是输出跟不上编码, 包在复用队列里越积越多; 编码库内部的分配不算在里面.
+		int64_t steady_pool_allocations;
+	};
+
+	enum encoder_preview_format
+	{
+		// 三个平面的 YUV420P, 有限范围.
+		ENCODER_PREVIEW_I420 = 0,
+		ENCODER_PREVIEW_BGRA = 1,
+		// data[0] 开始的 size 字节是一个完整的 JPEG 文件.
+		ENCODER_PREVIEW_JPEG = 2,
+	};
+
+	struct encoder_preview_config
+	{
+		// encoder_preview_format.
+		int format;
+		// 为 0 时按输出画面的比例算, 两个都为 0 时是输出的 1/4.
+		int width;
+		int height;
+		// 两次预览之间至少间隔多久, 0 表示每帧都要 (回调还没返回时跳过).
+		int interval_ms;
+		// JPEG 质量 1-100, 0 表示 75.
+		int jpeg_quality;
+	};
+
+	// 只在回调期间有效.
+	struct encoder_preview
+	{
+		int format;
+		int width;
+		int height;
+		const uint8_t* data[3];
+		int linesize[3];
+		int size;
+		int64_t timestamp;
+	};
+
+	typedef void (*encoder_preview_callback)(const encoder_preview* preview, void* user);
+
+	struct encoder_shm_t;
+
+	enum encoder_shm_kind
+	{
+		ENCODER_SHM_VIDEO = 0,
+		ENCODER_SHM_AUDIO = 1,
+	};
+
+	enum encoder_shm_format
+	{
+		// 单平面 BGR0, 用 linesize[0] 和 offset[0].
+		ENCODER_SHM_BGR0 = 0,
+		// 三个平面的 YUV420P.
+		ENCODER_SHM_I420 = 1,
+	};
+
+	#define ENCODER_SHM_MAX_DIRTY 16
+
+	// 共享内存里每个槽的描述, 生产者填写, 编码进程原地读取槽里的数据.
+	// offset 是各平面相对槽起点的字节偏移. 音频是 16 位交错 PCM, 长度为 size.
+	struct encoder_shm_frame
+	{
+		int32_t kind;
+		int32_t format;
+		int32_t width;
+		int32_t height;
+		int32_t linesize[3];
+		uint32_t offset[3];
+		uint32_t size;
+		int32_t flip;
+		int64_t timestamp;
+		// 和上一帧相比变化的区域 (left, top, right, bottom), 画面尺寸和输出一致时用来提高这些区域的画质.
+		int32_t dirty_count;
+		int32_t dirty[ENCODER_SHM_MAX_DIRTY][4];
+	};
+
+	enum encoder_batch_format
+	{
+		// 按扩展名判断, .y4m 是 YUV4MPEG2, 其他当作裸 BGR0.
+		ENCODER_BATCH_AUTO = 0,
+		ENCODER_BATCH_Y4M = 1,
+		ENCODER_BATCH_BGR0 = 2,
+	};
+
+	struct encoder_batch_input
+	{
+		int struct_size;
+
+		const char* video_path;
+		// encoder_batch_format.
+		int video_format;
+		// 裸 BGR0 文件的尺寸和帧率, Y4M 从文件头读取.
+		int raw_width;
+		int raw_height;
+		int raw_fps_num;
+		int raw_fps_den;
+
+		// 16 位 PCM 的 WAV 文件, 单声道或立体声, NULL 表示没有音频.
+		const char* audio_path;
+
+		// 不为 0 时按 GOP 切段, 多段同时编码后拼接, 只对能随机读取的输入有效.
+		int parallel;
+		// 每段的 GOP 数, 0 表示按核数自动决定.
+		int chunk_gops;
+	};
+
+	struct encoder_batch_result
+	{
+		int64_t video_frames;
+		int64_t audio_samples;
+		// 输出的媒体时长, 实际用时, 以及折算的帧率和相对实时的倍数.
+		double media_seconds;
+		double elapsed_seconds;
+		double fps;
+		double speed;
+		// 并行编码时切成的段数和同时编码的段数, 串行编码时为 0.
+		int chunks;
+		int workers;
+	};
+
+	enum encoder_pixel_format
+	{
+		// 4 字节一个像素, 内存里依次是 B, G, R, 第四个字节不用.
+		ENCODER_PIXEL_BGR0 = 0,
+		// YUV420P, 三个平面.
+		ENCODER_PIXEL_I420 = 1,
+	};
+
+	// 一帧视频. BGR0 只用 planes[0] / linesize[0], 会按 config 裁剪和加黑边; I420 直接缩放到输出尺寸.
+	// flip 表示上下颠倒 (例如 Windows 的 DIB), 只对 BGR0 有效.
+	struct encoder_video_frame
+	{
+		int format;
+		const uint8_t* planes[3];
+		int linesize[3];
+		int width;
+		int height;
+		int64_t timestamp;
+		int flip;
+	};
+
+	// 一帧音频, 16 位交错的 PCM, 声道数和采样率同 config.
+	struct encoder_audio_frame
+	{
+		const uint8_t* data;
+		int size;
+		int64_t timestamp;
+	};
+
+	enum encoder_feed_status
+	{
+		// 参数不合法.
+		ENCODER_FEED_ERROR = -1,
+		// 已经送进编码器.
+		ENCODER_FEED_OK = 0,
+		// 还没打开好, 暂停中, 或者按帧率是多余的帧, 直接丢掉了.
+		ENCODER_FEED_DROPPED = 1,
+		// 异步输入时前面排队的帧还没做完, 这一帧没有接收, 数据没有被读过.
+		ENCODER_FEED_BUSY = 2,
+	};
+
+	// 异步输入的一帧处理完时在库的线程池里调用, status 为 ENCODER_FEED_OK 或 ENCODER_FEED_DROPPED,
+	// 之后调用方才可以释放或者改写这一帧的数据. 回调里不要做耗时的事情.
+	typedef void (*encoder_feed_callback)(int status, void* user);
+
+	// 画中画的一个源在输出画面上的位置和大小 (会向下对齐到偶数, 可以部分超出画面),
+	// 以及从源画面上取的区域 (right/bottom 不含, 全为 0 表示整幅画面). 源画面缩放到这个大小, 不保持比例.
+	struct encoder_pip_layout
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+		int crop_left;
+		int crop_top;
+		int crop_right;
+		int crop_bottom;
+	};
+
+	enum encoder_state
+	{
+		ENCODER_STATE_STARTING = 0,
+		ENCODER_STATE_READY = 1,
+		ENCODER_STATE_FAILED = 2,
+	};
+
+	// 异步创建完成时在库的线程池里调用, state 为 ENCODER_STATE_READY 或 ENCODER_STATE_FAILED.
+	// 回调里不要做耗时的事情.
+	typedef void (*encoder_ready_callback)(encoder_t* encoder, int state, void* user);
+
 	ENCODER_API encoder_t* create_encoder(const char* outputfilename, int audio_channel, int audio_sample_rate, int fps, int video_width, int video_height, bool keep_ratio, int clip_top, int clip_bottom, int clip_left, int clip_right);
 
+	// 用默认值填充 config, 然后修改需要的字段再传给 create_encoder_ex.
+	ENCODER_API void encoder_config_init(encoder_config* config);
+	// 参数不合法或者打开失败时返回 NULL, 原因用 encoder_last_error 取得.
+	ENCODER_API encoder_t* create_encoder_ex(const encoder_config* config);
+	// 当前线程上一次 create_encoder_ex 失败的原因, 没有失败时返回空字符串.
+	ENCODER_API const char* encoder_last_error();
+
+	// 只检查参数, 立刻返回句柄, 打开输出和编码器放到后台做, 完成时调用 callback (可以为 NULL).
+	// 打开好之前输入的音视频直接丢掉. 参数不合法时返回 NULL, 原因用 encoder_last_error 取得.
+	// 失败的句柄同样要用 destory_encoder 释放.
+	ENCODER_API encoder_t* create_encoder_async(const encoder_config* config, encoder_ready_callback callback, void* user);
+	// 等待异步创建完成, timeout_ms 小于 0 时一直等. 返回 encoder_state,
+	// 返回 ENCODER_STATE_FAILED 时原因用 encoder_last_error 取得.
+	ENCODER_API int encoder_wait_ready(encoder_t* encoder, int timeout_ms);
+	// 按 config 的视频参数在后台预先打开 count 个编码器, 之后参数一样的会话直接使用, 省掉打开编码器的时间.
+	// 用掉一个会自动补上一个, count 为 0 时释放这种参数的所有预热编码器. 成功返回 0, 失败返回 -1.
+	ENCODER_API int encoder_prewarm(const encoder_config* config, int count);
+
+	// 离线转码一个文件. config 里 video_width/video_height/fps 为 0 时使用输入文件的参数,
+	// 音频采样率取自 WAV 文件. 成功返回 0, 失败返回 -1, 原因用 encoder_last_error 取得.
+	ENCODER_API void encoder_batch_input_init(encoder_batch_input* input);
+	ENCODER_API int encoder_batch_encode(const encoder_config* config, const encoder_batch_input* input, encoder_batch_result* result);
+
+	// 日志级别, 取值和 FFmpeg 的 AV_LOG_* 相同: -8 不输出, 16 错误, 24 警告 (默认), 32 信息, 48 调试.
+	// 高于这个级别的日志 (包括 x264 的) 在格式化之前就丢掉.
+	ENCODER_API void encoder_set_log_level(int level);
+	// 日志默认只写进内存里的环形缓冲 (保留最近 512 条), 不做任何 I/O.
+	// 设置 sink 之后每条日志另外交给 sink, 可能在任意线程上调用; NULL 表示恢复默认.
+	// sink 和 user 总是成对交给回调; 换掉 sink 时等正在进行的回调结束才返回, 之后可以释放旧的 user.
+	// 回调里不要再调用 encoder_set_log_sink.
+	typedef void (*encoder_log_sink)(int level, const char* message, void* user);
+	ENCODER_API void encoder_set_log_sink(encoder_log_sink sink, void* user);
+	// 把环形缓冲里的日志从旧到新拷到 buffer (截断并以 0 结尾), 返回完整文本的长度.
+	ENCODER_API int encoder_log_dump(char* buffer, int size);
+
+	// 打开或关闭各阶段 (裁剪, 格式转换, 叠加, 视频/音频编码, 写出) 的耗时记录, 默认关闭.
+	// 记录放在内存里的环形缓冲 (保留最近 16384 条), 重新打开时清空.
+	ENCODER_API void encoder_trace_enable(int enable);
+	// 把记录导出成 Chrome trace 的 JSON 拷到 buffer (截断并以 0 结尾), 返回完整文本的长度.
+	ENCODER_API int encoder_trace_dump(char* buffer, int size);
+
+	// 设置进程内所有会话共用的核预算, 以及预计同时运行的会话数, 只影响之后创建的会话.
+	ENCODER_API void encoder_scheduler_setup(int core_budget, int expected_sessions);
+
 	ENCODER_API void encoder_feed_audio(encoder_t*, uint8_t* data, long size, int64_t timestamp);
 	ENCODER_API void encoder_feed_video_frame(encoder_t*, uint8_t* data, int width, int height, int linesize, int64_t timestamp, bool flip_picture);
+	// 输入一帧视频, 在调用线程上转换和编码, 返回 encoder_feed_status.
+	ENCODER_API int encoder_feed_video(encoder_t*, const encoder_video_frame* frame);
+	// 输入一帧视频, 不拷贝也不等待: 转换和编码放到库的线程池里做, 完成时调用 callback (可以为 NULL).
+	// 返回 ENCODER_FEED_OK 表示已经接收, 此时 callback 一定会被调用; 其余返回值不会调用 callback.
+	// 排队的帧最多两帧, 满了返回 ENCODER_FEED_BUSY. 同一个编码器不要和同步的视频输入混用.
+	ENCODER_API int encoder_feed_video_async(encoder_t*, const encoder_video_frame* frame, encoder_feed_callback callback, void* user);
+	// 输入一帧音频, 数据拷走之后就返回, 编码在库的线程池里做. 返回 encoder_feed_status.
+	ENCODER_API int encoder_feed_audio_frame(encoder_t*, const encoder_audio_frame* frame);
 	ENCODER_API void encoder_flush_frames(encoder_t*);
+	// 暂停: 之后输入的音视频直接丢掉, 编码器和线程保持打开, 恢复时不用重新初始化.
+	// 恢复: 第一帧视频编成关键帧, 音视频时间戳接着暂停前往下排, 输出连续没有空档.
+	ENCODER_API void encoder_pause(encoder_t*);
+	ENCODER_API void encoder_resume(encoder_t*);
+	// 设置整个会话的感兴趣区域 (例如当前的活动窗口), 一直有效直到下次设置, count 为 0 时清除.
+	ENCODER_API void encoder_set_roi(encoder_t*, const encoder_roi* rois, int count);
+	// 只对下一帧视频有效的感兴趣区域, 优先于 encoder_set_roi 设置的.
+	ENCODER_API void encoder_set_frame_roi(encoder_t*, const encoder_roi* rois, int count);
+	// 叠加图 (鼠标指针, 水印), 编码器在裁剪和加黑边之后直接叠加到输出画面上, 调用方不用改自己的画面.
+	// bgra 是预乘 alpha 的 BGRA, 设置时转换一次, 之后移动不用重新设置. id 大的叠在上面.
+	// 已有的 id 换图时保留位置和透明度, 新的 id 在 (0, 0), 不透明. 参数不对时返回 -1.
+	ENCODER_API int encoder_overlay_set_image(encoder_t*, int id, const uint8_t* bgra, int width, int height, int stride);
+	// 位置是输出画面上的像素, 可以部分超出画面. alpha 为 0-255, 0 表示隐藏.
+	ENCODER_API void encoder_overlay_move(encoder_t*, int id, int x, int y, int alpha);
+	ENCODER_API void encoder_overlay_remove(encoder_t*, int id);
+	ENCODER_API void encoder_get_stats(encoder_t*, encoder_stats* stats);
+
+	// 画中画: 主画面 (encoder_feed_video_frame 等输入的) 之外再加视频源, 例如屏幕录制时角落里的摄像头.
+	// 源各自按自己的节奏输入, 输入时就在调用线程上裁剪缩放好; 每帧主画面转换成 YUV 之后
+	// 把每个源最近的一帧拷到布局的位置上, id 大的在上面, 鼠标指针和水印叠加图在所有源之上.
+	// 设置或修改布局, 成功返回 0, 参数不对返回 -1.
+	ENCODER_API int encoder_pip_set_layout(encoder_t*, int id, const encoder_pip_layout* layout);
+	ENCODER_API void encoder_pip_remove(encoder_t*, int id);
+	// 输入一帧源画面, 返回后数据就可以释放. 同一个源的输入要串行.
+	// 没有设置过布局或者参数不合法时返回 ENCODER_FEED_ERROR, 否则返回 ENCODER_FEED_OK.
+	ENCODER_API int encoder_pip_feed(encoder_t*, int id, const encoder_video_frame* frame);
+
+	// 从编码用的画面 (缩放, 叠加之后) 上取预览图, 缩小后在库的线程池里调用 callback, 不会阻塞编码.
+	// id 区分同一个会话上的多个预览, 例如实时预览和每分钟一张的缩略图. callback 为 NULL 时删除,
+	// 删除或者替换时会等正在进行的回调结束. 成功返回 0, 失败返回 -1, 原因用 encoder_last_error 取得.
+	ENCODER_API int encoder_set_preview(encoder_t*, int id, const encoder_preview_config* config, encoder_preview_callback callback, void* user);
+
+	// 跨进程传帧的共享内存环: slots 个槽, 每个槽 slot_bytes 字节, 配一个门铃 (Linux 上是 futex).
+	// 一个生产者 (例如沙箱里的采集进程) 写, 一个消费者 (编码进程) 读, 帧数据不再经过管道拷贝.
+	// name 为共享内存的名字 (Linux 上是 shm_open 的名字, 例如 "/cam1"); NULL 时 Linux 上用匿名的 memfd,
+	// 用 encoder_shm_fd 取得描述符传给另一个进程. 失败返回 NULL, 原因用 encoder_last_error 取得.
+	ENCODER_API encoder_shm_t* encoder_shm_create(const char* name, int slots, int slot_bytes);
+	ENCODER_API encoder_shm_t* encoder_shm_open(const char* name);
+	// Linux: 打开从别的进程传过来的 memfd, 描述符由调用方关闭.
+	// memfd 必须已经封住大小 (F_SEAL_SHRINK | F_SEAL_GROW, encoder_shm_create 创建的会自动封住), 否则失败.
+	ENCODER_API encoder_shm_t* encoder_shm_open_fd(int fd);
+	// Linux: 共享内存的描述符, 其他平台返回 -1.
+	ENCODER_API int encoder_shm_fd(encoder_shm_t*);
+	// 创建的一方释放时删除名字.
+	ENCODER_API void encoder_shm_destroy(encoder_shm_t*);
+
+	// 生产者: 等一个空槽 (最多 timeout_ms, 小于 0 时一直等), 返回槽的起点, 超时或者已关闭时返回 NULL.
+	// 写好数据后用 encoder_shm_commit 提交, 提交之前不能再次 begin.
+	ENCODER_API uint8_t* encoder_shm_begin(encoder_shm_t*, int timeout_ms);
+	ENCODER_API int encoder_shm_slot_bytes(encoder_shm_t*);
+	ENCODER_API void encoder_shm_commit(encoder_shm_t*, const encoder_shm_frame* frame);
+	// 生产者不再写了, 消费者取完剩下的槽之后 encoder_shm_pump 返回 -1.
+	ENCODER_API void encoder_shm_close(encoder_shm_t*);
+
+	// 消费者: 等到有帧 (最多 timeout_ms), 把已经提交的槽全部原地送进编码器.
+	// 返回处理的槽数, 超时返回 0, 生产者已关闭并且取完时返回 -1. 参数不合法的槽直接跳过.
+	ENCODER_API int encoder_shm_pump(encoder_shm_t*, encoder_t*, int timeout_ms);
+	// 延迟分布第 bucket 个区间的上限 (微秒), 最后一个区间没有上限, 返回 INT64_MAX.
+	ENCODER_API int64_t encoder_latency_bucket_limit_us(int bucket);
 	ENCODER_API void encoder_do_benchmark_and_setup_parameters();
 	ENCODER_API void destory_encoder(encoder_t* encoder);
 }
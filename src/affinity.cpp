@@ -0,0 +1,283 @@
+﻿
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <stdint.h>
+#include "affinity.hpp"
+
+namespace libencoder {
+
+bool cpu_set::parse(const std::string& str)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(str);
+	std::string item;
+
+	try
+	{
+		while (std::getline(ss, item, ','))
+		{
+			if (item.empty())
+				continue;
+
+			std::string::size_type dash = item.find('-');
+			int first = boost::lexical_cast<int>(item.substr(0, dash));
+			int last = dash == std::string::npos ? first : boost::lexical_cast<int>(item.substr(dash + 1));
+			if (first < 0 || last < first)
+				return false;
+
+			for (int cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+		}
+	}
+	catch (boost::bad_lexical_cast&)
+	{
+		return false;
+	}
+
+	std::sort(cpus.begin(), cpus.end());
+	cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+	m_cpus.swap(cpus);
+	return true;
+}
+
+std::string cpu_set::to_string() const
+{
+	std::stringstream ss;
+
+	for (std::size_t i = 0; i < m_cpus.size(); )
+	{
+		std::size_t j = i;
+		while (j + 1 < m_cpus.size() && m_cpus[j + 1] == m_cpus[j] + 1)
+			j++;
+
+		if (i != 0)
+			ss << ',';
+		ss << m_cpus[i];
+		if (j != i)
+			ss << '-' << m_cpus[j];
+		i = j + 1;
+	}
+	return ss.str();
+}
+
+int cpu_set::numa_node() const
+{
+	if (m_cpus.empty())
+		return -1;
+
+#ifdef _WIN32
+	// 同样按 XP 的 _WIN32_WINNT 编译, 运行时再找.
+	typedef BOOL (WINAPI *get_numa_processor_node_fn)(UCHAR, PUCHAR);
+	get_numa_processor_node_fn get_numa_processor_node = reinterpret_cast<get_numa_processor_node_fn>(
+		GetProcAddress(GetModuleHandleA("kernel32.dll"), "GetNumaProcessorNode"));
+	UCHAR node = 0;
+	if (get_numa_processor_node && m_cpus[0] < 256 && get_numa_processor_node(static_cast<UCHAR>(m_cpus[0]), &node) && node != 0xFF)
+		return node;
+	return -1;
+#elif defined(__linux__)
+	// /sys/devices/system/cpu/cpuN/ 下面有个 nodeM 的链接.
+	boost::system::error_code ec;
+	boost::filesystem::path dir("/sys/devices/system/cpu/cpu" + boost::lexical_cast<std::string>(m_cpus[0]));
+	for (boost::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+	{
+		std::string name = it->path().filename().string();
+		if (name.size() > 4 && name.compare(0, 4, "node") == 0)
+		{
+			try
+			{
+				return boost::lexical_cast<int>(name.substr(4));
+			}
+			catch (boost::bad_lexical_cast&)
+			{
+			}
+		}
+	}
+	return -1;
+#else
+	return -1;
+#endif
+}
+
+#ifdef __linux__
+static bool set_affinity(const cpu_set& cpus)
+{
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	for (std::size_t i = 0; i < cpus.cpus().size(); i++)
+	{
+		if (cpus.cpus()[i] < CPU_SETSIZE)
+			CPU_SET(cpus.cpus()[i], &mask);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+}
+#endif
+
+#ifdef _WIN32
+static DWORD_PTR affinity_mask(const cpu_set& cpus)
+{
+	// 只支持第一个处理器组里的 cpu.
+	DWORD_PTR mask = 0;
+	for (std::size_t i = 0; i < cpus.cpus().size(); i++)
+	{
+		if (cpus.cpus()[i] < static_cast<int>(sizeof(DWORD_PTR) * 8))
+			mask |= static_cast<DWORD_PTR>(1) << cpus.cpus()[i];
+	}
+	return mask;
+}
+#endif
+
+bool pin_current_thread(const cpu_set& cpus)
+{
+	if (cpus.empty())
+		return false;
+
+#ifdef _WIN32
+	DWORD_PTR mask = affinity_mask(cpus);
+	return mask && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+	return set_affinity(cpus);
+#else
+	return false;
+#endif
+}
+
+scoped_thread_affinity::scoped_thread_affinity(const cpu_set& cpus)
+	: m_pinned(false)
+{
+	if (cpus.empty())
+		return;
+
+#ifdef _WIN32
+	DWORD_PTR mask = affinity_mask(cpus);
+	DWORD_PTR old_mask = mask ? SetThreadAffinityMask(GetCurrentThread(), mask) : 0;
+	if (old_mask)
+	{
+		m_saved.resize(sizeof(old_mask));
+		memcpy(&m_saved[0], &old_mask, sizeof(old_mask));
+		m_pinned = true;
+	}
+#elif defined(__linux__)
+	cpu_set_t old_mask;
+	if (pthread_getaffinity_np(pthread_self(), sizeof(old_mask), &old_mask) == 0 && set_affinity(cpus))
+	{
+		m_saved.resize(sizeof(old_mask));
+		memcpy(&m_saved[0], &old_mask, sizeof(old_mask));
+		m_pinned = true;
+	}
+#endif
+}
+
+scoped_thread_affinity::~scoped_thread_affinity()
+{
+	if (!m_pinned)
+		return;
+
+#ifdef _WIN32
+	DWORD_PTR old_mask;
+	memcpy(&old_mask, &m_saved[0], sizeof(old_mask));
+	SetThreadAffinityMask(GetCurrentThread(), old_mask);
+#elif defined(__linux__)
+	cpu_set_t old_mask;
+	memcpy(&old_mask, &m_saved[0], sizeof(old_mask));
+	pthread_setaffinity_np(pthread_self(), sizeof(old_mask), &old_mask);
+#endif
+}
+
+node_buffer::node_buffer()
+	: m_data(NULL)
+	, m_capacity(0)
+	, m_mapped(false)
+{
+}
+
+node_buffer::~node_buffer()
+{
+	release();
+}
+
+void node_buffer::reserve(std::size_t size, int node)
+{
+	if (size <= m_capacity)
+		return;
+
+	release();
+
+	// 用整页的映射, 地址对齐满足 SIMD 的要求.
+#ifdef _WIN32
+	// VirtualAllocExNuma 从 Vista 开始才有, 工程按 XP 的 _WIN32_WINNT 编译, 运行时找不到就用 VirtualAlloc.
+	typedef LPVOID (WINAPI *virtual_alloc_ex_numa_fn)(HANDLE, LPVOID, SIZE_T, DWORD, DWORD, DWORD);
+	virtual_alloc_ex_numa_fn virtual_alloc_ex_numa = node >= 0 ? reinterpret_cast<virtual_alloc_ex_numa_fn>(
+		GetProcAddress(GetModuleHandleA("kernel32.dll"), "VirtualAllocExNuma")) : NULL;
+	if (virtual_alloc_ex_numa)
+		m_data = static_cast<uint8_t*>(virtual_alloc_ex_numa(GetCurrentProcess(), NULL, size,
+			MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node));
+	else
+		m_data = static_cast<uint8_t*>(VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+	m_mapped = m_data != NULL;
+#elif defined(__linux__)
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+	{
+		if (node >= 0 && node < 255)
+		{
+			// MPOL_PREFERRED: 优先从这个节点分配, 节点内存不够时退回别的节点.
+			const int mpol_preferred = 1;
+			unsigned long nodemask[256 / (sizeof(unsigned long) * 8)] = { 0 };
+			nodemask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+			syscall(SYS_mbind, p, size, mpol_preferred, nodemask, 256UL, 0);
+		}
+		m_data = static_cast<uint8_t*>(p);
+		m_mapped = true;
+	}
+#endif
+
+	if (!m_data)
+	{
+		m_data = static_cast<uint8_t*>(calloc(1, size));
+		m_mapped = false;
+		if (!m_data)
+			throw std::bad_alloc();
+	}
+	m_capacity = size;
+}
+
+void node_buffer::release()
+{
+	if (!m_data)
+		return;
+
+	if (m_mapped)
+	{
+#ifdef _WIN32
+		VirtualFree(m_data, 0, MEM_RELEASE);
+#elif defined(__linux__)
+		munmap(m_data, m_capacity);
+#endif
+	}
+	else
+	{
+		free(m_data);
+	}
+	m_data = NULL;
+	m_capacity = 0;
+	m_mapped = false;
+}
+
+}
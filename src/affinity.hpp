@@ -0,0 +1,73 @@
+﻿
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+namespace libencoder {
+
+// 一组 cpu 编号, 用 "0-7,16-23" 这样的字符串描述.
+class cpu_set
+{
+public:
+	cpu_set() {}
+
+	// 解析失败返回 false, 空字符串表示不绑定.
+	bool parse(const std::string& str);
+
+	bool empty() const { return m_cpus.empty(); }
+	int size() const { return static_cast<int>(m_cpus.size()); }
+	const std::vector<int>& cpus() const { return m_cpus; }
+
+	std::string to_string() const;
+
+	// 这组 cpu 所在的 NUMA 节点, 取第一个 cpu 所在的节点, 不知道的时候返回 -1.
+	int numa_node() const;
+
+private:
+	std::vector<int> m_cpus;
+};
+
+// 把当前线程绑定到 cpus 上, cpus 为空时什么也不做.
+bool pin_current_thread(const cpu_set& cpus);
+
+// 在作用域内把当前线程绑定到 cpus, 离开作用域时恢复.
+// Linux 上这期间创建的线程 (例如 x264 的工作线程) 会继承这个绑定.
+class scoped_thread_affinity : public boost::noncopyable
+{
+public:
+	explicit scoped_thread_affinity(const cpu_set& cpus);
+	~scoped_thread_affinity();
+
+private:
+	bool m_pinned;
+	std::vector<unsigned char> m_saved;
+};
+
+// 在指定 NUMA 节点上分配的内存, node 为 -1 时就是普通的对齐内存.
+class node_buffer : public boost::noncopyable
+{
+public:
+	node_buffer();
+	~node_buffer();
+
+	// 容量不够时重新分配, 原有内容不保留, 新分配的内存全部为 0.
+	void reserve(std::size_t size, int node);
+
+	uint8_t* data() { return m_data; }
+	std::size_t capacity() const { return m_capacity; }
+
+private:
+	void release();
+
+private:
+	uint8_t* m_data;
+	std::size_t m_capacity;
+	bool m_mapped;
+};
+
+}
@@ -0,0 +1,876 @@
+﻿
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "batch.hpp"
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/mathematics.h"
+}
+
+namespace libencoder {
+
+// 读取线程最多领先编码线程多少帧.
+static const int readahead_frames = 8;
+// 并行编码时每一段的 x264 线程数, 单个 x264 超过 4 到 8 个线程之后扩展性就不好了.
+static const int threads_per_chunk = 4;
+// 自动分段时, 段数是同时编码段数的多少倍, 多分几段让各线程的负载更均匀.
+static const int chunks_per_worker = 2;
+// 预读时每一页摸一下, 让缺页发生在读取线程上.
+static const std::size_t page_size = 4096;
+
+// 只读映射整个文件.
+class mapped_file : public boost::noncopyable
+{
+public:
+	explicit mapped_file(const std::string& path)
+	{
+		try
+		{
+			boost::interprocess::file_mapping file(path.c_str(), boost::interprocess::read_only);
+			boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+			m_region.swap(region);
+		}
+		catch (boost::interprocess::interprocess_exception& e)
+		{
+			throw std::runtime_error("Could not map " + path + ": " + e.what());
+		}
+		// 顺序读, 让内核多预读一些.
+		m_region.advise(boost::interprocess::mapped_region::advice_sequential);
+	}
+
+	const uint8_t* data() const { return static_cast<const uint8_t*>(m_region.get_address()); }
+	std::size_t size() const { return m_region.get_size(); }
+
+private:
+	boost::interprocess::mapped_region m_region;
+};
+
+class video_file : public boost::noncopyable
+{
+public:
+	video_file(const batch_input& input)
+		: m_file(input.video_path)
+		, m_yuv(false)
+		, m_width(input.width)
+		, m_height(input.height)
+		, m_fps_num(input.fps_num)
+		, m_fps_den(input.fps_den)
+		, m_frame_size(0)
+		, m_offset(0)
+	{
+		batch_video_format format = input.format;
+		if (format == batch_format_auto)
+		{
+			std::string ext = boost::filesystem::path(input.video_path).extension().string();
+			format = ext == ".y4m" ? batch_format_y4m : batch_format_bgr0;
+		}
+
+		if (format == batch_format_y4m)
+		{
+			parse_y4m_header();
+			m_yuv = true;
+			m_frame_size = static_cast<std::size_t>(m_width) * m_height + 2 * chroma_size();
+		}
+		else
+		{
+			if (m_width <= 0 || m_height <= 0 || m_fps_num <= 0 || m_fps_den <= 0)
+				throw std::runtime_error("raw BGR0 input needs width, height and fps");
+			m_frame_size = static_cast<std::size_t>(m_width) * m_height * 4;
+		}
+	}
+
+	bool yuv() const { return m_yuv; }
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	int fps_num() const { return m_fps_num; }
+	int fps_den() const { return m_fps_den; }
+
+	// 估计的帧数, Y4M 的帧头一般没有参数, 按最短的帧头算.
+	int64_t frames() const
+	{
+		std::size_t header = m_yuv ? 6 : 0;
+		return static_cast<int64_t>((m_file.size() - m_offset) / (m_frame_size + header));
+	}
+
+	// 顺序取出下一帧, 到文件尾返回 NULL.
+	const uint8_t* next()
+	{
+		if (m_yuv)
+		{
+			// 每帧以 "FRAME" 开头, 后面可能有参数, 到换行为止.
+			if (m_offset + 5 > m_file.size() || memcmp(m_file.data() + m_offset, "FRAME", 5) != 0)
+				return NULL;
+			const uint8_t* eol = static_cast<const uint8_t*>(memchr(m_file.data() + m_offset, '\n', m_file.size() - m_offset));
+			if (!eol)
+				return NULL;
+			m_offset = eol + 1 - m_file.data();
+		}
+
+		if (m_offset + m_frame_size > m_file.size())
+			return NULL;
+
+		const uint8_t* frame = m_file.data() + m_offset;
+		m_offset += m_frame_size;
+		return frame;
+	}
+
+	std::size_t frame_size() const { return m_frame_size; }
+
+	// 建立每一帧的偏移, 之后可以用 frame 随机访问. 返回帧数.
+	int64_t build_index()
+	{
+		std::size_t saved = m_offset;
+		m_index.clear();
+		for (const uint8_t* f = next(); f; f = next())
+			m_index.push_back(f - m_file.data());
+		m_offset = saved;
+		return static_cast<int64_t>(m_index.size());
+	}
+
+	// 第 i 帧, 要先调用 build_index, 可以在多个线程里同时调用.
+	const uint8_t* frame(int64_t i) const
+	{
+		return m_file.data() + m_index[static_cast<std::size_t>(i)];
+	}
+
+	// YUV420P 各平面的起点.
+	void planes(const uint8_t* frame, const uint8_t* data[3], int linesize[3]) const
+	{
+		data[0] = frame;
+		data[1] = frame + m_width * m_height;
+		data[2] = data[1] + chroma_size();
+		linesize[0] = m_width;
+		linesize[1] = linesize[2] = (m_width + 1) / 2;
+	}
+
+private:
+	std::size_t chroma_size() const
+	{
+		return static_cast<std::size_t>((m_width + 1) / 2) * ((m_height + 1) / 2);
+	}
+
+	void parse_y4m_header()
+	{
+		const char* begin = reinterpret_cast<const char*>(m_file.data());
+		const char* eol = static_cast<const char*>(memchr(begin, '\n', std::min<std::size_t>(m_file.size(), 1024)));
+		if (m_file.size() < 10 || memcmp(begin, "YUV4MPEG2 ", 10) != 0 || !eol)
+			throw std::runtime_error("not a YUV4MPEG2 file");
+
+		std::string header(begin, eol);
+		m_offset = eol + 1 - begin;
+
+		std::string::size_type pos = 0;
+		while (pos < header.size())
+		{
+			std::string::size_type end = header.find(' ', pos);
+			if (end == std::string::npos)
+				end = header.size();
+			std::string token = header.substr(pos, end - pos);
+			pos = end + 1;
+
+			if (token.empty())
+				continue;
+			try
+			{
+				switch (token[0])
+				{
+				case 'W':
+					m_width = boost::lexical_cast<int>(token.substr(1));
+					break;
+				case 'H':
+					m_height = boost::lexical_cast<int>(token.substr(1));
+					break;
+				case 'F':
+				{
+					std::string::size_type colon = token.find(':');
+					m_fps_num = boost::lexical_cast<int>(token.substr(1, colon - 1));
+					m_fps_den = colon == std::string::npos ? 1 : boost::lexical_cast<int>(token.substr(colon + 1));
+					break;
+				}
+				case 'C':
+					if (token.compare(0, 4, "C420") != 0)
+						throw std::runtime_error("only 4:2:0 YUV4MPEG2 is supported, got " + token);
+					break;
+				}
+			}
+			catch (boost::bad_lexical_cast&)
+			{
+				throw std::runtime_error("bad YUV4MPEG2 header field " + token);
+			}
+		}
+
+		if (m_width <= 0 || m_height <= 0 || m_fps_num <= 0 || m_fps_den <= 0)
+			throw std::runtime_error("YUV4MPEG2 header lacks size or frame rate");
+	}
+
+private:
+	mapped_file m_file;
+	bool m_yuv;
+	int m_width;
+	int m_height;
+	int m_fps_num;
+	int m_fps_den;
+	std::size_t m_frame_size;
+	std::size_t m_offset;
+	std::vector<std::size_t> m_index;
+};
+
+class wav_file : public boost::noncopyable
+{
+public:
+	explicit wav_file(const std::string& path)
+		: m_file(path)
+		, m_channels(0)
+		, m_sample_rate(0)
+		, m_data(NULL)
+		, m_samples(0)
+	{
+		const uint8_t* p = m_file.data();
+		std::size_t size = m_file.size();
+		if (size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0)
+			throw std::runtime_error("not a RIFF/WAVE file: " + path);
+
+		int bits = 0;
+		std::size_t offset = 12;
+		while (offset + 8 <= size)
+		{
+			const uint8_t* chunk = p + offset;
+			std::size_t chunk_size = AV_RL32(chunk + 4);
+			std::size_t body = offset + 8;
+
+			if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && body + 16 <= size)
+			{
+				int tag = AV_RL16(p + body);
+				m_channels = AV_RL16(p + body + 2);
+				m_sample_rate = AV_RL32(p + body + 4);
+				bits = AV_RL16(p + body + 14);
+				// WAVE_FORMAT_EXTENSIBLE 也可能是 PCM.
+				if (tag != 1 && tag != 0xFFFE)
+					throw std::runtime_error("only PCM WAV is supported: " + path);
+			}
+			else if (memcmp(chunk, "data", 4) == 0)
+			{
+				// 写了一半的文件 data 的长度可能不对, 以文件实际大小为准.
+				chunk_size = std::min(chunk_size, size - body);
+				m_data = p + body;
+				if (m_channels > 0)
+					m_samples = static_cast<int64_t>(chunk_size / (2 * m_channels));
+				break;
+			}
+			offset = body + chunk_size + (chunk_size & 1);
+		}
+
+		if (!m_data || bits != 16 || m_channels < 1 || m_channels > 2 || m_sample_rate <= 0)
+			throw std::runtime_error("need a 16 bit mono or stereo PCM WAV: " + path);
+	}
+
+	int channels() const { return m_channels; }
+	int sample_rate() const { return m_sample_rate; }
+	int64_t samples() const { return m_samples; }
+	const uint8_t* data() const { return m_data; }
+
+private:
+	mapped_file m_file;
+	int m_channels;
+	int m_sample_rate;
+	const uint8_t* m_data;
+	int64_t m_samples;
+};
+
+batch_runner::batch_runner(const batch_input& input)
+	: m_input(input)
+	, m_audio_pos(0)
+{
+	m_video.reset(new video_file(input));
+	if (!input.audio_path.empty())
+		m_audio.reset(new wav_file(input.audio_path));
+
+	m_probe.width = m_video->width();
+	m_probe.height = m_video->height();
+	m_probe.fps_num = m_video->fps_num();
+	m_probe.fps_den = m_video->fps_den();
+	m_probe.frames = m_video->frames();
+	m_probe.sample_rate = m_audio ? m_audio->sample_rate() : 0;
+	m_probe.channels = m_audio ? m_audio->channels() : 0;
+}
+
+batch_runner::~batch_runner()
+{
+}
+
+namespace {
+
+// 把文件里的一帧转换缩放到 dst, 失败时返回 false.
+bool convert_frame(frame_scaler& scaler, const video_file& video, const uint8_t* data,
+	uint8_t* const dst[], const int dst_linesize[], int out_width, int out_height)
+{
+	if (!video.yuv())
+		return scaler.scale_bgr0(data, video.width() * 4, video.width(), video.height(), dst, dst_linesize, out_width, out_height);
+
+	const uint8_t* src[3];
+	int src_linesize[3];
+	video.planes(data, src, src_linesize);
+	return scaler.scale_yuv420(src, src_linesize, video.width(), video.height(), dst, dst_linesize, out_width, out_height);
+}
+
+// 读取线程准备好的一帧.
+struct ready_frame
+{
+	ready_frame()
+		: timestamp(0)
+	{
+		memset(planes, 0, sizeof(planes));
+		memset(linesize, 0, sizeof(linesize));
+	}
+
+	int64_t timestamp;
+	const uint8_t* planes[3];
+	int linesize[3];
+	// 需要转换时的输出缓冲, 不需要转换时 planes 直接指向映射的文件.
+	std::vector<uint8_t> buffer;
+};
+
+// 读取线程和编码线程之间的有界队列.
+class frame_queue : public boost::noncopyable
+{
+public:
+	frame_queue()
+		: m_done(false)
+		, m_cancelled(false)
+	{
+	}
+
+	// 空闲的帧缓冲, 没有时阻塞. 取消之后返回 NULL.
+	ready_frame* acquire()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		while (m_free.empty() && !m_cancelled)
+			m_cond.wait(l);
+		if (m_cancelled)
+			return NULL;
+		ready_frame* f = m_free.front();
+		m_free.pop_front();
+		return f;
+	}
+
+	void recycle(ready_frame* f)
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_free.push_back(f);
+		m_cond.notify_all();
+	}
+
+	void push(ready_frame* f)
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_ready.push_back(f);
+		m_cond.notify_all();
+	}
+
+	// 下一帧, 读完了返回 NULL.
+	ready_frame* pop()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		while (m_ready.empty() && !m_done)
+			m_cond.wait(l);
+		if (m_ready.empty())
+			return NULL;
+		ready_frame* f = m_ready.front();
+		m_ready.pop_front();
+		return f;
+	}
+
+	void finish(const std::string& error = std::string())
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_done = true;
+		m_error = error;
+		m_cond.notify_all();
+	}
+
+	void cancel()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_cancelled = true;
+		m_cond.notify_all();
+	}
+
+	std::string error()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		return m_error;
+	}
+
+private:
+	boost::mutex m_mutex;
+	boost::condition_variable m_cond;
+	std::deque<ready_frame*> m_free;
+	std::deque<ready_frame*> m_ready;
+	bool m_done;
+	bool m_cancelled;
+	std::string m_error;
+};
+
+struct reader_context
+{
+	video_file* video;
+	frame_queue* queue;
+	int out_width;
+	int out_height;
+	int out_fps;
+	scale_filter filter;
+};
+
+void read_frames(reader_context ctx)
+{
+	video_file& video = *ctx.video;
+	frame_scaler scaler(ctx.filter);
+
+	// 和编码器用同样的网格做同样的取舍, 编码器会丢掉的帧这里就不转换了.
+	frame_governor governor(ctx.out_fps);
+	bool direct = video.yuv() && video.width() == ctx.out_width && video.height() == ctx.out_height;
+
+	try
+	{
+		for (int64_t i = 0; ; i++)
+		{
+			const uint8_t* data = video.next();
+			if (!data)
+				break;
+
+			int64_t timestamp = av_rescale(i, static_cast<int64_t>(AV_TIME_BASE) * video.fps_den(), video.fps_num());
+			if (!governor.admit(timestamp).encode)
+				continue;
+
+			ready_frame* f = ctx.queue->acquire();
+			if (!f)
+				break;
+			f->timestamp = timestamp;
+
+			if (direct)
+			{
+				// 不用转换, 只把这一帧的页预读进来.
+				volatile uint8_t sink = 0;
+				for (std::size_t off = 0; off < video.frame_size(); off += page_size)
+					sink += data[off];
+				video.planes(data, f->planes, f->linesize);
+			}
+			else
+			{
+				f->buffer.resize(avpicture_get_size(AV_PIX_FMT_YUV420P, ctx.out_width, ctx.out_height));
+				uint8_t* dst[4];
+				int dst_linesize[4];
+				av_image_fill_arrays(dst, dst_linesize, f->buffer.data(), AV_PIX_FMT_YUV420P, ctx.out_width, ctx.out_height, 1);
+				if (!convert_frame(scaler, video, data, dst, dst_linesize, ctx.out_width, ctx.out_height))
+					throw std::runtime_error("Could not create the conversion context");
+
+				for (int p = 0; p < 3; p++)
+				{
+					f->planes[p] = dst[p];
+					f->linesize[p] = dst_linesize[p];
+				}
+			}
+			ctx.queue->push(f);
+		}
+		ctx.queue->finish();
+	}
+	catch (std::exception& e)
+	{
+		ctx.queue->finish(e.what());
+	}
+}
+
+}
+
+batch_result batch_runner::run(encoder& enc, int out_width, int out_height, int out_fps)
+{
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+
+	m_audio_pos = 0;
+	batch_result result = m_input.parallel
+		? run_chunked(enc, out_width, out_height, out_fps)
+		: run_sequential(enc, out_width, out_height, out_fps);
+
+	// 剩下的音频, 然后写文件尾.
+	if (m_audio)
+		feed_audio(enc, av_rescale(m_audio->samples(), AV_TIME_BASE, m_audio->sample_rate()));
+	enc.flush_and_write_tailer();
+
+	result.audio_samples = m_audio_pos;
+	result.elapsed_seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+void batch_runner::feed_audio(encoder& enc, int64_t until)
+{
+	if (!m_audio)
+		return;
+
+	// 单声道扩成立体声, 每次最多送 100ms.
+	const int64_t chunk = m_audio->sample_rate() / 10;
+	int64_t end = std::min(m_audio->samples(), av_rescale(until, m_audio->sample_rate(), AV_TIME_BASE));
+	while (m_audio_pos < end)
+	{
+		int64_t n = std::min(chunk, end - m_audio_pos);
+		const uint8_t* pcm = m_audio->data() + m_audio_pos * 2 * m_audio->channels();
+		if (m_audio->channels() == 1)
+		{
+			m_stereo.resize(static_cast<std::size_t>(n) * 4);
+			const int16_t* in = reinterpret_cast<const int16_t*>(pcm);
+			int16_t* out = reinterpret_cast<int16_t*>(m_stereo.data());
+			for (int64_t i = 0; i < n; i++)
+				out[2 * i] = out[2 * i + 1] = in[i];
+			pcm = m_stereo.data();
+		}
+		enc.do_audio_frame(const_cast<uint8_t*>(pcm), static_cast<long>(n * 4), -1);
+		m_audio_pos += n;
+	}
+}
+
+batch_result batch_runner::run_sequential(encoder& enc, int out_width, int out_height, int out_fps)
+{
+	batch_result result = batch_result();
+	frame_queue queue;
+	ready_frame frames[readahead_frames];
+	for (int i = 0; i < readahead_frames; i++)
+		queue.recycle(&frames[i]);
+
+	reader_context ctx = { m_video.get(), &queue, out_width, out_height, out_fps, enc.video_scale_filter() };
+	boost::thread reader(boost::bind(&read_frames, ctx));
+
+	int64_t frame_duration = av_rescale(AV_TIME_BASE, m_video->fps_den(), m_video->fps_num());
+
+	try
+	{
+		for (;;)
+		{
+			ready_frame* f = queue.pop();
+			if (!f)
+				break;
+
+			// 音频按视频的进度交错送进去.
+			feed_audio(enc, f->timestamp + frame_duration);
+
+			enc.do_yuv_frame(f->planes, f->linesize, out_width, out_height, f->timestamp);
+			result.video_frames++;
+			result.media_seconds = (f->timestamp + frame_duration) / static_cast<double>(AV_TIME_BASE);
+			queue.recycle(f);
+		}
+	}
+	catch (...)
+	{
+		queue.cancel();
+		reader.join();
+		throw;
+	}
+	reader.join();
+
+	std::string error = queue.error();
+	if (!error.empty())
+		throw std::runtime_error(error);
+	return result;
+}
+
+namespace {
+
+// 输出的一帧: 取输入的第几帧, 输出时间戳 (微秒). 补出来的帧重复引用前一个输入帧.
+struct output_frame
+{
+	int64_t input;
+	int64_t timestamp;
+};
+
+struct chunk
+{
+	chunk()
+		: first(0)
+		, last(0)
+		, done(false)
+	{}
+
+	~chunk()
+	{
+		clear();
+	}
+
+	void clear()
+	{
+		for (std::size_t i = 0; i < packets.size(); i++)
+		{
+			av_packet_unref(packets[i]);
+			delete packets[i];
+		}
+		packets.clear();
+	}
+
+	// 输出帧的范围 [first, last).
+	std::size_t first;
+	std::size_t last;
+	std::vector<AVPacket*> packets;
+	bool done;
+	std::string error;
+};
+
+// 编码线程共享的状态.
+struct chunk_jobs : public boost::noncopyable
+{
+	chunk_jobs()
+		: next(0)
+		, written(0)
+		, max_ahead(0)
+		, cancelled(false)
+	{}
+
+	encoder* enc;
+	video_file* video;
+	const std::vector<output_frame>* frames;
+	std::vector<chunk> chunks;
+	int out_width;
+	int out_height;
+
+	boost::mutex mutex;
+	boost::condition_variable cond;
+	std::size_t next;
+	// 已经写入复用器的段数, 编码线程最多领先 max_ahead 段, 免得编码好的包堆积太多.
+	std::size_t written;
+	std::size_t max_ahead;
+	bool cancelled;
+};
+
+// 在独立的编码器上编码一段, 包按顺序留在 c.packets 里.
+void encode_chunk(chunk_jobs& jobs, chunk& c)
+{
+	video_file& video = *jobs.video;
+	const std::vector<output_frame>& frames = *jobs.frames;
+	bool direct = video.yuv() && video.width() == jobs.out_width && video.height() == jobs.out_height;
+
+	AVCodecContext* ctx = jobs.enc->open_video_codec(threads_per_chunk);
+	AVFrame* frame = av_frame_alloc();
+	frame_scaler scaler(jobs.enc->video_scale_filter());
+	std::vector<uint8_t> buffer;
+	encode_pipe pipe(ctx);
+
+	try
+	{
+		if (!frame)
+			throw std::bad_alloc();
+
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = jobs.out_width;
+		frame->height = jobs.out_height;
+		if (!direct)
+		{
+			buffer.resize(avpicture_get_size(AV_PIX_FMT_YUV420P, jobs.out_width, jobs.out_height));
+			avpicture_fill(reinterpret_cast<AVPicture*>(frame), buffer.data(), AV_PIX_FMT_YUV420P, jobs.out_width, jobs.out_height);
+		}
+
+		int64_t converted = -1;
+		for (std::size_t i = c.first; i <= c.last; i++)
+		{
+			const AVFrame* input = NULL;
+			if (i < c.last)
+			{
+				const output_frame& f = frames[i];
+				const uint8_t* data = video.frame(f.input);
+
+				if (direct)
+				{
+					video.planes(data, const_cast<const uint8_t**>(frame->data), frame->linesize);
+				}
+				else if (f.input != converted)
+				{
+					if (!convert_frame(scaler, video, data, frame->data, frame->linesize, jobs.out_width, jobs.out_height))
+						throw std::runtime_error("Could not create the conversion context");
+					converted = f.input;
+				}
+
+				// 和实时编码一样, 编码器的 time_base 是 1/10000 秒.
+				frame->pts = f.timestamp / 100;
+				input = frame;
+			}
+
+			// 最后一次送 NULL, 取出编码器里 delay 的帧.
+			int ret = pipe.send_frame(input);
+			if (ret < 0 && ret != AVERROR_EOF)
+				throw std::runtime_error("Video encoding failed!");
+
+			for (;;)
+			{
+				AVPacket* pkt = new AVPacket;
+				av_init_packet(pkt);
+				pkt->data = NULL;
+				pkt->size = 0;
+
+				ret = pipe.receive_packet(pkt);
+				if (ret < 0)
+				{
+					delete pkt;
+					break;
+				}
+				c.packets.push_back(pkt);
+			}
+			if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+				throw std::runtime_error("Video encoding failed!");
+		}
+	}
+	catch (std::exception& e)
+	{
+		c.error = e.what();
+	}
+
+	pipe.reset(NULL);
+	av_frame_free(&frame);
+	avcodec_free_context(&ctx);
+}
+
+void chunk_worker(chunk_jobs* jobs)
+{
+	for (;;)
+	{
+		std::size_t index;
+		{
+			boost::mutex::scoped_lock l(jobs->mutex);
+			while (!jobs->cancelled && jobs->next < jobs->chunks.size() && jobs->next >= jobs->written + jobs->max_ahead)
+				jobs->cond.wait(l);
+			if (jobs->cancelled || jobs->next >= jobs->chunks.size())
+				return;
+			index = jobs->next++;
+		}
+
+		chunk& c = jobs->chunks[index];
+		try
+		{
+			encode_chunk(*jobs, c);
+		}
+		catch (std::exception& e)
+		{
+			c.error = e.what();
+		}
+
+		boost::mutex::scoped_lock l(jobs->mutex);
+		c.done = true;
+		jobs->cond.notify_all();
+	}
+}
+
+}
+
+batch_result batch_runner::run_chunked(encoder& enc, int out_width, int out_height, int out_fps)
+{
+	batch_result result = batch_result();
+
+	// 先按帧率网格决定每个输出帧用哪个输入帧, 和实时编码时 frame_governor 的取舍一致.
+	int64_t input_frames = m_video->build_index();
+	std::vector<output_frame> frames;
+	frames.reserve(static_cast<std::size_t>(input_frames));
+	frame_governor governor(out_fps);
+	for (int64_t i = 0; i < input_frames; i++)
+	{
+		int64_t timestamp = av_rescale(i, static_cast<int64_t>(AV_TIME_BASE) * m_video->fps_den(), m_video->fps_num());
+		frame_governor::decision d = governor.admit(timestamp);
+		if (!d.encode)
+			continue;
+		for (int k = 0; k < d.duplicates && !frames.empty(); k++)
+		{
+			output_frame dup = { frames.back().input, governor.slot_timestamp(d.duplicate_slot + k) };
+			frames.push_back(dup);
+		}
+		output_frame f = { i, d.timestamp };
+		frames.push_back(f);
+	}
+	if (frames.empty())
+		return result;
+
+	// 按核预算决定同时编码几段, 段的边界都在 GOP 的边界上.
+	const video_config& vc = enc.video_settings();
+	std::size_t gop = vc.gop > 0 ? vc.gop : static_cast<std::size_t>(vc.fps * 15);
+	gop = std::max<std::size_t>(gop, 1);
+	int workers = std::max(1, scheduler::instance().core_budget() / threads_per_chunk);
+
+	std::size_t total_gops = (frames.size() + gop - 1) / gop;
+	std::size_t chunk_gops = m_input.chunk_gops > 0
+		? static_cast<std::size_t>(m_input.chunk_gops)
+		: std::max<std::size_t>(1, (total_gops + workers * chunks_per_worker - 1) / (workers * chunks_per_worker));
+	std::size_t chunk_frames = chunk_gops * gop;
+
+	chunk_jobs jobs;
+	jobs.enc = &enc;
+	jobs.video = m_video.get();
+	jobs.frames = &frames;
+	jobs.out_width = out_width;
+	jobs.out_height = out_height;
+	jobs.chunks.resize((frames.size() + chunk_frames - 1) / chunk_frames);
+	for (std::size_t i = 0; i < jobs.chunks.size(); i++)
+	{
+		jobs.chunks[i].first = i * chunk_frames;
+		jobs.chunks[i].last = std::min(frames.size(), (i + 1) * chunk_frames);
+	}
+	workers = static_cast<int>(std::min<std::size_t>(workers, jobs.chunks.size()));
+	jobs.max_ahead = workers * chunks_per_worker;
+
+	boost::thread_group threads;
+	for (int i = 0; i < workers; i++)
+		threads.create_thread(boost::bind(&chunk_worker, &jobs));
+
+	// 按顺序把各段的包写进同一个文件. 各段的编码参数相同, B 帧造成的 DTS 偏移也相同,
+	// 所以直接用绝对时间戳拼起来, DTS 仍然单调连续.
+	std::string error;
+	for (std::size_t i = 0; i < jobs.chunks.size() && error.empty(); i++)
+	{
+		chunk& c = jobs.chunks[i];
+		{
+			boost::mutex::scoped_lock l(jobs.mutex);
+			while (!c.done)
+				jobs.cond.wait(l);
+		}
+
+		if (!c.error.empty())
+		{
+			error = c.error;
+			break;
+		}
+
+		for (std::size_t k = 0; k < c.packets.size(); k++)
+		{
+			AVPacket* pkt = c.packets[k];
+			if (pkt->pts != AV_NOPTS_VALUE)
+				feed_audio(enc, pkt->pts * 100);
+			enc.do_video_packet(pkt);
+		}
+		c.clear();
+
+		boost::mutex::scoped_lock l(jobs.mutex);
+		jobs.written = i + 1;
+		jobs.cond.notify_all();
+	}
+
+	{
+		boost::mutex::scoped_lock l(jobs.mutex);
+		jobs.cancelled = true;
+		jobs.cond.notify_all();
+	}
+	threads.join_all();
+
+	if (!error.empty())
+		throw std::runtime_error(error);
+
+	const output_frame& last = frames.back();
+	result.video_frames = static_cast<int64_t>(frames.size());
+	result.media_seconds = (last.timestamp + av_rescale(AV_TIME_BASE, 1, out_fps)) / static_cast<double>(AV_TIME_BASE);
+	result.chunks = static_cast<int>(jobs.chunks.size());
+	result.workers = workers;
+	return result;
+}
+
+}
@@ -0,0 +1,107 @@
+﻿
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "encoder.hpp"
+
+namespace libencoder {
+
+enum batch_video_format
+{
+	batch_format_auto,
+	// YUV4MPEG2, 只支持 4:2:0.
+	batch_format_y4m,
+	// 没有文件头的 BGR0, 尺寸和帧率由调用方给出.
+	batch_format_bgr0,
+};
+
+struct batch_input
+{
+	batch_input()
+		: format(batch_format_auto)
+		, width(0)
+		, height(0)
+		, fps_num(0)
+		, fps_den(1)
+		, parallel(false)
+		, chunk_gops(0)
+	{}
+
+	std::string video_path;
+	batch_video_format format;
+	// 裸 BGR0 文件的尺寸和帧率, Y4M 从文件头读.
+	int width;
+	int height;
+	int fps_num;
+	int fps_den;
+
+	// 16 位 PCM 的 WAV 文件, 可以为空.
+	std::string audio_path;
+
+	// 按 GOP 切成若干段, 各段用独立的编码器并行编码, 再按顺序拼起来.
+	bool parallel;
+	// 每段的 GOP 数, 0 表示按核数自动决定.
+	int chunk_gops;
+};
+
+// 输入文件的参数, 创建编码器之前用来补全配置.
+struct batch_probe
+{
+	int width;
+	int height;
+	int fps_num;
+	int fps_den;
+	int64_t frames;
+	// 没有音频文件时为 0.
+	int sample_rate;
+	int channels;
+};
+
+struct batch_result
+{
+	int64_t video_frames;
+	int64_t audio_samples;
+	// 并行编码时的段数和同时编码的段数, 顺序编码时为 0.
+	int chunks;
+	int workers;
+	// 输出的媒体时长和实际用掉的时间.
+	double media_seconds;
+	double elapsed_seconds;
+};
+
+class video_file;
+class wav_file;
+
+// 离线转码: 把文件映射到内存, 读取和格式转换放在单独的线程上, 和编码重叠,
+// 编码器收多快就喂多快. 出错抛出 std::runtime_error.
+class batch_runner : public boost::noncopyable
+{
+public:
+	explicit batch_runner(const batch_input& input);
+	~batch_runner();
+
+	const batch_probe& probe() const { return m_probe; }
+
+	// 编码完所有的帧并写入文件尾, encoder 的输出帧率决定丢帧和补帧.
+	batch_result run(encoder& enc, int out_width, int out_height, int out_fps);
+
+private:
+	batch_result run_sequential(encoder& enc, int out_width, int out_height, int out_fps);
+	batch_result run_chunked(encoder& enc, int out_width, int out_height, int out_fps);
+
+	// 把音频送到 until (微秒) 为止.
+	void feed_audio(encoder& enc, int64_t until);
+
+private:
+	batch_input m_input;
+	int64_t m_audio_pos;
+	std::vector<uint8_t> m_stereo;
+
+	boost::scoped_ptr<video_file> m_video;
+	boost::scoped_ptr<wav_file> m_audio;
+	batch_probe m_probe;
+};
+
+}
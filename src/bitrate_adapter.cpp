@@ -0,0 +1,124 @@
+﻿
+#include <algorithm>
+#include <cstdlib>
+
+#include "bitrate_adapter.hpp"
+
+namespace libencoder {
+
+static const int64_t window_us = 500000;
+// 写出时间少于 1 毫秒时算不出输出能力, 当作输出没有成为瓶颈.
+static const int64_t min_busy_us = 1000;
+static const int64_t high_delay_ms = 500;
+static const int64_t low_delay_ms = 100;
+// 降码率之后等积压排掉再看, 升码率要求这么长时间内都没有积压.
+static const int64_t down_hold_us = 2000000;
+static const int64_t up_hold_us = 8000000;
+
+bitrate_adapter::bitrate_adapter()
+	: m_min_kbps(0)
+	, m_max_kbps(0)
+	, m_window_start(-1)
+	, m_window_bytes(0)
+	, m_window_busy(0)
+	, m_last_change(0)
+	, m_last_congested(0)
+	, m_bitrate(0)
+	, m_drain(0)
+	, m_queued(0)
+	, m_queue_delay(0)
+	, m_step_downs(0)
+	, m_step_ups(0)
+{
+}
+
+void bitrate_adapter::reset(int min_kbps, int max_kbps, int start_kbps)
+{
+	m_min_kbps = min_kbps;
+	m_max_kbps = max_kbps;
+	m_window_start = -1;
+	m_bitrate = max_kbps > 0 ? clamp(start_kbps) : start_kbps;
+	m_drain = 0;
+}
+
+int bitrate_adapter::clamp(int64_t kbps) const
+{
+	return static_cast<int>(std::max<int64_t>(m_min_kbps, std::min<int64_t>(m_max_kbps, kbps)));
+}
+
+int bitrate_adapter::update(int64_t now, int64_t bytes_written, int64_t write_busy, int64_t queued_bytes)
+{
+	if (!enabled())
+		return 0;
+
+	if (m_window_start < 0)
+	{
+		m_window_start = now;
+		m_window_bytes = bytes_written;
+		m_window_busy = write_busy;
+		m_last_change = m_last_congested = now;
+		return 0;
+	}
+	if (now - m_window_start < window_us)
+		return 0;
+
+	int64_t bytes = bytes_written - m_window_bytes;
+	int64_t busy = write_busy - m_window_busy;
+	m_window_start = now;
+	m_window_bytes = bytes_written;
+	m_window_busy = write_busy;
+
+	// 输出能力 = 写出的字节 / 写出所花的时间, 和当前码率无关, 不积压的时候也能估计.
+	int drain = m_drain;
+	if (busy < min_busy_us)
+		drain = 0;
+	else if (bytes > 0)
+	{
+		int estimate = static_cast<int>(std::min<int64_t>(bytes * 8 * 1000 / busy, 0x7fffffff));
+		drain = drain ? static_cast<int>((static_cast<int64_t>(drain) * 7 + static_cast<int64_t>(estimate) * 3) / 10) : estimate;
+	}
+	m_drain = drain;
+
+	// 积压按输出能力折算成排空要的时间, 估计不出来时按当前码率.
+	int current = m_bitrate;
+	int64_t delay = queued_bytes * 8 / std::max(1, drain > 0 ? drain : current);
+	bool growing = queued_bytes >= m_queued;
+	m_queued = queued_bytes;
+	m_queue_delay = delay;
+
+	// 降过码率之后积压在变少就再等等, 不要一路降到底.
+	bool congested = (delay > high_delay_ms && growing) || (drain > 0 && drain < current * 9 / 10 && delay > low_delay_ms);
+	if (congested)
+		m_last_congested = now;
+
+	int target = current;
+	if (congested && now - m_last_change >= down_hold_us)
+	{
+		int64_t down = static_cast<int64_t>(current) * 85 / 100;
+		if (drain > 0)
+			down = std::min<int64_t>(down, static_cast<int64_t>(drain) * 85 / 100);
+		target = clamp(down);
+	}
+	else if (!congested && delay < low_delay_ms && now - m_last_change >= up_hold_us && now - m_last_congested >= up_hold_us
+		&& (drain == 0 || drain > current * 5 / 4))
+	{
+		int64_t up = static_cast<int64_t>(current) * 110 / 100;
+		if (drain > 0)
+			up = std::min<int64_t>(up, static_cast<int64_t>(drain) * 85 / 100);
+		target = clamp(up);
+	}
+
+	// 变化不到 5% 不值得插一个关键帧.
+	if (std::abs(target - current) * 20 < current)
+		return 0;
+
+	if (target < current)
+		++m_step_downs;
+	else
+		++m_step_ups;
+	m_bitrate = target;
+	m_last_change = now;
+	return target;
+}
+
+}
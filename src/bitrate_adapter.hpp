@@ -0,0 +1,61 @@
+﻿
+#pragma once
+
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace libencoder {
+
+// 按输出的排空情况调整视频码率.
+// 复用线程写不动的时候 (管道, 套接字比编码慢), 包在复用队列里越积越多, 延迟跟着涨.
+// 每半秒看一次写出的字节数, 写出所花的时间和队列里积压的字节数:
+// 积压 (按输出能力折算) 超过 500 毫秒还在增长, 或者输出能力比当前码率低并且已经开始积压, 就降到输出能力的 85%;
+// 积压一直很少, 输出能力也有富余, 每隔 8 秒往上加 10%. 码率限制在 [min, max] 之内.
+class bitrate_adapter : public boost::noncopyable
+{
+public:
+	bitrate_adapter();
+
+	// max_kbps 为 0 表示不调整.
+	void reset(int min_kbps, int max_kbps, int start_kbps);
+	bool enabled() const { return m_max_kbps > 0; }
+
+	// 在编码线程里每帧调用一次, 时间都是微秒, 字节数和写出时间都是累计值.
+	// 需要换码率时返回新的码率 (kbps), 否则返回 0.
+	int update(int64_t now, int64_t bytes_written, int64_t write_busy, int64_t queued_bytes);
+
+	// 以下可以在任意线程读.
+	int bitrate() const { return m_bitrate; }
+	// 估计的输出能力, 0 表示输出没有成为瓶颈.
+	int drain_kbps() const { return m_drain; }
+	int64_t queued_bytes() const { return m_queued; }
+	int64_t queue_delay_ms() const { return m_queue_delay; }
+	int64_t step_downs() const { return m_step_downs; }
+	int64_t step_ups() const { return m_step_ups; }
+
+private:
+	int clamp(int64_t kbps) const;
+
+private:
+	int m_min_kbps;
+	int m_max_kbps;
+
+	// 上一个统计窗口的起点.
+	int64_t m_window_start;
+	int64_t m_window_bytes;
+	int64_t m_window_busy;
+	// 上一次换码率, 上一次积压的时间.
+	int64_t m_last_change;
+	int64_t m_last_congested;
+
+	boost::atomic<int> m_bitrate;
+	boost::atomic<int> m_drain;
+	boost::atomic<int64_t> m_queued;
+	boost::atomic<int64_t> m_queue_delay;
+	boost::atomic<int64_t> m_step_downs;
+	boost::atomic<int64_t> m_step_ups;
+};
+
+}
@@ -0,0 +1,134 @@
+﻿
+#include <algorithm>
+#include <sstream>
+
+#include <boost/bind.hpp>
+
+#include "codec_pool.hpp"
+#include "scheduler.hpp"
+
+namespace libencoder {
+
+codec_pool& codec_pool::instance()
+{
+	// 和 scheduler 一样故意不析构.
+	static codec_pool* pool = new codec_pool;
+	return *pool;
+}
+
+std::string codec_pool::make_key(const video_config& vc, bool global_header, bool auto_threads, const cpu_set& cpus)
+{
+	std::stringstream ss;
+	ss << vc.width << 'x' << vc.height << '@' << vc.fps << '/' << vc.fps_num << '/' << vc.fps_den
+		<< " rc=" << vc.rc_mode << ',' << vc.bit_rate << ',' << vc.max_bit_rate << ',' << vc.vbv_buffer << ',' << vc.crf
+		<< " gop=" << vc.gop << ',' << vc.bframes << ',' << vc.lookahead
+		<< " x264=" << vc.preset << ',' << vc.profile << ',' << vc.tune << ',' << vc.low_latency
+		<< " threads=" << (auto_threads ? 0 : vc.threads)
+		<< " gh=" << global_header
+		<< " cpus=" << cpus.to_string();
+	for (std::size_t i = 0; i < vc.codec_options.size(); i++)
+		ss << ' ' << vc.codec_options[i].first << '=' << vc.codec_options[i].second;
+	return ss.str();
+}
+
+void codec_pool::prewarm(const video_config& vc, bool global_header, bool auto_threads, const cpu_set& cpus, int count)
+{
+	std::string key = make_key(vc, global_header, auto_threads, cpus);
+	std::vector<AVCodecContext*> released;
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+
+		entry& e = m_entries[key];
+		e.vc = vc;
+		e.global_header = global_header;
+		e.cpus = cpus;
+		e.target = std::max(0, count);
+		e.failed = false;
+
+		while (static_cast<int>(e.ready.size()) > e.target)
+		{
+			released.push_back(e.ready.back());
+			e.ready.pop_back();
+		}
+		refill(key, e);
+	}
+
+	for (std::size_t i = 0; i < released.size(); i++)
+		avcodec_free_context(&released[i]);
+}
+
+AVCodecContext* codec_pool::take(const std::string& key)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	std::map<std::string, entry>::iterator it = m_entries.find(key);
+	if (it == m_entries.end() || it->second.ready.empty())
+		return NULL;
+
+	AVCodecContext* ctx = it->second.ready.back();
+	it->second.ready.pop_back();
+	refill(key, it->second);
+	return ctx;
+}
+
+int codec_pool::ready_count(const std::string& key) const
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	std::map<std::string, entry>::const_iterator it = m_entries.find(key);
+	return it == m_entries.end() ? 0 : static_cast<int>(it->second.ready.size());
+}
+
+void codec_pool::refill(const std::string& key, entry& e)
+{
+	while (!e.failed && static_cast<int>(e.ready.size()) + e.opening < e.target)
+	{
+		e.opening++;
+		scheduler::instance().io_service(0).post(boost::bind(&codec_pool::open_one, this, key));
+	}
+}
+
+void codec_pool::open_one(const std::string& key)
+{
+	video_config vc;
+	bool global_header;
+	cpu_set cpus;
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		entry& e = m_entries[key];
+		vc = e.vc;
+		global_header = e.global_header;
+		cpus = e.cpus;
+	}
+
+	AVCodecContext* ctx = NULL;
+	try
+	{
+		// x264 的工作线程继承打开时的绑定.
+		scoped_thread_affinity affinity(cpus);
+		ctx = ffmpeg_encoder::open_video_codec(vc, global_header);
+	}
+	catch (std::exception&)
+	{
+	}
+
+	boost::mutex::scoped_lock l(m_mutex);
+	entry& e = m_entries[key];
+	e.opening--;
+	if (!ctx)
+	{
+		e.failed = true;
+		return;
+	}
+	if (static_cast<int>(e.ready.size()) < e.target)
+	{
+		e.ready.push_back(ctx);
+		return;
+	}
+
+	// 期间 prewarm 调小了数量.
+	l.unlock();
+	avcodec_free_context(&ctx);
+}
+
+}
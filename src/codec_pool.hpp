@@ -0,0 +1,62 @@
+﻿
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include "ffmpeg_encoder.hpp"
+#include "affinity.hpp"
+
+namespace libencoder {
+
+// 预先打开好的视频编码器.
+// avcodec_open2 打开 x264 要几百毫秒, 常用的参数组合可以先在后台打开几个放着,
+// 创建会话时参数完全一致就直接拿来用, 拿走之后在后台补上.
+class codec_pool : public boost::noncopyable
+{
+public:
+	static codec_pool& instance();
+
+	// 参数组合的标识. auto_threads 为 true 时线程数由调度器决定, 不参与比较.
+	static std::string make_key(const video_config& vc, bool global_header, bool auto_threads, const cpu_set& cpus);
+
+	// 让池里保持 count 个这种参数的编码器, 不够的在共享线程池里打开, count 为 0 时全部释放.
+	void prewarm(const video_config& vc, bool global_header, bool auto_threads, const cpu_set& cpus, int count);
+
+	// 取一个打开好的编码器, 没有时返回 NULL, 调用方负责释放.
+	AVCodecContext* take(const std::string& key);
+
+	// 池里打开好的编码器数.
+	int ready_count(const std::string& key) const;
+
+private:
+	struct entry
+	{
+		entry() : global_header(false), target(0), opening(0), failed(false) {}
+
+		video_config vc;
+		bool global_header;
+		cpu_set cpus;
+		int target;
+		int opening;
+		// 打开失败过就不再自动补, 免得一直失败一直重试.
+		bool failed;
+		std::vector<AVCodecContext*> ready;
+	};
+
+	codec_pool() {}
+
+	// 调用时持有 m_mutex.
+	void refill(const std::string& key, entry& e);
+	void open_one(const std::string& key);
+
+private:
+	mutable boost::mutex m_mutex;
+	std::map<std::string, entry> m_entries;
+};
+
+}
@@ -3,6 +3,7 @@
 #include <boost/thread.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/algorithm/string/replace.hpp>
 #include <boost/regex.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -23,53 +24,263 @@
 
 #include "encoder.hpp"
 #include "ffmpeg_encoder.hpp"
+#include "codec_pool.hpp"
+#include "trace.hpp"
+#include "ts_sender.hpp"
 
 static std::string calculated_preset = "fast";
 
+// 低延迟模式下复用线程最多为了等音频压住多久的视频.
+static const int64_t low_latency_interleave_delta = 50000;
+
 namespace libencoder
 {
-	encoder::encoder(const char* filename, int audio_channel, int audio_sample_rate, int fps, int video_width, int video_height, bool keep_ratio, const rect& clip_rect_)
-		: m_work(new boost::asio::io_service::work(m_io_service))
-		, m_io_service_thread(boost::thread(boost::bind(&boost::asio::io_service::run, &m_io_service)))
+	encoder::encoder(const char* filename, int audio_channel, int audio_sample_rate, int fps, int video_width, int video_height, bool keep_ratio, const rect& clip_rect_, const encoder_options& options, bool deferred)
+		: m_filename(filename)
+		, m_options(options)
+		, m_state(state_starting)
+		, m_session(scheduler::instance().register_session(options.priority, options.cpus))
+		, m_audio_strand(scheduler::instance().io_service(m_session))
+		, m_video_strand(scheduler::instance().io_service(m_session))
+		, m_video_pending(0)
 		, clip_rect(clip_rect_)
+		, m_governor(fps)
+		, m_paused(false)
+		, m_video_resumed(false)
+		, m_audio_resumed(false)
+		, m_roi_set(false)
+		, m_pip(options.scale_filter)
+		, m_have_frame(false)
+		, m_numa_node(options.cpus.numa_node())
+		, m_src_frame(NULL)
+		, m_yuv_frame(NULL)
+		, m_scaler(options.scale_filter)
+		, m_video_frames(0)
+		, m_warm_allocations(-1)
+		, m_audio_allocations(0)
 		, m_keep_ratio(keep_ratio)
 	{
+		m_ac.channels = 2;
+		m_ac.bit_rate = options.audio_bitrate;
+		m_ac.bytes_persample = 2;
+		m_ac.sample_rate = audio_sample_rate;
+
+		m_vc = make_video_config(fps, video_width, video_height, options);
+		if (m_vc.threads <= 0)
+			m_vc.threads = scheduler::instance().session_threads(m_session);
+
+		if (deferred)
+			return;
+
+		try
+		{
+			start();
+		}
+		catch (...)
+		{
+			release();
+			throw;
+		}
+		m_state = state_ready;
+	}
+
+	video_config encoder::make_video_config(int fps, int video_width, int video_height, const encoder_options& options)
+	{
+		video_config vc;
+		vc.fps = fps;
+		vc.bit_rate = options.bitrate;
+		vc.rc_mode = options.rc_mode;
+		vc.max_bit_rate = options.max_bitrate;
+		vc.vbv_buffer = options.vbv_buffer;
+		vc.crf = options.crf;
+		vc.gop = options.gop;
+		vc.bframes = options.bframes;
+		vc.lookahead = options.lookahead;
+		vc.codec_options = options.codec_options;
+		vc.height = video_height;
+		vc.width = video_width;
+		vc.preset = options.preset.empty() ? calculated_preset : options.preset;
+		vc.profile = options.profile;
+		vc.tune = options.tune;
+		vc.fps_num = 1;
+		vc.fps_den = vc.fps;
+		vc.threads = options.threads > 0 ? options.threads : 0;
+		vc.low_latency = options.low_latency;
+		return vc;
+	}
+
+	std::string encoder::output_format(const std::string& filename)
+	{
+		// 按 PCR 发送的数据报输出只能是 TS.
+		if (ts_sender::is_url(filename))
+			return "mpegts";
+
 		// extract type from extension
 		std::string extension = boost::filesystem::path(filename).extension().string();
 		if (extension.empty())
-			extension = "ts";
-		m_livecodec.reset(new ffmpeg_encoder(std::string(filename), extension.substr(1), std::string("9.0")));
+			extension = ".ts";
+		return extension.substr(1);
+	}
 
-		m_ac.channels = 2;
-		m_ac.bit_rate = 64000;
-		m_ac.bytes_persample = 2;
-		m_ac.sample_rate = audio_sample_rate;
+	void encoder::start()
+	{
+		const encoder_options& options = m_options;
+
+		// 初始化期间把当前线程绑到会话的 cpu 上, x264 创建的工作线程会继承这个绑定.
+		scoped_thread_affinity affinity(options.cpus);
+
+		m_livecodec.reset(new ffmpeg_encoder(m_filename, output_format(m_filename), std::string("9.0")));
 		m_livecodec->init_audio_encoder(m_ac);
+		// 新的编码器从头预热.
+		m_video_frames = 0;
+		m_warm_allocations = -1;
 
-		m_vc.fps = fps;
-		m_vc.bit_rate = 1000;
-		m_vc.height = video_height;
-		m_vc.width = video_width;
-		m_vc.preset = calculated_preset;
-		m_vc.profile = "main";
-		m_vc.fps_num = 1;
-		m_vc.fps_den = m_vc.fps;
+		// 池里有参数完全一样的编码器时直接拿来用, 省掉 avcodec_open2.
+		std::string key = codec_pool::make_key(m_vc, m_livecodec->need_global_header(), options.threads <= 0, options.cpus);
+		if (AVCodecContext* pooled = codec_pool::instance().take(key))
+		{
+			m_vc.threads = pooled->thread_count;
+			m_livecodec->init_video_encoder(m_vc, pooled);
+		}
+		else
+		{
+			m_livecodec->init_video_encoder(m_vc);
+		}
+
+		if (options.adaptive_max_bitrate)
+			m_livecodec->set_adaptive_bitrate(options.adaptive_min_bitrate, options.adaptive_max_bitrate);
+
+		m_sws_buffer.reserve(avpicture_get_size(AV_PIX_FMT_YUV420P, m_vc.width, m_vc.height), m_numa_node);
 
-		m_livecodec->init_video_encoder(m_vc);
+		// 每帧用的 AVFrame 和音频缓冲一开始就准备好.
+		m_src_frame = av_frame_alloc();
+		m_yuv_frame = av_frame_alloc();
+		if (!m_src_frame || !m_yuv_frame)
+		{
+			throw std::runtime_error("Could not allocate video frame!");
+		}
+		for (int i = 0; i < audio_buffer_count / 2; i++)
+		{
+			std::vector<uint8_t>* buffer = new std::vector<uint8_t>;
+			buffer->reserve(m_ac.sample_rate * 2 * 2 / 10);
+			m_audio_buffers.push(buffer);
+		}
 
+		if (options.low_latency)
+			m_livecodec->set_max_interleave_delta(low_latency_interleave_delta);
+		m_livecodec->set_cpu_affinity(options.cpus);
+		if (options.fragment_ms)
+			m_livecodec->set_fragment_interval(options.fragment_ms < 0 ? -1 : options.fragment_ms * static_cast<int64_t>(1000));
+		if (options.rotate_size_mb > 0 || options.rotate_seconds > 0)
+		{
+			// 没给模板时接着第一个文件的名字编号: record.mp4, record-1.mp4, record-2.mp4 ...
+			std::string name_template = options.rotate_template;
+			if (name_template.empty())
+			{
+				// 模板还要经过 strftime, 文件名里原有的 "%" 写成 "%%".
+				boost::filesystem::path path(m_filename);
+				name_template = boost::algorithm::replace_all_copy((path.parent_path() / path.stem()).string(), "%", "%%") + "-%N"
+					+ boost::algorithm::replace_all_copy(path.extension().string(), "%", "%%");
+			}
+			m_livecodec->set_rotation(name_template, options.rotate_size_mb * static_cast<int64_t>(1024 * 1024),
+				options.rotate_seconds * static_cast<int64_t>(AV_TIME_BASE));
+		}
 		m_livecodec->write_header();
 	}
 
+	void encoder::start_async(const boost::function<void(bool)>& done)
+	{
+		scheduler::instance().io_service(m_session).post(boost::bind(&encoder::run_start, this, done));
+	}
+
+	void encoder::run_start(boost::function<void(bool)> done)
+	{
+		bool ok = true;
+		std::string error;
+		try
+		{
+			start();
+		}
+		catch (std::exception& e)
+		{
+			ok = false;
+			error = e.what();
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_start_mutex);
+			m_start_error = error;
+			m_state = ok ? state_ready : state_failed;
+			m_start_cond.notify_all();
+		}
+
+		// 状态一变别的线程就可能销毁编码器, 之后不能再碰 this.
+		if (done)
+			done(ok);
+	}
+
+	encoder::start_state encoder::wait_started(int timeout_ms)
+	{
+		boost::mutex::scoped_lock l(m_start_mutex);
+
+		boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+		while (m_state == state_starting)
+		{
+			if (timeout_ms < 0)
+				m_start_cond.wait(l);
+			else if (!m_start_cond.timed_wait(l, deadline))
+				break;
+		}
+		return state();
+	}
+
+	std::string encoder::start_error() const
+	{
+		boost::mutex::scoped_lock l(m_start_mutex);
+		return m_start_error;
+	}
+
 	encoder::~encoder()
 	{
-		m_work.reset();
-		m_io_service.stop();
-		m_io_service_thread.join();
+		// 后台还在打开时要等它做完.
+		wait_started(-1);
+		release();
 	}
 
-	void encoder::do_video_frame(uint8_t* data, int width, int height, int linesize, int64_t timestamp, bool flip_picture/* = false*/)
+	void encoder::release()
 	{
-		AVFrame* frame = av_frame_alloc();
+		wait_video_idle();
+		wait_audio_idle();
+		// 会话注销后绑定的线程池可能被拆掉, 投递到池里的预览要先做完.
+		m_previews.wait_idle();
+		m_livecodec.reset();
+		scheduler::instance().unregister_session(m_session);
+
+		std::vector<uint8_t>* buffer;
+		while (m_audio_buffers.pop(buffer))
+			delete buffer;
+		av_frame_free(&m_src_frame);
+		av_frame_free(&m_yuv_frame);
+	}
+
+	bool encoder::do_video_frame(uint8_t* data, int width, int height, int linesize, int64_t timestamp, bool flip_picture/* = false*/)
+	{
+		// 还没打开好 (或者打开失败) 时的输入直接丢掉.
+		if (m_state != state_ready)
+			return false;
+
+		// 延迟从帧进入编码库开始算.
+		int64_t input_time = av_gettime_relative();
+
+		// 先决定这一帧要不要, 多余的帧不做任何拷贝和转换.
+		frame_governor::decision d = admit_video(timestamp);
+		if (!d.encode)
+			return false;
+
+		encode_duplicates(d);
+		timestamp = d.timestamp;
+
+		AVFrame* frame = m_src_frame;
 
 		if (!flip_picture)
 		{
@@ -81,6 +292,8 @@ namespace libencoder
 
 		if (clip_rect.is_valid())
 		{
+			trace_span span(trace_clip, timestamp);
+
 			//			memset(&clip_buffer[0], 0, clip_buffer.size());
 			int dst_copy_x = 0;
 			int dst_copy_y = 0;
@@ -128,7 +341,7 @@ namespace libencoder
 				}
 			}
 
-			clip_buffer.resize((dst_real_width + 8)*(dst_real_height + 8) * 4);
+			clip_buffer.reserve((dst_real_width + 8)*(dst_real_height + 8) * 4, m_numa_node);
 
 			avpicture_fill((AVPicture*)frame, clip_buffer.data(), AV_PIX_FMT_BGR0,
 				dst_real_width, dst_real_height);
@@ -140,24 +353,20 @@ namespace libencoder
 
 			// 然后将视频从原始的 buffer  里拷贝到 clip_buffer.
 			// 不拷贝覆盖的地方是 0 , 于是就黑边了.
-			if (flip_picture)
+			// 大画面按行切开, 放到共享线程池里一起拷.
+			uint8_t* dst_base = frame->data[0] + dst_copy_x * 4;
+			const rect& crop = clip_rect;
+			scheduler::instance().parallel_for(m_session, clip_rect.height(), (256 * 1024) / std::max(1, copy_line_size),
+				[=, &crop](int begin, int end)
 			{
-				for (int copy_Y = dst_copy_y, i_Y = 0; i_Y < clip_rect.height(); ++i_Y, ++copy_Y)
+				for (int i_Y = begin; i_Y < end; ++i_Y)
 				{
-					memcpy(frame->data[0] + dst_stride * copy_Y + dst_copy_x * 4,
-						data + (height- 1 -  (clip_rect.top + i_Y)) * stride + clip_rect.left * 4,
+					int src_Y = flip_picture ? (height - 1 - (crop.top + i_Y)) : (crop.top + i_Y);
+					memcpy(dst_base + dst_stride * (dst_copy_y + i_Y),
+						data + src_Y * stride + crop.left * 4,
 						copy_line_size);
 				}
-			}
-			else
-			{
-				for (int copy_Y = dst_copy_y, i_Y = 0; i_Y < clip_rect.height(); ++i_Y, ++copy_Y)
-				{
-					memcpy(frame->data[0] + dst_stride * copy_Y + dst_copy_x * 4,
-						data + (clip_rect.top + i_Y) * stride + clip_rect.left * 4,
-						copy_line_size);
-				}
-			}
+			});
 
 			width = dst_real_width;
 			height = dst_real_height;
@@ -166,30 +375,335 @@ namespace libencoder
 		{
 			avpicture_fill((AVPicture*)frame, data, AV_PIX_FMT_BGR0, width, height);
 		}
-		AVFrame* dst = av_frame_alloc();
-		avpicture_fill((AVPicture*)dst, m_sws_buffer, AV_PIX_FMT_YUV420P, m_vc.width, m_vc.height);
+		AVFrame* dst = m_yuv_frame;
+		avpicture_fill((AVPicture*)dst, m_sws_buffer.data(), AV_PIX_FMT_YUV420P, m_vc.width, m_vc.height);
 		dst->width = m_vc.width;
 		dst->height = m_vc.height;
 
-		auto m_swsctx = sws_getContext(width, height, AV_PIX_FMT_BGR0, dst->width, dst->height,
-			AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
-		auto ret = sws_scale(m_swsctx, frame->data, frame->linesize, 0, height, dst->data, dst->linesize);
-		m_livecodec->do_video_frame(m_sws_buffer, dst->width, dst->height, timestamp);
-		sws_freeContext(m_swsctx);
-		av_frame_free(&frame);
+		{
+			trace_span span(trace_convert, timestamp);
+			if (!m_scaler.scale_bgr0(frame->data[0], frame->linesize[0], width, height, dst->data, dst->linesize, dst->width, dst->height))
+				return false;
+		}
+		if (!m_pip.empty())
+		{
+			trace_span span(trace_compose, timestamp);
+			m_pip.compose(dst->data, dst->linesize, dst->width, dst->height);
+		}
+		if (!m_overlay.empty())
+		{
+			trace_span span(trace_overlay, timestamp);
+			m_overlay.blend(dst->data, dst->linesize, dst->width, dst->height);
+		}
+		if (!m_previews.empty())
+			m_previews.on_frame(dst->data, dst->linesize, dst->width, dst->height, timestamp, scheduler::instance().io_service(m_session));
+		m_livecodec->do_video_frame(m_sws_buffer.data(), dst->width, dst->height, timestamp, input_time, collect_roi());
+		m_have_frame = true;
+
+		// 预热结束时记下池已经分配的次数, 之后再增长的放到统计里.
+		if (++m_video_frames == warmup_frames)
+			m_warm_allocations = pool_allocations();
+		return true;
+	}
+
+	bool encoder::clip_fits(int width, int height) const
+	{
+		if (!clip_rect.is_valid())
+			return true;
+		return clip_rect.left >= 0 && clip_rect.top >= 0 && clip_rect.left < clip_rect.right && clip_rect.top < clip_rect.bottom
+			&& clip_rect.right <= width && clip_rect.bottom <= height;
+	}
+
+	frame_governor::decision encoder::admit_video(int64_t timestamp)
+	{
+		if (m_paused)
+			return frame_governor::decision();
+
+		if (m_video_resumed.exchange(false))
+		{
+			m_governor.rebase();
+			m_livecodec->request_keyframe();
+		}
+		return m_governor.admit(timestamp);
+	}
+
+	void encoder::pause()
+	{
+		m_paused = true;
+	}
+
+	void encoder::resume()
+	{
+		if (!m_paused.exchange(false))
+			return;
+		m_video_resumed = true;
+		m_audio_resumed = true;
+	}
+
+	void encoder::encode_duplicates(const frame_governor::decision& d)
+	{
+		// m_sws_buffer 里还是上一帧的画面.
+		for (int i = 0; m_have_frame && i < d.duplicates; i++)
+			m_livecodec->do_video_frame(m_sws_buffer.data(), m_vc.width, m_vc.height, m_governor.slot_timestamp(d.duplicate_slot + i));
+	}
+
+	bool encoder::do_yuv_frame(const uint8_t* const planes[3], const int linesize[3], int width, int height, int64_t timestamp)
+	{
+		if (m_state != state_ready)
+			return false;
+
+		int64_t input_time = av_gettime_relative();
+
+		frame_governor::decision d = admit_video(timestamp);
+		if (!d.encode)
+			return false;
+
+		encode_duplicates(d);
+
+		AVFrame* dst = m_yuv_frame;
+		avpicture_fill((AVPicture*)dst, m_sws_buffer.data(), AV_PIX_FMT_YUV420P, m_vc.width, m_vc.height);
+
+		{
+			trace_span span(trace_convert, d.timestamp);
+			if (!m_scaler.scale_yuv420(planes, linesize, width, height, dst->data, dst->linesize, m_vc.width, m_vc.height))
+				return false;
+		}
+		if (!m_pip.empty())
+		{
+			trace_span span(trace_compose, d.timestamp);
+			m_pip.compose(dst->data, dst->linesize, m_vc.width, m_vc.height);
+		}
+		if (!m_overlay.empty())
+		{
+			trace_span span(trace_overlay, d.timestamp);
+			m_overlay.blend(dst->data, dst->linesize, m_vc.width, m_vc.height);
+		}
+		if (!m_previews.empty())
+			m_previews.on_frame(dst->data, dst->linesize, m_vc.width, m_vc.height, d.timestamp, scheduler::instance().io_service(m_session));
+
+		m_livecodec->do_video_frame(m_sws_buffer.data(), m_vc.width, m_vc.height, d.timestamp, input_time, collect_roi());
+		m_have_frame = true;
+		return true;
+	}
+
+	bool encoder::do_video_input(const video_input& input)
+	{
+		if (input.format == video_input::bgr0)
+			return do_video_frame(const_cast<uint8_t*>(input.planes[0]), input.width, input.height, input.linesize[0], input.timestamp, input.flip);
+		return do_yuv_frame(input.planes, input.linesize, input.width, input.height, input.timestamp);
+	}
+
+	bool encoder::post_video_input(const video_input& input, const boost::function<void(bool)>& done)
+	{
+		// 先占位再检查, 多个线程同时交帧时也不会超过上限.
+		if (m_video_pending.fetch_add(1) >= video_queue_limit)
+		{
+			--m_video_pending;
+			return false;
+		}
+		m_video_strand.post(boost::bind(&encoder::run_video_input, this, input, done));
+		return true;
+	}
+
+	void encoder::run_video_input(video_input input, boost::function<void(bool)> done)
+	{
+		bool ok = do_video_input(input);
+		--m_video_pending;
+		if (done)
+			done(ok);
+	}
+
+	std::vector<roi_rect> encoder::clamp_roi(const std::vector<roi_rect>& rois) const
+	{
+		std::vector<roi_rect> result;
+		for (std::size_t i = 0; i < rois.size(); i++)
+		{
+			roi_rect r = rois[i];
+			r.left = std::max(0, r.left);
+			r.top = std::max(0, r.top);
+			r.right = std::min(m_vc.width, r.right);
+			r.bottom = std::min(m_vc.height, r.bottom);
+			r.qoffset = std::max(-100, std::min(100, r.qoffset));
+			if (r.left < r.right && r.top < r.bottom)
+				result.push_back(r);
+		}
+		return result;
+	}
+
+	int64_t encoder::pool_allocations() const
+	{
+		return m_livecodec->pool_allocations() + m_audio_allocations;
+	}
+
+	void encoder::set_preview(int id, const preview_config& config, const preview_callback& callback)
+	{
+		m_previews.set(id, config, callback, m_vc.width, m_vc.height);
+	}
+
+	void encoder::set_roi(const std::vector<roi_rect>& rois)
+	{
+		std::vector<roi_rect> clamped = clamp_roi(rois);
 
-		av_frame_free(&dst);
+		boost::mutex::scoped_lock l(m_roi_mutex);
+		m_session_roi.swap(clamped);
+		m_roi_set = !m_session_roi.empty() || !m_next_roi.empty();
 	}
 
-	void encoder::do_audio_frame(uint8_t* data, long size, int64_t timestamp)
+	void encoder::set_frame_roi(const std::vector<roi_rect>& rois)
 	{
-		m_livecodec->do_audio_frame(data, size, timestamp);
+		std::vector<roi_rect> clamped = clamp_roi(rois);
+
+		boost::mutex::scoped_lock l(m_roi_mutex);
+		m_next_roi.swap(clamped);
+		m_roi_set = !m_session_roi.empty() || !m_next_roi.empty();
+	}
+
+	const std::vector<roi_rect>* encoder::collect_roi()
+	{
+		if (!ffmpeg_encoder::roi_supported())
+			return NULL;
+
+		m_frame_roi.clear();
+		if (m_roi_set)
+		{
+			boost::mutex::scoped_lock l(m_roi_mutex);
+			m_frame_roi.insert(m_frame_roi.end(), m_next_roi.begin(), m_next_roi.end());
+			m_frame_roi.insert(m_frame_roi.end(), m_session_roi.begin(), m_session_roi.end());
+			m_next_roi.clear();
+			m_roi_set = !m_session_roi.empty();
+		}
+
+		// 调用方给的区域排在前面, 优先于自动得出的区域.
+		if (m_options.roi_auto)
+			m_dirty.update(m_sws_buffer.data(), m_vc.width, m_vc.width, m_vc.height,
+				m_options.roi_dirty_qoffset, m_options.roi_static_qoffset, m_frame_roi);
+
+		return m_frame_roi.empty() ? NULL : &m_frame_roi;
+	}
+
+	AVCodecContext* encoder::open_video_codec(int threads) const
+	{
+		video_config vc = m_vc;
+		vc.threads = threads;
+		return ffmpeg_encoder::open_video_codec(vc, m_livecodec->need_global_header());
+	}
+
+	void encoder::do_video_packet(const AVPacket* pkt)
+	{
+		m_livecodec->write_video_packet(pkt);
+	}
+
+	bool encoder::do_audio_frame(uint8_t* data, long size, int64_t timestamp)
+	{
+		if (m_paused || m_state != state_ready)
+			return false;
+		if (m_audio_resumed.exchange(false))
+			m_audio_strand.post(boost::bind(&ffmpeg_encoder::rebase_audio, m_livecodec.get()));
+
+		// 数据先拷到池里的缓冲上, 编码放到共享线程池上做.
+		std::vector<uint8_t>* buffer = NULL;
+		if (!m_audio_buffers.pop(buffer))
+		{
+			buffer = new std::vector<uint8_t>;
+			++m_audio_allocations;
+		}
+		buffer->assign(data, data + size);
+		m_audio_strand.post(boost::bind(&encoder::encode_audio, this, buffer, timestamp));
+		return true;
+	}
+
+	void encoder::encode_audio(std::vector<uint8_t>* data, int64_t timestamp)
+	{
+		m_livecodec->do_audio_frame(data->data(), static_cast<long>(data->size()), timestamp);
+		if (!m_audio_buffers.push(data))
+			delete data;
+	}
+
+	static void set_promise(boost::promise<void>* done)
+	{
+		done->set_value();
+	}
+
+	void encoder::wait_audio_idle()
+	{
+		boost::promise<void> done;
+		m_audio_strand.post(boost::bind(&set_promise, &done));
+		done.get_future().wait();
+	}
+
+	void encoder::wait_video_idle()
+	{
+		boost::promise<void> done;
+		m_video_strand.post(boost::bind(&set_promise, &done));
+		done.get_future().wait();
 	}
 
 	void encoder::flush_and_write_tailer()
 	{
+		if (m_state != state_ready)
+			return;
+
+		wait_video_idle();
+		wait_audio_idle();
 		m_livecodec->flush_and_write_tailer();
 	}
+
+	void encoder::get_stats(encoder_stats& stats) const
+	{
+		if (m_state != state_ready)
+		{
+			memset(&stats, 0, sizeof(stats));
+			stats.state = m_state;
+			return;
+		}
+		stats.state = state_ready;
+
+		mux_stats ms = m_livecodec->stats();
+
+		stats.video_queue_depth = ms.video_queue_depth;
+		stats.video_queue_max = ms.video_queue_max;
+		stats.audio_queue_depth = ms.audio_queue_depth;
+		stats.audio_queue_max = ms.audio_queue_max;
+		stats.packets_written = ms.packets_written;
+		stats.bytes_written = ms.bytes_written;
+		stats.interleave_forced = ms.interleave_forced;
+
+		for (int i = 0; i < ENCODER_LATENCY_BUCKETS && i < latency_buckets; i++)
+			stats.latency_histogram[i] = ms.latency_histogram[i];
+		stats.latency_samples = ms.latency_samples;
+		stats.latency_avg_us = ms.latency_samples ? ms.latency_total / ms.latency_samples : 0;
+		stats.latency_max_us = ms.latency_max;
+
+		// 会话实际使用的绑定.
+		std::string cpus = scheduler::instance().session_cpus(m_session).to_string();
+		strncpy(stats.cpu_set, cpus.c_str(), sizeof(stats.cpu_set) - 1);
+		stats.cpu_set[sizeof(stats.cpu_set) - 1] = 0;
+		stats.numa_node = m_numa_node;
+		stats.codec_threads = m_vc.threads;
+
+		stats.frames_dropped = m_governor.frames_dropped();
+		stats.frames_duplicated = m_governor.frames_duplicated();
+		stats.pool_allocations = ms.pool_allocations + m_audio_allocations;
+		int64_t warm = m_warm_allocations;
+		stats.steady_pool_allocations = warm < 0 ? 0 : pool_allocations() - warm;
+		stats.fragments_written = ms.fragments_written;
+		stats.rotations = ms.rotations;
+		stats.paused = m_paused;
+		stats.roi_supported = ffmpeg_encoder::roi_supported();
+		stats.roi_frames = m_livecodec->roi_frames();
+		const bitrate_adapter& abr = m_livecodec->adaptive_bitrate();
+		stats.adaptive_bitrate_kbps = abr.enabled() ? abr.bitrate() : (m_vc.rc_mode == rc_crf ? m_vc.max_bit_rate : m_vc.bit_rate);
+		stats.adaptive_drain_kbps = abr.drain_kbps();
+		stats.adaptive_queued_bytes = abr.queued_bytes();
+		stats.adaptive_queue_delay_ms = abr.queue_delay_ms();
+		stats.adaptive_step_downs = abr.step_downs();
+		stats.adaptive_step_ups = abr.step_ups();
+		stats.paced_datagrams = ms.paced_datagrams;
+		stats.paced_batches = ms.paced_batches;
+		stats.paced_send_errors = ms.paced_send_errors;
+		strncpy(stats.current_file, ms.current_file.c_str(), sizeof(stats.current_file) - 1);
+		stats.current_file[sizeof(stats.current_file) - 1] = 0;
+	}
 }
 
 #ifdef _WIN32
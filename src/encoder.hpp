@@ -4,9 +4,20 @@
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/stack.hpp>
 
 #include <libencoder_api.hpp>
 #include "ffmpeg_encoder.hpp"
+#include "scheduler.hpp"
+#include "encoder_options.hpp"
+#include "frame_governor.hpp"
+#include "frame_scaler.hpp"
+#include "roi_map.hpp"
+#include "overlay.hpp"
+#include "pip.hpp"
+#include "preview.hpp"
 
 namespace libencoder{
 
@@ -15,7 +26,7 @@ struct rect {
 
 	rect() { top = bottom = left = right; }
 
-	bool is_valid()
+	bool is_valid() const
 	{
 		return !(top == bottom && left == right);
 	}
@@ -29,22 +40,118 @@ class ffmpeg_encoder;
 class encoder
 {
 public:
-	encoder(const char* filename, int audio_channel, int audio_sample_rate, int fps, int video_width, int video_height, bool keep_ratio, const rect& clip_rect);
+	enum start_state { state_starting, state_ready, state_failed };
+
+	// deferred 为 false 时在构造函数里打开输出和编码器, 失败抛出异常;
+	// 为 true 时只做参数准备, 之后调用 start_async 在后台打开.
+	encoder(const char* filename, int audio_channel, int audio_sample_rate, int fps, int video_width, int video_height, bool keep_ratio, const rect& clip_rect, const encoder_options& options = encoder_options(), bool deferred = false);
 	~encoder();
 
 public:
-	// 向视频编码器输入一帧视频.
-	void do_video_frame(uint8_t* data, int width, int height, int linesize, int64_t timestamp, bool flip_picture = false);
-
-	// 向音频编码器输入一帧音频.
-	void do_audio_frame(uint8_t* data, long size, int64_t timestamp);
+	// 在会话的线程池里打开输出和编码器, 完成后 (成功或失败) 调用 done, 参数为是否成功.
+	void start_async(const boost::function<void(bool)>& done);
+	start_state state() const { return static_cast<start_state>(m_state.load()); }
+	// 等待后台打开完成, timeout_ms 小于 0 时一直等, 返回当时的状态.
+	start_state wait_started(int timeout_ms);
+	// 打开失败的原因.
+	std::string start_error() const;
+
+	// 按会话参数生成视频编码器配置, 线程数为 0 表示由调度器决定.
+	static video_config make_video_config(int fps, int video_width, int video_height, const encoder_options& options);
+	// 按扩展名决定的输出格式名.
+	static std::string output_format(const std::string& filename);
+
+	// 向视频编码器输入一帧视频. 返回这一帧是否送进了编码器, 没打开好, 暂停或者多余的帧返回 false.
+	bool do_video_frame(uint8_t* data, int width, int height, int linesize, int64_t timestamp, bool flip_picture = false);
+
+	// 输入一帧 YUV420P, 尺寸和输出一致时直接拷贝, 否则缩放 (不加黑边, 不裁剪).
+	bool do_yuv_frame(const uint8_t* const planes[3], const int linesize[3], int width, int height, int64_t timestamp);
+
+	// 按格式交给 do_video_frame 或 do_yuv_frame.
+	bool do_video_input(const video_input& input);
+
+	// 把一帧交给共享线程池去转换和编码, 调用线程不等. 处理完 (送进编码器或者丢掉) 之后调用 done,
+	// 在那之前调用方不能释放或者改写帧数据. 已经有 video_queue_limit 帧在排队时不接收, 返回 false.
+	// 同一个会话不要和 do_video_frame / do_yuv_frame 混用.
+	enum { video_queue_limit = 2 };
+	bool post_video_input(const video_input& input, const boost::function<void(bool)>& done);
+
+	// 向音频编码器输入一帧音频, 数据拷走之后就返回. 没打开好或者暂停时返回 false.
+	bool do_audio_frame(uint8_t* data, long size, int64_t timestamp);
+
+	// 感兴趣区域, 坐标是输出画面上的像素. set_roi 一直有效直到下次设置,
+	// set_frame_roi 只用于下一帧, 两者同时有时下一帧的优先.
+	void set_roi(const std::vector<roi_rect>& rois);
+	void set_frame_roi(const std::vector<roi_rect>& rois);
+
+	// 鼠标指针, 水印这类叠加图, 在裁剪和加黑边之后叠加到输出画面上, 见 overlay_compositor.
+	overlay_compositor& overlay() { return m_overlay; }
+
+	// 画中画的额外视频源, 合成在主画面之上, 叠加图之下, 见 pip_compositor.
+	pip_compositor& pip() { return m_pip; }
+
+	// 预览图, 见 preview_taps::set.
+	void set_preview(int id, const preview_config& config, const preview_callback& callback);
+
+	// 暂停期间输入的音视频直接丢掉, 编码器和线程都保持打开.
+	// 恢复后第一帧视频编成关键帧, 音视频的时间戳都接着暂停前往下排, 输出里没有空档.
+	void pause();
+	void resume();
+	bool paused() const { return m_paused; }
+
+	// 分段并行编码用: 按会话的参数另开一个视频编码器, 调用方负责释放.
+	AVCodecContext* open_video_codec(int threads) const;
+	// 写入另开的编码器编码好的视频包, 时间戳以编码器的 time_base 为单位.
+	void do_video_packet(const AVPacket* pkt);
+	const video_config& video_settings() const { return m_vc; }
+	// 裁剪区域是否完整地落在 width x height 的 BGR0 画面里, 不裁剪时总是 true.
+	bool clip_fits(int width, int height) const;
+	const encoder_options& options() const { return m_options; }
+	scale_filter video_scale_filter() const { return m_scaler.filter(); }
 
 	void flush_and_write_tailer();
 
+	void get_stats(encoder_stats& stats) const;
+
 private:
-	boost::asio::io_service m_io_service;
-	boost::scoped_ptr<boost::asio::io_service::work> m_work;
-	boost::thread m_io_service_thread;
+	// data 来自 m_audio_buffers, 编码完还回去.
+	void encode_audio(std::vector<uint8_t>* data, int64_t timestamp);
+	// 等共享线程池里这个会话的音频任务全部做完.
+	void wait_audio_idle();
+	void run_video_input(video_input input, boost::function<void(bool)> done);
+	// 等 post_video_input 交出去的帧全部做完.
+	void wait_video_idle();
+	// 用上一帧的画面补上帧率网格上缺的帧.
+	void encode_duplicates(const frame_governor::decision& d);
+	// 打开输出和编码器, 写文件头.
+	void start();
+	void run_start(boost::function<void(bool)> done);
+	// 释放 start 里创建的东西, 并注销会话.
+	void release();
+	// 暂停时不要这一帧, 刚恢复时重新对齐时间戳, 其余交给 m_governor.
+	frame_governor::decision admit_video(int64_t timestamp);
+	// 把这一帧用的区域收集到 m_frame_roi, 没有区域时返回 NULL.
+	const std::vector<roi_rect>* collect_roi();
+	// 裁剪到画面内, 去掉空的区域.
+	std::vector<roi_rect> clamp_roi(const std::vector<roi_rect>& rois) const;
+	// 帧缓冲, 包和音频缓冲这几个池一共新分配的次数.
+	int64_t pool_allocations() const;
+
+private:
+	std::string m_filename;
+	encoder_options m_options;
+
+	boost::atomic<int> m_state;
+	std::string m_start_error;
+	mutable boost::mutex m_start_mutex;
+	boost::condition_variable m_start_cond;
+
+	int m_session;
+	// 音频编码在共享线程池上串行执行.
+	boost::asio::io_service::strand m_audio_strand;
+	// post_video_input 交过来的帧同样串行执行, m_video_pending 是还没做完的帧数.
+	boost::asio::io_service::strand m_video_strand;
+	boost::atomic<int> m_video_pending;
 
 	int m_audio_channel;
 	int audio_sample_rate;
@@ -52,9 +159,45 @@ private:
 	int video_height;
 
 	rect clip_rect;
-	std::vector<uint8_t> clip_buffer;
+	node_buffer clip_buffer;
+
+	// 对齐到帧率网格, 丢掉多余的帧, 补上缺的帧.
+	frame_governor m_governor;
+	boost::atomic<bool> m_paused;
+	// 恢复之后还没有处理的视频, 音频.
+	boost::atomic<bool> m_video_resumed;
+	boost::atomic<bool> m_audio_resumed;
+	// 调用方设置的区域, 以及自动从变化区域得出的区域.
+	boost::mutex m_roi_mutex;
+	std::vector<roi_rect> m_session_roi;
+	std::vector<roi_rect> m_next_roi;
+	boost::atomic<bool> m_roi_set;
+	std::vector<roi_rect> m_frame_roi;
+	dirty_tracker m_dirty;
+	overlay_compositor m_overlay;
+	pip_compositor m_pip;
+	preview_taps m_previews;
+
+	// 保存上一帧转换后的 YUV, 补帧时直接拿来编码.
+	node_buffer m_sws_buffer;
+	bool m_have_frame;
+	int m_numa_node;
+
+	// 每帧复用的 AVFrame 和缩放器.
+	AVFrame* m_src_frame;
+	AVFrame* m_yuv_frame;
+	frame_scaler m_scaler;
+	// 预热阶段的帧数, 之后各个池都不应该再增长.
+	enum { warmup_frames = 300 };
+	int64_t m_video_frames;
+	// 预热结束时池已经分配的次数, 还没预热完时是 -1.
+	boost::atomic<int64_t> m_warm_allocations;
+
+	// 音频数据从调用线程交给共享线程池时用的缓冲.
+	enum { audio_buffer_count = 64 };
+	boost::lockfree::stack<std::vector<uint8_t>*, boost::lockfree::capacity<audio_buffer_count> > m_audio_buffers;
+	boost::atomic<int64_t> m_audio_allocations;
 
-	uint8_t m_sws_buffer[1280 * 720 * 2];
 	boost::shared_ptr<ffmpeg_encoder> m_livecodec;
 	audio_config m_ac;
 	video_config m_vc;
@@ -0,0 +1,326 @@
+﻿
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#include <boost/lexical_cast.hpp>
+
+#include "encoder_options.hpp"
+
+extern "C"
+{
+#include "libavutil/dict.h"
+#include "libavutil/opt.h"
+}
+
+namespace libencoder {
+
+static const char* const x264_presets[] =
+{
+	"ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow", "placebo", NULL
+};
+
+static const char* const x264_tunes[] =
+{
+	"film", "animation", "grain", "stillimage", "psnr", "ssim", "fastdecode", "zerolatency", NULL
+};
+
+static const char* const h264_profiles[] =
+{
+	"baseline", "main", "high", "high10", "high422", "high444", NULL
+};
+
+static bool in_list(const char* const* list, const std::string& value)
+{
+	for (; *list; list++)
+	{
+		if (value == *list)
+			return true;
+	}
+	return false;
+}
+
+// 文件名模板里有没有会展开的 "%" 转换 ("%N" 或者 strftime 的), "%%" 只是百分号.
+static bool has_name_specifier(const std::string& name_template)
+{
+	for (std::size_t i = 0; i + 1 < name_template.size(); i++)
+	{
+		if (name_template[i] != '%')
+			continue;
+		if (name_template[i + 1] != '%')
+			return true;
+		i++;
+	}
+	return false;
+}
+
+static int to_int(const std::string& key, const std::string& value)
+{
+	try
+	{
+		return boost::lexical_cast<int>(value);
+	}
+	catch (boost::bad_lexical_cast&)
+	{
+		throw std::invalid_argument("option " + key + ": not a number: " + value);
+	}
+}
+
+void apply_profile(encoder_options& options, const std::string& name, int fps)
+{
+	if (fps <= 0)
+		fps = 25;
+
+	if (name == "archive")
+	{
+		// 录像存档: 质量优先, 码率随内容变化, 长 GOP.
+		options.rc_mode = rc_crf;
+		options.crf = 20;
+		options.preset = "slow";
+		options.gop = fps * 10;
+		options.bframes = 3;
+		options.lookahead = 60;
+		options.audio_bitrate = 128;
+	}
+	else if (name == "live")
+	{
+		// 推流: 恒定码率, VBV 一秒, 两秒一个关键帧方便播放端快速起播.
+		options.rc_mode = rc_cbr;
+		options.bitrate = 2500;
+		options.vbv_buffer = 2500;
+		options.preset = "veryfast";
+		options.gop = fps * 2;
+		options.bframes = 0;
+		options.lookahead = 10;
+		options.audio_bitrate = 96;
+	}
+	else if (name == "low-cpu")
+	{
+		// 机器负载高时用: 最快的 preset, 没有 B 帧和 lookahead.
+		options.rc_mode = rc_crf;
+		options.crf = 26;
+		options.preset = "superfast";
+		options.bframes = 0;
+		options.lookahead = 0;
+		options.scale_filter = scale_fast_bilinear;
+	}
+	else
+	{
+		throw std::invalid_argument("unknown profile: " + name);
+	}
+}
+
+void apply_option(encoder_options& options, const std::string& key, const std::string& value)
+{
+	if (key.compare(0, 6, "codec.") == 0 && key.size() > 6)
+		options.codec_options.push_back(std::make_pair(key.substr(6), value));
+	else if (key == "priority")
+		options.priority = to_int(key, value);
+	else if (key == "cpu_set")
+	{
+		if (!options.cpus.parse(value))
+			throw std::invalid_argument("option cpu_set: bad cpu list: " + value);
+	}
+	else if (key == "latency_mode")
+		options.low_latency = value == "low" || value == "1";
+	else if (key == "rc_mode")
+	{
+		if (value == "cbr")
+			options.rc_mode = rc_cbr;
+		else if (value == "vbr")
+			options.rc_mode = rc_vbr;
+		else if (value == "crf")
+			options.rc_mode = rc_crf;
+		else
+			throw std::invalid_argument("option rc_mode: expect cbr, vbr or crf: " + value);
+	}
+	else if (key == "bitrate_kbps")
+		options.bitrate = to_int(key, value);
+	else if (key == "max_bitrate_kbps")
+		options.max_bitrate = to_int(key, value);
+	else if (key == "vbv_buffer_kbits")
+		options.vbv_buffer = to_int(key, value);
+	else if (key == "crf")
+		options.crf = to_int(key, value);
+	else if (key == "gop")
+		options.gop = to_int(key, value);
+	else if (key == "bframes")
+		options.bframes = to_int(key, value);
+	else if (key == "lookahead")
+		options.lookahead = to_int(key, value);
+	else if (key == "threads")
+		options.threads = to_int(key, value);
+	else if (key == "preset")
+		options.preset = value;
+	else if (key == "h264_profile")
+		options.profile = value;
+	else if (key == "tune")
+		options.tune = value;
+	else if (key == "audio_bitrate_kbps")
+		options.audio_bitrate = to_int(key, value);
+	else if (key == "rotate_size_mb")
+		options.rotate_size_mb = to_int(key, value);
+	else if (key == "rotate_seconds")
+		options.rotate_seconds = to_int(key, value);
+	else if (key == "rotate_template")
+		options.rotate_template = value;
+	else if (key == "mp4_fragment_ms")
+		options.fragment_ms = to_int(key, value);
+	else if (key == "roi_auto")
+		options.roi_auto = to_int(key, value) != 0;
+	else if (key == "roi_dirty_qoffset")
+		options.roi_dirty_qoffset = to_int(key, value);
+	else if (key == "roi_static_qoffset")
+		options.roi_static_qoffset = to_int(key, value);
+	else if (key == "adaptive_min_kbps")
+		options.adaptive_min_bitrate = to_int(key, value);
+	else if (key == "adaptive_max_kbps")
+		options.adaptive_max_bitrate = to_int(key, value);
+	else if (key == "scale_filter")
+	{
+		if (!parse_scale_filter(value, options.scale_filter))
+			throw std::invalid_argument("option scale_filter: expect fast_bilinear, bilinear, bicubic or lanczos: " + value);
+	}
+	else
+		throw std::invalid_argument("unknown option: " + key);
+}
+
+std::vector<std::pair<std::string, std::string> > split_options(const std::string& str)
+{
+	std::vector<std::pair<std::string, std::string> > result;
+
+	// 借用 ffmpeg 的解析, 值里的 ':' 可以用 '\' 转义或者加引号.
+	AVDictionary* dict = NULL;
+	if (av_dict_parse_string(&dict, str.c_str(), "=", ":", 0) < 0)
+	{
+		av_dict_free(&dict);
+		throw std::invalid_argument("malformed options: " + str);
+	}
+
+	AVDictionaryEntry* e = NULL;
+	while ((e = av_dict_get(dict, "", e, AV_DICT_IGNORE_SUFFIX)))
+		result.push_back(std::make_pair(std::string(e->key), std::string(e->value)));
+	av_dict_free(&dict);
+	return result;
+}
+
+// 在一个临时的编码器上下文里试着设置, 名字和值都由编码器自己检查.
+static void validate_codec_options(const encoder_options& options)
+{
+	if (options.codec_options.empty())
+		return;
+
+	AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+	if (!codec)
+		codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+	if (!codec)
+		throw std::invalid_argument("codec options given but no h264 encoder available");
+
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+	if (!ctx)
+		throw std::bad_alloc();
+
+	for (std::size_t i = 0; i < options.codec_options.size(); i++)
+	{
+		const std::string& key = options.codec_options[i].first;
+		const std::string& value = options.codec_options[i].second;
+
+		int ret = av_opt_set(ctx, key.c_str(), value.c_str(), AV_OPT_SEARCH_CHILDREN);
+		if (ret < 0)
+		{
+			avcodec_free_context(&ctx);
+			if (ret == AVERROR_OPTION_NOT_FOUND)
+				throw std::invalid_argument(std::string("unknown codec option for ") + codec->name + ": " + key);
+			throw std::invalid_argument("bad value for codec option " + key + ": " + value);
+		}
+	}
+	avcodec_free_context(&ctx);
+}
+
+void validate_options(const encoder_options& options, int fps, int width, int height)
+{
+	if (fps <= 0 || fps > 240)
+		throw std::invalid_argument("fps out of range (1-240)");
+	if (width <= 0 || height <= 0 || width % 2 || height % 2)
+		throw std::invalid_argument("video size must be positive and even");
+
+	switch (options.rc_mode)
+	{
+	case rc_cbr:
+		if (options.bitrate <= 0)
+			throw std::invalid_argument("cbr needs bitrate_kbps");
+		if (options.max_bitrate && options.max_bitrate != options.bitrate)
+			throw std::invalid_argument("cbr: max_bitrate_kbps must equal bitrate_kbps");
+		break;
+	case rc_vbr:
+		if (options.bitrate <= 0)
+			throw std::invalid_argument("vbr needs bitrate_kbps");
+		if (options.max_bitrate && options.max_bitrate < options.bitrate)
+			throw std::invalid_argument("vbr: max_bitrate_kbps less than bitrate_kbps");
+		break;
+	case rc_crf:
+		if (options.crf < 0 || options.crf > 51)
+			throw std::invalid_argument("crf needs crf in 0-51");
+		break;
+	default:
+		if (options.crf >= 0)
+			throw std::invalid_argument("crf given without rc_mode crf");
+		if (options.bitrate <= 0)
+			throw std::invalid_argument("bitrate_kbps must be positive");
+		break;
+	}
+
+	if (options.max_bitrate < 0 || options.vbv_buffer < 0)
+		throw std::invalid_argument("max_bitrate_kbps and vbv_buffer_kbits must not be negative");
+	if (options.vbv_buffer && !options.max_bitrate && options.rc_mode != rc_cbr && options.rc_mode != rc_vbr)
+		throw std::invalid_argument("vbv_buffer_kbits needs max_bitrate_kbps");
+
+	if (options.gop < 0)
+		throw std::invalid_argument("gop must not be negative");
+	if (options.bframes > 16)
+		throw std::invalid_argument("bframes out of range (0-16)");
+	if (options.gop && options.bframes > 0 && options.bframes >= options.gop)
+		throw std::invalid_argument("bframes must be less than gop");
+	if (options.low_latency && options.bframes > 0)
+		throw std::invalid_argument("low latency mode does not allow bframes");
+	// 低延迟靠一帧大小的 VBV 限制每帧的大小, crf 本身没有码率.
+	if (options.low_latency && options.rc_mode == rc_crf && !options.max_bitrate)
+		throw std::invalid_argument("low latency mode with rc_mode crf needs max_bitrate_kbps");
+	if (options.lookahead > 250)
+		throw std::invalid_argument("lookahead out of range (0-250)");
+	if (options.threads < 0 || options.threads > 64)
+		throw std::invalid_argument("threads out of range (0-64)");
+
+	if (!options.preset.empty() && !in_list(x264_presets, options.preset))
+		throw std::invalid_argument("unknown preset: " + options.preset);
+	if (!options.tune.empty() && !in_list(x264_tunes, options.tune))
+		throw std::invalid_argument("unknown tune: " + options.tune);
+	if (!options.profile.empty() && !in_list(h264_profiles, options.profile))
+		throw std::invalid_argument("unknown h264 profile: " + options.profile);
+
+	if (options.audio_bitrate < 8 || options.audio_bitrate > 512)
+		throw std::invalid_argument("audio_bitrate_kbps out of range (8-512)");
+	if (options.fragment_ms < -1)
+		throw std::invalid_argument("mp4_fragment_ms must be -1, 0 or positive");
+	if (options.rotate_size_mb < 0 || options.rotate_seconds < 0)
+		throw std::invalid_argument("rotate_size_mb and rotate_seconds must not be negative");
+	// 每次展开都一样的模板会让新文件覆盖上一个.
+	if (!options.rotate_template.empty() && !has_name_specifier(options.rotate_template))
+		throw std::invalid_argument("rotate_template needs %N or a strftime specifier: " + options.rotate_template);
+	if (options.roi_dirty_qoffset < -100 || options.roi_dirty_qoffset > 100
+		|| options.roi_static_qoffset < -100 || options.roi_static_qoffset > 100)
+		throw std::invalid_argument("roi_dirty_qoffset and roi_static_qoffset must be between -100 and 100");
+	if (options.adaptive_min_bitrate < 0 || options.adaptive_max_bitrate < 0)
+		throw std::invalid_argument("adaptive_min_kbps and adaptive_max_kbps must not be negative");
+	if (options.adaptive_min_bitrate && !options.adaptive_max_bitrate)
+		throw std::invalid_argument("adaptive_min_kbps needs adaptive_max_kbps");
+	if (options.adaptive_max_bitrate && options.adaptive_min_bitrate > options.adaptive_max_bitrate)
+		throw std::invalid_argument("adaptive_min_kbps greater than adaptive_max_kbps");
+	// crf 没有目标码率, 只能调整最大码率.
+	if (options.adaptive_max_bitrate && options.rc_mode == rc_crf && !options.max_bitrate)
+		throw std::invalid_argument("adaptive bitrate with crf needs max_bitrate_kbps");
+
+	validate_codec_options(options);
+}
+
+}
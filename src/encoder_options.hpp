@@ -0,0 +1,114 @@
+﻿
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "ffmpeg_encoder.hpp"
+#include "affinity.hpp"
+#include "scheduler.hpp"
+#include "frame_scaler.hpp"
+
+namespace libencoder {
+
+// 创建会话时的可选参数.
+// 数值参数 0 (crf, bframes, lookahead 为 -1) 表示使用默认值.
+struct encoder_options
+{
+	encoder_options()
+		: priority(scheduler::default_priority)
+		, low_latency(false)
+		, rc_mode(rc_default)
+		, bitrate(1000)
+		, max_bitrate(0)
+		, vbv_buffer(0)
+		, crf(-1)
+		, gop(0)
+		, bframes(-1)
+		, lookahead(-1)
+		, threads(0)
+		, profile("main")
+		, audio_bitrate(64)
+		, scale_filter(scale_bicubic)
+		, fragment_ms(0)
+		, rotate_size_mb(0)
+		, rotate_seconds(0)
+		, roi_auto(false)
+		, roi_dirty_qoffset(-30)
+		, roi_static_qoffset(20)
+		, adaptive_min_bitrate(0)
+		, adaptive_max_bitrate(0)
+	{}
+
+	// 会话优先级, 决定从全局核预算里分到的编码线程数.
+	int priority;
+
+	// 会话的线程 (包括 x264 的工作线程) 绑定到这组 cpu 上, 帧缓冲分配在对应的 NUMA 节点.
+	cpu_set cpus;
+
+	// 低延迟的直播模式.
+	bool low_latency;
+
+	// 码率控制, 码率单位都是 kbps, vbv_buffer 单位是 kbit.
+	rate_control_mode rc_mode;
+	int bitrate;
+	int max_bitrate;
+	int vbv_buffer;
+	int crf;
+
+	// GOP 长度 (帧), 最多的连续 B 帧数, x264 的 lookahead 帧数.
+	int gop;
+	int bframes;
+	int lookahead;
+
+	// x264 线程数, 0 表示由调度器分配.
+	int threads;
+
+	// 为空时由 benchmark 决定 preset.
+	std::string preset;
+	std::string profile;
+	std::string tune;
+
+	int audio_bitrate;
+
+	// 原样传给编码器的参数, 例如 x264 的 "aq-mode".
+	std::vector<std::pair<std::string, std::string> > codec_options;
+
+	// 任意比例缩放时用的滤镜.
+	libencoder::scale_filter scale_filter;
+
+	// MP4 分片间隔 (毫秒), 0 表示不分片, -1 表示每个 GOP 一个分片.
+	int fragment_ms;
+
+	// 当前文件超过这么大 (MB) 或者这么长 (秒) 之后在下一个关键帧换新文件, 0 表示不限.
+	// 新文件名由 rotate_template 生成, 见 packet_muxer::set_rotation.
+	int rotate_size_mb;
+	int rotate_seconds;
+	std::string rotate_template;
+
+	// 按相邻两帧的变化区域自动调整画质, 适合屏幕录制. 偏移的含义见 roi_rect::qoffset,
+	// 变化的区域用 roi_dirty_qoffset, 其余用 roi_static_qoffset.
+	bool roi_auto;
+	int roi_dirty_qoffset;
+	int roi_static_qoffset;
+
+	// 输出跟不上时在这个范围 (kbps) 内自动调整视频码率, 见 bitrate_adapter. adaptive_max_bitrate 为 0 表示不调整.
+	int adaptive_min_bitrate;
+	int adaptive_max_bitrate;
+};
+
+// 应用命名的参数组合: "archive", "live", "low-cpu". 未知的名字抛出 std::invalid_argument.
+void apply_profile(encoder_options& options, const std::string& name, int fps);
+
+// 按名字设置一个参数, 名字和 encoder_config 的字段一致, "codec." 开头的转给编码器.
+// 未知的名字或者非法的值抛出 std::invalid_argument.
+void apply_option(encoder_options& options, const std::string& key, const std::string& value);
+
+// 把 "key=value:key=value" 拆开, 格式错误抛出 std::invalid_argument.
+std::vector<std::pair<std::string, std::string> > split_options(const std::string& str);
+
+// 创建编码器之前检查参数, 有问题抛出 std::invalid_argument, 不让 x264 悄悄忽略.
+void validate_options(const encoder_options& options, int fps, int width, int height);
+
+}
@@ -1,68 +1,158 @@
 ﻿
 #include "ffmpeg_encoder.hpp"
-
-#define IO_BUFFER_SIZE	32768
+#include "trace.hpp"
 
 namespace libencoder {
 
+encode_pipe::encode_pipe(AVCodecContext* ctx /*= NULL*/)
+	: m_ctx(ctx)
+#if !HAVE_AVCODEC_SEND_RECEIVE
+	, m_frame(NULL)
+	, m_has_frame(false)
+	, m_draining(false)
+#endif
+{
+}
+
+encode_pipe::~encode_pipe()
+{
+}
+
+void encode_pipe::reset(AVCodecContext* ctx)
+{
+	m_ctx = ctx;
+#if !HAVE_AVCODEC_SEND_RECEIVE
+	m_frame = NULL;
+	m_has_frame = false;
+	m_draining = false;
+#endif
+}
+
+int encode_pipe::send_frame(const AVFrame* frame)
+{
+	if (!m_ctx)
+		return AVERROR(EINVAL);
+#if HAVE_AVCODEC_SEND_RECEIVE
+	return avcodec_send_frame(m_ctx, frame);
+#else
+	if (m_draining)
+		return AVERROR_EOF;
+	if (m_has_frame)
+		return AVERROR(EAGAIN);
+	if (!frame)
+	{
+		m_draining = true;
+		return 0;
+	}
+
+	// 真正的编码推迟到 receive_packet, 包可以直接写进调用方给的缓冲里.
+	m_frame = frame;
+	m_has_frame = true;
+	return 0;
+#endif
+}
+
+int encode_pipe::receive_packet(AVPacket* pkt)
+{
+	if (!m_ctx)
+		return AVERROR(EINVAL);
+#if HAVE_AVCODEC_SEND_RECEIVE
+	return avcodec_receive_packet(m_ctx, pkt);
+#else
+	if (!m_has_frame && !m_draining)
+		return AVERROR(EAGAIN);
+
+	// flush 状态下每次调用取出一个 delay 的包, 直到编码器吐完.
+	const AVFrame* frame = m_has_frame ? m_frame : NULL;
+	m_frame = NULL;
+	m_has_frame = false;
+
+	int got_output = 0;
+	int ret = encode(frame, pkt, &got_output);
+	if (ret < 0)
+		return ret;
+	if (got_output)
+		return 0;
+	return frame ? AVERROR(EAGAIN) : AVERROR_EOF;
+#endif
+}
+
+#if !HAVE_AVCODEC_SEND_RECEIVE
+int encode_pipe::encode(const AVFrame* frame, AVPacket* pkt, int* got_output)
+{
+	// data 和 size 是调用方准备好的缓冲, 足够大时编码器直接写进去, 不用另外分配.
+	av_init_packet(pkt);
+
+	// 没有 delay 的编码器不接受 NULL 帧.
+	if (!frame && !(m_ctx->codec->capabilities & CODEC_CAP_DELAY))
+	{
+		*got_output = 0;
+		return 0;
+	}
+
+	if (m_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+		return avcodec_encode_video2(m_ctx, pkt, frame, got_output);
+	return avcodec_encode_audio2(m_ctx, pkt, frame, got_output);
+}
+#endif
+
 ffmpeg_encoder::ffmpeg_encoder(const std::string& live_name, std::string fmt /*= "mpegts"*/, std::string version/* = ""*/)
-	: m_fmt_ctx(NULL)
-	, m_h264_ctx(NULL)
+	: m_h264_ctx(NULL)
 	, m_audio_ctx(NULL)
+	, m_video_index(-1)
+	, m_audio_index(-1)
 	, m_swr_ctx(NULL)
 	, m_vframe_index(1)
 	, m_aframe_index(0)
+	, m_force_keyframe(false)
+	, m_base_bit_rate(0)
+	, m_base_max_rate(0)
+	, m_base_buffer_size(0)
+	, m_roi_frames(0)
+	, m_audio_rebase(false)
+	, m_audio_next_ts(AV_NOPTS_VALUE)
+	, m_audio_ts_offset(0)
 	, m_swsctx(NULL)
+	, m_video_frame(NULL)
+#if HAVE_AVCODEC_SEND_RECEIVE
+	, m_video_pool(NULL)
+	, m_audio_pool(NULL)
+#endif
+	, m_frame_allocations(0)
+	, m_audio_frame(NULL)
 	, m_clone_frame_len(0)
 	, m_clone_frame(NULL)
 	, m_volume(256)
 	, m_live_name(live_name)
 {
-	m_fmt_name = fmt;
-	m_fmt_ctx = avformat_alloc_context();
-	m_fmt_ctx->oformat = av_guess_format(fmt.c_str(), NULL, NULL);
-	if (!m_fmt_ctx->oformat)
-	{
-		m_fmt_name = "mpegts";
-		m_fmt_ctx->oformat = av_guess_format("mpegts", NULL, NULL);
-	}
-	if (!m_fmt_ctx->oformat)
-	{
-		throw std::runtime_error("Could not guess format: ");
-	}
-
-	unsigned char* io_buffer = reinterpret_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
-
-	avio_open2(&m_fmt_ctx->pb, live_name.c_str(), AVIO_FLAG_READ_WRITE, NULL, NULL);
-
-	//if (fmt != "flv")
-		//m_fmt_ctx->pb->direct = 1;
-
-	av_dict_free(&m_fmt_ctx->metadata);
-	std::string name = "libencoder-" + version;
-	if (!version.empty())
-		name = "libencoder-" + version;
-	av_dict_set(&m_fmt_ctx->metadata, "service_name", name.c_str(), 0);
-	av_dict_set(&m_fmt_ctx->metadata, "title", "", 0);
-	av_dict_set(&m_fmt_ctx->metadata, "service_provider", "wanin.net", 0);
+	m_muxer.reset(new packet_muxer(live_name, fmt, version));
 }
 
 ffmpeg_encoder::~ffmpeg_encoder()
 {
+	// 先停掉复用线程, 再释放编码器.
+	m_muxer.reset();
+
 	if (m_swr_ctx)
 		swr_free(&m_swr_ctx);
 	if (m_clone_frame)
 		av_free(m_clone_frame);
 	if (m_swsctx)
 		sws_freeContext(m_swsctx);
+	av_frame_free(&m_video_frame);
+#if HAVE_AVCODEC_SEND_RECEIVE
+	// 编码器还拿着的缓冲在它释放时才真正归还.
+	av_buffer_pool_uninit(&m_video_pool);
+	av_buffer_pool_uninit(&m_audio_pool);
+#endif
+	av_frame_free(&m_audio_frame);
 	if (m_h264_ctx)
-		avcodec_close(m_h264_ctx);
+		avcodec_free_context(&m_h264_ctx);
 	if (m_audio_ctx)
-		avcodec_close(m_audio_ctx);
-	avformat_free_context(m_fmt_ctx);
+		avcodec_free_context(&m_audio_ctx);
 }
 
-void ffmpeg_encoder::init_video_encoder(video_config vc, std::string encoder /*= "libx264"*/)
+AVCodecContext* ffmpeg_encoder::open_video_codec(const video_config& vc, bool global_header, const std::string& encoder /*= "libx264"*/)
 {
 	AVCodec* codec = nullptr;
 	AVCodec* codec_hwaccel = avcodec_find_encoder_by_name("h264_qsv");
@@ -74,40 +164,57 @@ void ffmpeg_encoder::init_video_encoder(video_config vc, std::string encoder /*=
 			codec = avcodec_find_encoder(AV_CODEC_ID_H264);
 	}
 
-	m_video_stream = avformat_new_stream(m_fmt_ctx, codec);
-	if (!m_video_stream)
-	{
-		throw std::runtime_error("Could not allocate video stream!");
-		return;
-	}
-	m_video_stream->id = 40;
-	m_h264_ctx = m_video_stream->codec;
-	m_h264_ctx->thread_count = boost::thread::hardware_concurrency();
-	m_h264_ctx->thread_type = FF_THREAD_FRAME;
-	if (!m_h264_ctx)
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+	if (!ctx)
 	{
 		throw std::runtime_error("Could not allocate video codec context!");
-		return;
 	}
+	// 帧级多线程每多一个线程就多一帧延迟, 低延迟模式用片级多线程.
+	ctx->thread_type = vc.low_latency ? FF_THREAD_SLICE : FF_THREAD_FRAME;
 
-	if (m_fmt_name == "flv" || m_fmt_name == "mp4")
-		m_h264_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	if (global_header)
+		ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
 
-	m_h264_ctx->bit_rate = vc.bit_rate * 1000;
-	m_h264_ctx->rc_max_rate = vc.bit_rate * 2000;
-	m_h264_ctx->rc_min_rate = 3000;
-	// 	m_h264_ctx->rc_max_rate = m_h264_ctx->bit_rate;
-	// 	m_h264_ctx->flags |= CODEC_FLAG_QSCALE;
-	m_h264_ctx->rc_buffer_size = 30 * 1024 * 1024;
-	m_h264_ctx->width = vc.width;
-	m_h264_ctx->height = vc.height;
+	switch (vc.rc_mode)
+	{
+	case rc_cbr:
+		ctx->bit_rate = vc.bit_rate * 1000;
+		ctx->rc_max_rate = ctx->bit_rate;
+		ctx->rc_min_rate = ctx->bit_rate;
+		ctx->rc_buffer_size = vc.vbv_buffer > 0 ? vc.vbv_buffer * 1000 : static_cast<int>(ctx->bit_rate);
+		av_opt_set(ctx->priv_data, "nal-hrd", "cbr", 0);
+		break;
+	case rc_vbr:
+		ctx->bit_rate = vc.bit_rate * 1000;
+		ctx->rc_max_rate = vc.max_bit_rate > 0 ? vc.max_bit_rate * 1000 : ctx->bit_rate * 2;
+		ctx->rc_buffer_size = vc.vbv_buffer > 0 ? vc.vbv_buffer * 1000 : static_cast<int>(ctx->rc_max_rate);
+		break;
+	case rc_crf:
+		ctx->bit_rate = 0;
+		av_opt_set_double(ctx->priv_data, "crf", vc.crf, 0);
+		if (vc.max_bit_rate > 0)
+		{
+			ctx->rc_max_rate = vc.max_bit_rate * 1000;
+			ctx->rc_buffer_size = vc.vbv_buffer > 0 ? vc.vbv_buffer * 1000 : static_cast<int>(ctx->rc_max_rate);
+		}
+		break;
+	default:
+		ctx->bit_rate = vc.bit_rate * 1000;
+		ctx->rc_max_rate = vc.max_bit_rate > 0 ? vc.max_bit_rate * 1000 : vc.bit_rate * 2000;
+		ctx->rc_min_rate = 3000;
+		ctx->rc_buffer_size = vc.vbv_buffer > 0 ? vc.vbv_buffer * 1000 : 30 * 1024 * 1024;
+		ctx->qmin = 18;
+		ctx->qmax = 25;
+		break;
+	}
+	ctx->width = vc.width;
+	ctx->height = vc.height;
 	// frames per second.
 	AVRational rate = { 1, 10000 };
-	m_h264_ctx->time_base = rate;// av_inv_q(rate);
-	m_video_stream->time_base = m_h264_ctx->time_base;
+	ctx->time_base = rate;// av_inv_q(rate);
 
-	m_h264_ctx->ticks_per_frame;
-	m_h264_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+	ctx->ticks_per_frame;
+	ctx->pix_fmt = AV_PIX_FMT_YUV420P;
 	int profile = FF_PROFILE_H264_HIGH;
 	if (!vc.profile.empty())
 	{
@@ -124,93 +231,234 @@ void ffmpeg_encoder::init_video_encoder(video_config vc, std::string encoder /*=
 		if (vc.profile == "high444")
 			profile = FF_PROFILE_H264_HIGH_444;
 	}
-	m_h264_ctx->profile = profile;
-	m_h264_ctx->thread_count = vc.threads;
-	m_h264_ctx->thread_count = m_h264_ctx->thread_count > 16 ? 16 : m_h264_ctx->thread_count;
-	m_h264_ctx->keyint_min = (vc.fps_num / vc.fps_den) / 2;
-	m_h264_ctx->gop_size = vc.fps * 15;
+	ctx->profile = profile;
+	// 线程数由调度器按会话分配, 不再每个会话都占满所有核.
+	ctx->thread_count = vc.threads > 0 ? vc.threads : 1;
+	ctx->keyint_min = (vc.fps_num / vc.fps_den) / 2;
+	ctx->gop_size = vc.gop > 0 ? vc.gop : static_cast<int>(vc.fps * 15);
+	if (vc.bframes >= 0)
+		ctx->max_b_frames = vc.bframes;
 	if (!vc.preset.empty())
-		av_opt_set(m_h264_ctx->priv_data, "preset", vc.preset.c_str(), 0);
+		av_opt_set(ctx->priv_data, "preset", vc.preset.c_str(), 0);
 
-	m_h264_ctx->qmin = 18;
-	m_h264_ctx->qmax = 25;
+	std::string tune = vc.tune != "film" ? vc.tune : std::string();
 
-	if (!vc.tune.empty() && vc.tune != "film")
-		av_opt_set(m_h264_ctx->priv_data, "tune", vc.tune.c_str(), 0);
-	av_opt_set_int(m_h264_ctx->priv_data, "rc-lookahead", 100, 0);
+	if (vc.low_latency)
+	{
+		// 不等后面的帧: 没有 B 帧, 没有 lookahead, 用帧内刷新代替 IDR,
+		// VBV 只有一帧大小, 每一帧都能马上发出去.
+		// x264 的 tune 可以用逗号组合, 调用方给的 tune (例如 stillimage) 保留.
+		if (tune.find("zerolatency") == std::string::npos)
+			tune += tune.empty() ? "zerolatency" : ",zerolatency";
+		ctx->max_b_frames = 0;
+		av_opt_set_int(ctx->priv_data, "rc-lookahead", 0, 0);
+		av_opt_set_int(ctx->priv_data, "intra-refresh", 1, 0);
+		int64_t vbv_rate = vc.rc_mode == rc_default || !ctx->rc_max_rate ? ctx->bit_rate : ctx->rc_max_rate;
+		if (vbv_rate > 0)
+		{
+			ctx->rc_max_rate = vbv_rate;
+			ctx->rc_buffer_size = static_cast<int>(vbv_rate / (vc.fps > 0 ? vc.fps : 25));
+		}
+	}
+	else
+	{
+		av_opt_set_int(ctx->priv_data, "rc-lookahead", vc.lookahead >= 0 ? vc.lookahead : 100, 0);
+	}
+
+	if (!tune.empty())
+		av_opt_set(ctx->priv_data, "tune", tune.c_str(), 0);
 
 	AVDictionary* encoder_opts = nullptr;
-	av_dict_set(&encoder_opts, "threads", "auto", 0);
+	for (std::size_t i = 0; i < vc.codec_options.size(); i++)
+		av_dict_set(&encoder_opts, vc.codec_options[i].first.c_str(), vc.codec_options[i].second.c_str(), 0);
 
-	m_video_stream->avg_frame_rate = { (int)vc.fps, 1 };
-	if (avcodec_open2(m_h264_ctx, codec, &encoder_opts) < 0)
+	if (avcodec_open2(ctx, codec, &encoder_opts) < 0)
 	{
 		av_dict_free(&encoder_opts);
+		avcodec_free_context(&ctx);
 		throw std::runtime_error("Could not open h264 codec!");
-		return;
+	}
+
+	// 编码器没有用掉的参数说明名字写错了, 不能当作没看见.
+	AVDictionaryEntry* unused = av_dict_get(encoder_opts, "", NULL, AV_DICT_IGNORE_SUFFIX);
+	if (unused)
+	{
+		std::string name = unused->key;
+		av_dict_free(&encoder_opts);
+		avcodec_free_context(&ctx);
+		throw std::runtime_error("Unknown codec option: " + name);
 	}
 	av_dict_free(&encoder_opts);
+	return ctx;
+}
+
+void ffmpeg_encoder::set_adaptive_bitrate(int min_kbps, int max_kbps)
+{
+	m_base_bit_rate = m_h264_ctx->bit_rate;
+	m_base_max_rate = m_h264_ctx->rc_max_rate;
+	m_base_buffer_size = m_h264_ctx->rc_buffer_size;
+
+	// crf 没有目标码率, 调整的是最大码率.
+	int64_t base = m_base_bit_rate > 0 ? m_base_bit_rate : m_base_max_rate;
+	if (max_kbps <= 0 || base <= 0)
+	{
+		m_bitrate_adapter.reset(0, 0, 0);
+		return;
+	}
+
+	int start = static_cast<int>(base / 1000);
+	m_bitrate_adapter.reset(min_kbps, max_kbps, start);
+	if (m_bitrate_adapter.bitrate() != start)
+		apply_bitrate(m_bitrate_adapter.bitrate());
+}
+
+void ffmpeg_encoder::apply_bitrate(int kbps)
+{
+	int64_t base = m_base_bit_rate > 0 ? m_base_bit_rate : m_base_max_rate;
+	int64_t rate = kbps * static_cast<int64_t>(1000);
+
+	AVCodecContext* ctx = m_h264_ctx;
+	if (m_base_bit_rate > 0)
+	{
+		// CBR 的最小码率和码率相同.
+		if (ctx->rc_min_rate == ctx->bit_rate)
+			ctx->rc_min_rate = rate;
+		ctx->bit_rate = rate;
+	}
+	if (m_base_max_rate > 0)
+		ctx->rc_max_rate = m_base_max_rate * rate / base;
+	if (m_base_buffer_size > 0)
+		ctx->rc_buffer_size = static_cast<int>(m_base_buffer_size * rate / base);
+}
+
+bool ffmpeg_encoder::format_needs_global_header(const std::string& fmt)
+{
+	AVOutputFormat* oformat = av_guess_format(fmt.c_str(), NULL, NULL);
+	if (!oformat)
+		oformat = av_guess_format("mpegts", NULL, NULL);
+	return oformat && (oformat->flags & AVFMT_GLOBALHEADER) != 0;
+}
+
+void ffmpeg_encoder::init_video_encoder(video_config vc, std::string encoder /*= "libx264"*/)
+{
+	init_video_encoder(vc, open_video_codec(vc, m_muxer->need_global_header(), encoder));
+}
+
+void ffmpeg_encoder::init_video_encoder(const video_config& vc, AVCodecContext* opened)
+{
+	m_h264_ctx = opened;
+	m_video_pipe.reset(m_h264_ctx);
+
+	m_video_index = m_muxer->add_stream(m_h264_ctx);
+	AVStream* st = m_muxer->stream(m_video_index);
+	st->id = 40;
+	st->avg_frame_rate = { (int)vc.fps, 1 };
 	m_sws_buffer_size = avpicture_get_size(AV_PIX_FMT_YUV420P, vc.width, vc.height);
 	m_sws_buffer.resize(m_sws_buffer_size);
+
+	// 每帧复用同一个 AVFrame, 数据指针每次重新填.
+	m_video_frame = av_frame_alloc();
+	if (!m_video_frame)
+		throw std::runtime_error("Could not allocate video frame!");
+#if HAVE_AVCODEC_SEND_RECEIVE
+	m_video_pool = av_buffer_pool_init(m_sws_buffer_size, NULL);
+	if (!m_video_pool)
+		throw std::runtime_error("Could not allocate video frame pool!");
+	m_video_buffers.reserve(64);
+#endif
 }
 
-void ffmpeg_encoder::do_video_frame(uint8_t* data, int width, int height, int64_t timestamp)
+void ffmpeg_encoder::do_video_frame(uint8_t* data, int width, int height, int64_t timestamp, int64_t input_time,
+	const std::vector<roi_rect>* rois)
 {
-	AVFrame* frame = av_frame_alloc();
-	frame->format = AV_PIX_FMT_YUV420P;
-	int got_output;
+	if (!m_h264_ctx)
+		return;
+
+	AVFrame* frame = m_video_frame;
 	int ret;
 
-	ret = avpicture_fill(reinterpret_cast<AVPicture*>(frame), data, AV_PIX_FMT_YUV420P, width, height);
+#if HAVE_AVCODEC_SEND_RECEIVE
+	// 拷进池里的缓冲再交给编码器, 编码器引用这块缓冲, 不用自己再分配一份. 稳定之后池里的缓冲循环使用.
+	if (avpicture_get_size(AV_PIX_FMT_YUV420P, width, height) > m_sws_buffer_size)
+		return;
+	frame->buf[0] = pool_get(m_video_pool, m_video_buffers);
+	if (!frame->buf[0])
+		return;
+	ret = avpicture_fill(reinterpret_cast<AVPicture*>(frame), frame->buf[0]->data, AV_PIX_FMT_YUV420P, width, height);
 	if (ret <= 0)
 	{
-		av_frame_free(&frame);
+		av_buffer_unref(&frame->buf[0]);
 		return;
 	}
+	memcpy(frame->buf[0]->data, data, ret);
+#else
+	ret = avpicture_fill(reinterpret_cast<AVPicture*>(frame), data, AV_PIX_FMT_YUV420P, width, height);
+	if (ret <= 0)
+		return;
+#endif
 
 	frame->format = AV_PIX_FMT_YUV420P;
-	frame->width = width;
-	frame->height = height;
-
-	AVPacket pkt;
-	av_init_packet(&pkt);
-	pkt.data = NULL;
-	pkt.size = 0;
+	frame->width = m_h264_ctx->width;
+	frame->height = m_h264_ctx->height;
 
 	frame->pts =  timestamp / 100;// timestamp;
+	bool keyframe = m_force_keyframe.exchange(false);
+	if (m_bitrate_adapter.enabled())
+	{
+		int kbps = m_bitrate_adapter.update(av_gettime_relative(), m_muxer->bytes_written(), m_muxer->write_busy_us(), m_muxer->queued_bytes());
+		if (kbps > 0)
+		{
+			apply_bitrate(kbps);
+			keyframe = true;
+		}
+	}
+	frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 	m_vframe_index++;
 
-	frame->width = m_h264_ctx->width;
-	frame->height = m_h264_ctx->height;
+	if (input_time != AV_NOPTS_VALUE)
+		m_muxer->mark_input(m_video_index, frame->pts, input_time);
 
-	if (!m_h264_ctx)
+#if HAVE_AV_REGION_OF_INTEREST
+	if (rois && !rois->empty())
 	{
-		av_frame_free(&frame);
-		return;
+		AVFrameSideData* sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+			static_cast<int>(rois->size() * sizeof(AVRegionOfInterest)));
+		if (sd)
+		{
+			AVRegionOfInterest* roi = reinterpret_cast<AVRegionOfInterest*>(sd->data);
+			for (std::size_t i = 0; i < rois->size(); i++)
+			{
+				const roi_rect& r = (*rois)[i];
+				roi[i].self_size = sizeof(AVRegionOfInterest);
+				roi[i].top = r.top;
+				roi[i].bottom = r.bottom;
+				roi[i].left = r.left;
+				roi[i].right = r.right;
+				roi[i].qoffset = av_make_q(r.qoffset, 100);
+			}
+			m_roi_frames++;
+		}
 	}
+#else
+	(void)rois;
+#endif
 
-	ret = avcodec_encode_video2(m_h264_ctx, &pkt, frame, &got_output);
-	if (ret != 0)
 	{
-		// LOG_ERR << "Video encoding failed!";
-		av_frame_free(&frame);
-		return;
+		trace_span span(trace_video_encode, timestamp);
+		ret = encode_frame(m_video_pipe, m_video_index, frame);
 	}
-	if (got_output)
-	{
-		pkt.stream_index = m_video_stream->index;
-		av_packet_rescale_ts(&pkt,m_h264_ctx->time_base, m_video_stream->time_base);
-
-		boost::mutex::scoped_lock l(m_mutex);
 
-		if(pkt.buf)
-			ret = av_interleaved_write_frame(m_fmt_ctx, &pkt);
-		if (ret < 0) {
-
-		}
-		av_free_packet(&pkt);
+#if HAVE_AV_REGION_OF_INTEREST
+	// m_video_frame 每帧复用, 区域只对这一帧有效.
+	av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+#endif
+#if HAVE_AVCODEC_SEND_RECEIVE
+	av_buffer_unref(&frame->buf[0]);
+#endif
+	if (ret < 0)
+	{
+		// LOG_ERR << "Video encoding failed!";
 	}
-	av_frame_free(&frame);
 }
 
 void ffmpeg_encoder::init_audio_encoder(audio_config ac, std::string encoder /*= "libvo_aacenc"*/)
@@ -223,21 +471,14 @@ void ffmpeg_encoder::init_audio_encoder(audio_config ac, std::string encoder /*=
 		throw std::runtime_error("Could not open audio codec!");
 		return;
 	}
-	m_audio_stream = avformat_new_stream(m_fmt_ctx, codec);
-	if (!m_audio_stream)
-	{
-		throw std::runtime_error("Could not allocate audio stream!");
-		return;
-	}
-	m_audio_stream->id = 50;
-	m_audio_ctx = m_audio_stream->codec;
+	m_audio_ctx = avcodec_alloc_context3(codec);
 	if (!m_audio_ctx)
 	{
 		throw std::runtime_error("Could not allocate audio codec context!");
 		return;
 	}
 
-	if (m_fmt_name == "flv" || m_fmt_name == "mp4")
+	if (m_muxer->need_global_header())
 		m_audio_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
 
 	m_audio_ctx->bit_rate = ac.bit_rate * 1000;
@@ -259,9 +500,32 @@ void ffmpeg_encoder::init_audio_encoder(audio_config ac, std::string encoder /*=
 
 	AVRational rate = { 1, (int)ac.sample_rate };
 	// AVRational rate = { 1, 1000 };
-	m_audio_stream->time_base = rate;//AVRational{ 1, ac.sample_rate };
 	m_audio_ctx->time_base = rate;	// m_audio_ctx->channel_layout;
 	auto ret = avcodec_open2(m_audio_ctx, codec, NULL);
+	if (ret >= 0)
+		m_audio_pipe.reset(m_audio_ctx);
+
+	m_audio_index = m_muxer->add_stream(m_audio_ctx);
+	m_muxer->stream(m_audio_index)->id = 50;
+
+	m_audio_frame = av_frame_alloc();
+	if (!m_audio_frame)
+		throw std::runtime_error("Could not allocate audio frame!");
+
+	// 转换用的缓冲一开始就按一帧的大小分配好.
+	int frame_bytes = m_audio_ctx->frame_size * m_audio_ctx->channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+	if (frame_bytes > 0)
+	{
+		m_audio_buffer.resize(frame_bytes);
+		m_swr_buffer.resize(av_get_bytes_per_sample(m_audio_ctx->sample_fmt) * m_audio_ctx->channels * m_audio_ctx->frame_size);
+		m_streambuf.prepare(frame_bytes * 4);
+#if HAVE_AVCODEC_SEND_RECEIVE
+		m_audio_pool = av_buffer_pool_init(static_cast<int>(m_swr_buffer.size()), NULL);
+		if (!m_audio_pool)
+			throw std::runtime_error("Could not allocate audio frame pool!");
+		m_audio_buffers.reserve(64);
+#endif
+	}
 }
 
 void ffmpeg_encoder::do_audio_frame(uint8_t* data, long size, int64_t timestamp)
@@ -269,12 +533,11 @@ void ffmpeg_encoder::do_audio_frame(uint8_t* data, long size, int64_t timestamp)
 	if (!m_audio_ctx)
 		return;
 
-	AVFrame* frame = av_frame_alloc();
+	AVFrame* frame = m_audio_frame;
 	int want_data_size = m_audio_ctx->frame_size * m_audio_ctx->channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
 	if (want_data_size <= 0)
 	{
 		// LOG_WARN << "want_data_size == " << want_data_size;
-		av_frame_free(&frame);
 		return;
 	}
 
@@ -285,7 +548,8 @@ void ffmpeg_encoder::do_audio_frame(uint8_t* data, long size, int64_t timestamp)
 		m_streambuf.commit(size);
 	}
 
-	m_audio_buffer.resize(want_data_size);
+	if (m_audio_buffer.size() < static_cast<std::size_t>(want_data_size))
+		m_audio_buffer.resize(want_data_size);
 
 	int64_t time_unit = (m_audio_ctx->frame_size * 10000000LL) / m_audio_ctx->sample_rate;
 
@@ -300,14 +564,14 @@ void ffmpeg_encoder::do_audio_frame(uint8_t* data, long size, int64_t timestamp)
 		if (m_volume != 256)
 			audio_volume(&m_audio_buffer[0], want_data_size, m_volume);
 
+#if HAVE_AVCODEC_SEND_RECEIVE
+		// 转换结果直接写进池里的缓冲, 编码器引用这块缓冲, 不用自己再拷一份.
+		frame->buf[0] = pool_get(m_audio_pool, m_audio_buffers);
+		if (!frame->buf[0])
+			break;
+#endif
 		SwrConvert(&m_audio_buffer[0], want_data_size, &frame);
 
-		int got_output;
-		AVPacket pkt;
-		av_init_packet(&pkt);
-		pkt.data = NULL;
-		pkt.size = 0;
-
 		if (timestamp == -1)
 		{
 			frame->pts = m_aframe_index;
@@ -319,39 +583,38 @@ void ffmpeg_encoder::do_audio_frame(uint8_t* data, long size, int64_t timestamp)
 		}
 		else
 		{
-			frame->pts = timestamp;
+			if (m_audio_rebase && m_audio_next_ts != AV_NOPTS_VALUE)
+				m_audio_ts_offset = timestamp - m_audio_next_ts;
+			m_audio_rebase = false;
+
+			frame->pts = timestamp - m_audio_ts_offset;
 			timestamp += time_unit;
+			m_audio_next_ts = frame->pts + time_unit;
 		}
 
-		ret = avcodec_encode_audio2(m_audio_ctx, &pkt, frame, &got_output);
-		if (ret != 0)
 		{
-			break;
+			trace_span span(trace_audio_encode, frame->pts);
+			ret = encode_frame(m_audio_pipe, m_audio_index, frame);
 		}
-		if (got_output)
-		{
-			pkt.stream_index = m_audio_stream->index;
-			av_packet_rescale_ts(&pkt, m_audio_ctx->time_base, m_audio_stream->time_base);
-
-#if FF_API_CODED_FRAME
-			if (m_audio_ctx && m_audio_ctx->coded_frame && m_audio_ctx->coded_frame->key_frame)
-				pkt.flags |= AV_PKT_FLAG_KEY;
+#if HAVE_AVCODEC_SEND_RECEIVE
+		av_buffer_unref(&frame->buf[0]);
 #endif
-			boost::mutex::scoped_lock l(m_mutex);
-			assert(pkt.buf);
-			ret = av_interleaved_write_frame(m_fmt_ctx, &pkt);
-			if (ret < 0)
-			{
-			}
-			av_free_packet(&pkt);
+		if (ret < 0)
+		{
+			break;
 		}
 	} while (true);
-	av_frame_free(&frame);
 }
 
 void ffmpeg_encoder::write_header()
 {
-	int ret = avformat_write_header(m_fmt_ctx, NULL/*&dict*/);
+	int ret = m_muxer->write_header();
+	if (ret < 0)
+	{
+		char error[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+		av_strerror(ret, error, sizeof(error));
+		throw std::runtime_error("Could not write header to " + m_live_name + ": " + error);
+	}
 }
 
 void ffmpeg_encoder::volume(int vol)
@@ -375,14 +638,17 @@ void ffmpeg_encoder::audio_volume(uint8_t* buffer, int size, int vol)
 void ffmpeg_encoder::SwrConvert(uint8_t* buffer, int size, AVFrame** dst)
 {
 	int bytes = av_get_bytes_per_sample(m_audio_ctx->sample_fmt) * m_audio_ctx->channels * m_audio_ctx->frame_size;
-	m_swr_buffer.resize(bytes);
+	if (m_swr_buffer.size() < static_cast<std::size_t>(bytes))
+		m_swr_buffer.resize(bytes);
 
 	AVFrame* frame = *dst;
 	frame->nb_samples = m_audio_ctx->frame_size;
 	frame->format = m_audio_ctx->sample_fmt;
 	frame->channel_layout = m_audio_ctx->channel_layout;
 
-	frame->data[0] = & m_swr_buffer[0];
+	// 帧带着池里的缓冲时转换到那块缓冲上.
+	uint8_t* out_buffer = frame->buf[0] ? frame->buf[0]->data : &m_swr_buffer[0];
+	frame->data[0] = out_buffer;
 	frame->data[1] = frame->data[0] + (bytes / 2);
 	uint8_t** out = frame->data;
 	uint8_t** in = &buffer;
@@ -411,7 +677,7 @@ void ffmpeg_encoder::SwrConvert(uint8_t* buffer, int size, AVFrame** dst)
 		int ret = swr_convert(m_swr_ctx, out, nb_samples, (const uint8_t**)in, nb_samples);
 		if (ret == nb_samples)
 		{
-			ret = avcodec_fill_audio_frame(frame, m_audio_ctx->channels, m_audio_ctx->sample_fmt, &m_swr_buffer[0], bytes, 1);
+			ret = avcodec_fill_audio_frame(frame, m_audio_ctx->channels, m_audio_ctx->sample_fmt, out_buffer, bytes, 1);
 			//if (ret < 0) LOG_ERR << "avcodec_fill_audio_frame(<-) failed!";
 		}
 	}
@@ -428,81 +694,129 @@ void ffmpeg_encoder::flush()
 		do_audio_frame(0, 0, -1);
 	}
 
-	int got_output;
+	// 进入 flush 状态后把 delay 的包全部取出来.
+	if (m_audio_pipe.send_frame(NULL) >= 0)
+		drain_packets(m_audio_pipe, m_audio_index);
+	m_muxer->end_of_stream(m_audio_index);
 
-	do {
-		AVPacket pkt;
-		av_init_packet(&pkt);
-		pkt.data = NULL;
-		pkt.size = 0;
+	// 然后是视频.
+	if (m_video_pipe.send_frame(NULL) >= 0)
+		drain_packets(m_video_pipe, m_video_index);
+	m_muxer->end_of_stream(m_video_index);
+}
 
-		auto ret = avcodec_encode_audio2(m_audio_ctx, &pkt, NULL, &got_output);
-		if (ret != 0)
+int ffmpeg_encoder::encode_frame(encode_pipe& pipe, int stream_index, const AVFrame* frame)
+{
+	int ret = pipe.send_frame(frame);
+	if (ret == AVERROR(EAGAIN))
+	{
+		// 编码器要求先取走输出.
+		drain_packets(pipe, stream_index);
+		ret = pipe.send_frame(frame);
+	}
+	if (ret < 0)
+		return ret;
+
+	ret = drain_packets(pipe, stream_index);
+	return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+int ffmpeg_encoder::drain_packets(encode_pipe& pipe, int stream_index)
+{
+	int ret;
+	for (;;)
+	{
+		// 包从复用器的池里取, 老版本的编码器直接写进包自带的缓冲.
+		AVPacket* pkt = m_muxer->acquire_packet(stream_index);
+
+		ret = pipe.receive_packet(pkt);
+		if (ret < 0)
 		{
+			m_muxer->release_packet(stream_index, pkt);
 			break;
 		}
-		if (got_output)
-		{
-			pkt.stream_index = m_audio_stream->index;
-			av_packet_rescale_ts(&pkt, m_audio_ctx->time_base, m_audio_stream->time_base);
 
+		write_packet(pkt, pipe.context(), stream_index);
+	}
+	return ret;
+}
+
+void ffmpeg_encoder::write_packet(AVPacket* pkt, AVCodecContext* ctx, int stream_index)
+{
 #if FF_API_CODED_FRAME
-			if (m_audio_ctx && m_audio_ctx->coded_frame && m_audio_ctx->coded_frame->key_frame)
-				pkt.flags |= AV_PKT_FLAG_KEY;
+	if (ctx->codec_type == AVMEDIA_TYPE_AUDIO && ctx->coded_frame && ctx->coded_frame->key_frame)
+		pkt->flags |= AV_PKT_FLAG_KEY;
 #endif
-			boost::mutex::scoped_lock l(m_mutex);
-			assert(pkt.buf);
-			ret = av_interleaved_write_frame(m_fmt_ctx, &pkt);
-			if (ret < 0)
-			{
-			}
-			av_free_packet(&pkt);
-		}
-	} while (got_output);
 
-	// 然后是视频.
-	do {
-		AVPacket pkt;
-		av_init_packet(&pkt);
-		pkt.data = NULL;
-		pkt.size = 0;
+	// 交给复用线程去写, 编码线程不用等文件 IO.
+	m_muxer->push_packet(stream_index, pkt);
+}
 
-		auto ret = avcodec_encode_video2(m_h264_ctx, &pkt, NULL, &got_output);
-		if (ret != 0)
-		{
-			return;
-		}
-		if (got_output)
-		{
-			pkt.stream_index = m_video_stream->index;
-			av_packet_rescale_ts(&pkt, m_h264_ctx->time_base, m_video_stream->time_base);
+void ffmpeg_encoder::write_video_packet(const AVPacket* pkt)
+{
+	AVPacket* queued = m_muxer->acquire_packet(m_video_index);
+	av_packet_unref(queued);
+	if (av_packet_ref(queued, pkt) < 0)
+	{
+		m_muxer->release_packet(m_video_index, queued);
+		return;
+	}
+	m_muxer->push_packet(m_video_index, queued);
+}
 
-			boost::mutex::scoped_lock l(m_mutex);
+void ffmpeg_encoder::flush_and_write_tailer()
+{
+	this->flush();
+	m_muxer->write_trailer(AV_TIME_BASE * (m_aframe_index / (double)m_audio_ctx->sample_rate));
+}
 
-			ret = av_interleaved_write_frame(m_fmt_ctx, &pkt);
-			if (ret < 0)
-			{
-			}
-			av_free_packet(&pkt);
-		}
-	}while(got_output);
+void ffmpeg_encoder::set_max_interleave_delta(int64_t us)
+{
+	m_muxer->set_max_interleave_delta(us);
 }
 
-void ffmpeg_encoder::flush_and_write_tailer()
+void ffmpeg_encoder::set_cpu_affinity(const cpu_set& cpus)
+{
+	m_muxer->set_cpu_affinity(cpus);
+}
+
+void ffmpeg_encoder::set_fragment_interval(int64_t us)
+{
+	m_muxer->set_fragment_interval(us);
+}
+
+void ffmpeg_encoder::set_rotation(const std::string& name_template, int64_t max_bytes, int64_t max_duration)
+{
+	m_muxer->set_rotation(name_template, max_bytes, max_duration);
+}
+
+mux_stats ffmpeg_encoder::stats() const
+{
+	return m_muxer->stats();
+}
+
+#if HAVE_AVCODEC_SEND_RECEIVE
+AVBufferRef* ffmpeg_encoder::pool_get(AVBufferPool* pool, std::vector<uint8_t*>& seen)
 {
-	if (m_fmt_ctx->pb)
+	// 池里的缓冲释放之前地址不变, 没见过的地址就是新分配的.
+	AVBufferRef* buf = av_buffer_pool_get(pool);
+	if (buf && std::find(seen.begin(), seen.end(), buf->data) == seen.end())
 	{
-		this->flush();
-		{
-			boost::mutex::scoped_lock l(m_mutex);
-			AV_TIME_BASE;
-			m_fmt_ctx->duration = AV_TIME_BASE * (m_aframe_index / (double)m_audio_ctx->sample_rate);
-			m_video_stream->nb_frames;
-			m_video_stream->duration = 10000 * (m_aframe_index / (double)m_audio_ctx->sample_rate);
-			av_write_trailer(m_fmt_ctx);
-		}
-		avio_close(m_fmt_ctx->pb);
+		seen.push_back(buf->data);
+		++m_frame_allocations;
 	}
+	return buf;
+}
+#endif
+
+int64_t ffmpeg_encoder::pool_allocations() const
+{
+	int64_t count = m_frame_allocations;
+	if (m_video_index >= 0)
+		count += m_muxer->pool_allocations(m_video_index);
+	if (m_audio_index >= 0)
+		count += m_muxer->pool_allocations(m_audio_index);
+	return count;
 }
 
 }
@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <cstdint>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <list>
@@ -14,10 +15,12 @@
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/asio.hpp>
 #include <boost/assert.hpp>
+#include <boost/scoped_ptr.hpp>
 
 extern "C"
 {
@@ -35,8 +38,27 @@ extern "C"
 #include "libavutil/opt.h"
 }
 
+#include "packet_muxer.hpp"
+#include "bitrate_adapter.hpp"
+
+// libavutil 56.25 开始有 AVRegionOfInterest, libx264 按它设置宏块的量化偏移.
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(56, 25, 100)
+#	define HAVE_AV_REGION_OF_INTEREST 1
+#else
+#	define HAVE_AV_REGION_OF_INTEREST 0
+#endif
+
 namespace libencoder{
 
+// 码率控制方式, rc_default 是原来的平均码率加 qmin/qmax 限制.
+enum rate_control_mode
+{
+	rc_default,
+	rc_cbr,
+	rc_vbr,
+	rc_crf,
+};
+
 struct video_config
 {
 	std::string profile;
@@ -49,6 +71,30 @@ struct video_config
 	int fps_num; ///< numerator
 	int fps_den; ///< denominator
 	int bit_rate;
+	rate_control_mode rc_mode;
+	// 以下码率单位 kbps/kbit, 0 表示按 rc_mode 取默认值.
+	int max_bit_rate;
+	int vbv_buffer;
+	int crf;
+	// 0 表示 15 秒, bframes 和 lookahead 为 -1 表示由 preset 决定.
+	int gop;
+	int bframes;
+	int lookahead;
+	// 在内置设置之后原样交给编码器.
+	std::vector<std::pair<std::string, std::string> > codec_options;
+	// 低延迟模式: 片级多线程, zerolatency, 无 B 帧, 周期帧内刷新, 一帧大小的 VBV.
+	bool low_latency;
+};
+
+// 感兴趣区域, 坐标是输出画面上的像素, right/bottom 不含.
+// qoffset 取 -100 到 100, 负数表示提高画质, 对应 AVRegionOfInterest::qoffset 的 -1 到 1.
+struct roi_rect
+{
+	int left;
+	int top;
+	int right;
+	int bottom;
+	int qoffset;
 };
 
 struct audio_config
@@ -83,6 +129,38 @@ struct codec_stat
 	int run_time_log;
 };
 
+// 编码器的 send/receive 接口.
+// 老版本 libavcodec 上用 avcodec_encode_video2/avcodec_encode_audio2 模拟,
+// 语义和 avcodec_send_frame/avcodec_receive_packet 一致:
+// send 一帧之后, 必须 receive 到 EAGAIN 才能再 send, send(NULL) 之后 receive 到 EOF 为止.
+// 老版本上编码发生在 receive 里, 所以 send 的帧在 receive 返回之前必须有效.
+class encode_pipe : public boost::noncopyable
+{
+public:
+	explicit encode_pipe(AVCodecContext* ctx = NULL);
+	~encode_pipe();
+
+	void reset(AVCodecContext* ctx);
+	AVCodecContext* context() const { return m_ctx; }
+
+	// 送一帧给编码器, frame 为 NULL 表示进入 flush 状态.
+	int send_frame(const AVFrame* frame);
+
+	// 取出一个编码好的包, 没有可用的包返回 AVERROR(EAGAIN), flush 完毕返回 AVERROR_EOF.
+	// pkt 的 data/size 可以预先指向一块缓冲, 老版本的编码器会直接写进去.
+	int receive_packet(AVPacket* pkt);
+
+private:
+	AVCodecContext* m_ctx;
+#if !HAVE_AVCODEC_SEND_RECEIVE
+	int encode(const AVFrame* frame, AVPacket* pkt, int* got_output);
+
+	const AVFrame* m_frame;
+	bool m_has_frame;
+	bool m_draining;
+#endif
+};
+
 class ffmpeg_encoder : public boost::noncopyable
 {
 public:
@@ -92,9 +170,41 @@ public:
 public:
 	// 初始化视频编码器, 默认为libx264编码器.
 	void init_video_encoder(video_config vc, std::string encoder = "libx264");
+	// 使用已经打开好的编码器 (例如从 codec_pool 取来的), 接管其所有权.
+	void init_video_encoder(const video_config& vc, AVCodecContext* opened);
+
+	// 按 vc 创建并打开一个视频编码器, 调用方负责释放. 出错抛出 std::runtime_error.
+	static AVCodecContext* open_video_codec(const video_config& vc, bool global_header, const std::string& encoder = "libx264");
+
+	// 输出格式是否要求编码器生成全局头.
+	bool need_global_header() const { return m_muxer->need_global_header(); }
+	// 还没有打开输出时按格式名判断, 未知的格式和 packet_muxer 一样按 mpegts 处理.
+	static bool format_needs_global_header(const std::string& fmt);
+
+	// 直接写入在别处编码好的视频包 (参数必须和 init_video_encoder 一致), 时间戳以视频编码器的 time_base 为单位.
+	void write_video_packet(const AVPacket* pkt);
+
+	// 下一帧视频编成关键帧.
+	void request_keyframe() { m_force_keyframe = true; }
+
+	// 输出跟不上时在 [min_kbps, max_kbps] 之内调整视频码率, 最大码率和 VBV 按比例跟着变,
+	// 新码率从一个关键帧开始. 要在 init_video_encoder 之后设置, max_kbps 为 0 表示不调整.
+	void set_adaptive_bitrate(int min_kbps, int max_kbps);
+	const bitrate_adapter& adaptive_bitrate() const { return m_bitrate_adapter; }
+
+	// 暂停恢复后调用, 之后调用方给出的音频时间戳接着上一帧往下排. 要在音频编码的线程里调用.
+	void rebase_audio() { m_audio_rebase = true; }
 
 	// 向视频编码器输入一帧视频.
-	void do_video_frame(uint8_t* data, int width, int height, int64_t timestamp);
+	// input_time 是这一帧进入编码库时的时钟 (av_gettime_relative), 用于统计延迟.
+	// rois 按顺序排优先级, 重叠时前面的优先; 编译时的 libavutil 不支持时忽略.
+	void do_video_frame(uint8_t* data, int width, int height, int64_t timestamp, int64_t input_time = AV_NOPTS_VALUE,
+		const std::vector<roi_rect>* rois = NULL);
+
+	// 当前的 libavcodec 能否按区域调整画质.
+	static bool roi_supported() { return HAVE_AV_REGION_OF_INTEREST != 0; }
+	// 带着区域信息编码的帧数.
+	int64_t roi_frames() const { return m_roi_frames; }
 
 	// 初始化音频编码器, 默认为 libvo_aacenc 编码器.
 	void init_audio_encoder(audio_config ac, std::string encoder = "libvo_aacenc");
@@ -102,7 +212,7 @@ public:
 	// 向音频编码器输入一帧音频.
 	void do_audio_frame(uint8_t* data, long size, int64_t timestamp);
 
-	// 在初始化音频和视频编码器后, 必须调用write_header来写入视频格式头.
+	// 在初始化音频和视频编码器后, 必须调用write_header来写入视频格式头, 失败时抛出 std::runtime_error.
 	void write_header();
 
 	// 把delay的编码写入掉.
@@ -112,28 +222,81 @@ public:
 
 	// 音频音量调节.
 	void volume(int vol);
+
+	// 一路流没有数据时, 另一路最多缓存多长时间 (微秒) 的包.
+	void set_max_interleave_delta(int64_t us);
+
+	// 复用线程绑定的 cpu, 要在 write_header 之前设置.
+	void set_cpu_affinity(const cpu_set& cpus);
+
+	// MP4 的分片间隔, 见 packet_muxer::set_fragment_interval, 要在 write_header 之前设置.
+	void set_fragment_interval(int64_t us);
+
+	// 文件切分, 见 packet_muxer::set_rotation, 要在 write_header 之前设置.
+	void set_rotation(const std::string& name_template, int64_t max_bytes, int64_t max_duration);
+
+	// 复用队列的状态.
+	mux_stats stats() const;
+
+	// 帧缓冲池和两路包池新分配的次数, 稳定之后只有复用跟不上时包池才会增长.
+	int64_t pool_allocations() const;
 private:
 	void audio_volume(uint8_t* buffer, int size, int vol);
 	void SwrConvert(uint8_t* buffer, int size, AVFrame** dst);
+#if HAVE_AVCODEC_SEND_RECEIVE
+	// 从池里取一块帧缓冲, 池新分配时记一次.
+	AVBufferRef* pool_get(AVBufferPool* pool, std::vector<uint8_t*>& seen);
+#endif
+
+	// 把一帧送进编码器, 然后把所有可用的包都取出来写入文件.
+	int encode_frame(encode_pipe& pipe, int stream_index, const AVFrame* frame);
+	// 取出编码器里当前所有可用的包, 返回 AVERROR(EAGAIN) 或 AVERROR_EOF.
+	int drain_packets(encode_pipe& pipe, int stream_index);
+	// pkt 来自 m_muxer 的包池, 所有权交给复用线程.
+	void write_packet(AVPacket* pkt, AVCodecContext* ctx, int stream_index);
+	// 按打开时的比例改视频编码器的码率参数, libx264 在下一帧之前重新配置.
+	void apply_bitrate(int kbps);
 
 private:
-	AVFormatContext* m_fmt_ctx;
-	std::string m_fmt_name;
+	boost::scoped_ptr<packet_muxer> m_muxer;
 	AVCodecContext* m_h264_ctx;
 	AVCodecContext* m_audio_ctx;
-	AVStream* m_video_stream;
-	AVStream* m_audio_stream;
+	encode_pipe m_video_pipe;
+	encode_pipe m_audio_pipe;
+	int m_video_index;
+	int m_audio_index;
 	boost::asio::streambuf m_streambuf;
 	int64_t m_vframe_index;
 	int64_t m_aframe_index;
+	boost::atomic<bool> m_force_keyframe;
+	bitrate_adapter m_bitrate_adapter;
+	// 视频编码器打开时的码率参数, 调整码率时按比例缩放.
+	int64_t m_base_bit_rate;
+	int64_t m_base_max_rate;
+	int m_base_buffer_size;
+	boost::atomic<int64_t> m_roi_frames;
+	// 调用方给出音频时间戳时, 暂停造成的空档从时间戳里减掉.
+	bool m_audio_rebase;
+	int64_t m_audio_next_ts;
+	int64_t m_audio_ts_offset;
 	SwrContext* m_swr_ctx;
 	std::vector<uint8_t> m_sws_buffer;
 	int m_sws_buffer_size;
 	struct SwsContext* m_swsctx;
+	AVFrame* m_video_frame;
+#if HAVE_AVCODEC_SEND_RECEIVE
+	// avcodec_send_frame 会给没有引用计数的帧另外分配一份拷贝, 视频和音频帧都改用池里的缓冲.
+	AVBufferPool* m_video_pool;
+	AVBufferPool* m_audio_pool;
+	// 池里出现过的缓冲, 取到没见过的说明池新分配了一块.
+	std::vector<uint8_t*> m_video_buffers;
+	std::vector<uint8_t*> m_audio_buffers;
+#endif
+	boost::atomic<int64_t> m_frame_allocations;
+	AVFrame* m_audio_frame;
 	std::vector<uint8_t> m_swr_buffer;
 	std::vector<uint8_t> m_audio_buffer;
 
-	boost::mutex m_mutex;
 	uint8_t* m_clone_frame;
 	int m_clone_frame_len;
 
@@ -0,0 +1,66 @@
+﻿
+#include <algorithm>
+
+#include "frame_governor.hpp"
+
+extern "C"
+{
+#include "libavutil/avutil.h"
+#include "libavutil/mathematics.h"
+}
+
+namespace libencoder {
+
+frame_governor::frame_governor(int fps)
+	: m_fps(fps > 0 ? fps : 25)
+	, m_origin(AV_NOPTS_VALUE)
+	, m_last_slot(-1)
+	, m_last_input(AV_NOPTS_VALUE)
+	, m_rebase(false)
+	, m_dropped(0)
+	, m_duplicated(0)
+{
+}
+
+int64_t frame_governor::slot_timestamp(int64_t slot) const
+{
+	return m_origin + av_rescale(slot, AV_TIME_BASE, m_fps);
+}
+
+frame_governor::decision frame_governor::admit(int64_t timestamp)
+{
+	decision d = decision();
+
+	if (m_origin == AV_NOPTS_VALUE)
+		m_origin = timestamp;
+
+	// 采集端重新开始计时, 把原点挪过去, 让这一帧接在上一帧后面.
+	if (m_last_input != AV_NOPTS_VALUE && (m_rebase || timestamp < m_last_input - resync_threshold))
+		m_origin = timestamp - av_rescale(m_last_slot + 1, AV_TIME_BASE, m_fps);
+	m_rebase = false;
+	m_last_input = timestamp;
+
+	// 四舍五入到最近的格子, 采集时间的抖动不会造成丢帧.
+	int64_t slot = av_rescale_rnd(timestamp - m_origin, m_fps, AV_TIME_BASE, AV_ROUND_NEAR_INF);
+
+	if (slot <= m_last_slot)
+	{
+		++m_dropped;
+		return d;
+	}
+
+	if (m_last_slot >= 0)
+	{
+		int64_t gap = slot - m_last_slot - 1;
+		d.duplicates = static_cast<int>(std::min<int64_t>(gap, m_fps * max_duplicate_seconds));
+		d.duplicate_slot = m_last_slot + 1;
+		m_duplicated += d.duplicates;
+	}
+
+	m_last_slot = slot;
+	d.encode = true;
+	d.timestamp = slot_timestamp(slot);
+	return d;
+}
+
+}
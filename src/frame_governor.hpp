@@ -0,0 +1,57 @@
+﻿
+#pragma once
+
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+
+namespace libencoder {
+
+// 把输入的时间戳对齐到会话的帧率网格上.
+// 同一个格子里多来的帧直接丢掉, 不做任何像素处理; 中间空出的格子用上一帧补上.
+// 输出的时间戳严格递增, 复用器不会再收到重复或者倒退的 PTS.
+class frame_governor
+{
+public:
+	// 一次最多补这么多秒的帧, 更长的停顿直接跳过去.
+	static const int max_duplicate_seconds = 2;
+	// 时间戳倒退超过这么多微秒当作采集端重新开始计时.
+	static const int64_t resync_threshold = 1000000;
+
+	explicit frame_governor(int fps);
+
+	struct decision
+	{
+		// 这一帧是否需要编码.
+		bool encode;
+		// 编码这一帧之前先重复上一帧多少次.
+		int duplicates;
+		// 第一个要补的帧所在的格子, 时间戳用 slot_timestamp 计算.
+		int64_t duplicate_slot;
+		// 这一帧对齐后的时间戳 (微秒).
+		int64_t timestamp;
+	};
+
+	decision admit(int64_t timestamp);
+
+	// 暂停恢复后调用: 下一帧不管时间戳是多少都接在上一帧后面, 不补帧.
+	void rebase() { m_rebase = true; }
+
+	// 格子编号对应的时间戳 (微秒).
+	int64_t slot_timestamp(int64_t slot) const;
+
+	int64_t frames_dropped() const { return m_dropped; }
+	int64_t frames_duplicated() const { return m_duplicated; }
+
+private:
+	int m_fps;
+	int64_t m_origin;
+	int64_t m_last_slot;
+	int64_t m_last_input;
+	bool m_rebase;
+
+	boost::atomic<int64_t> m_dropped;
+	boost::atomic<int64_t> m_duplicated;
+};
+
+}
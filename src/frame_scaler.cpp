@@ -0,0 +1,349 @@
+﻿
+#include <cstring>
+
+#include "frame_scaler.hpp"
+
+extern "C"
+{
+#include "libswscale/swscale.h"
+#include "libavutil/imgutils.h"
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define LIBENCODER_SSE2 1
+#	include <emmintrin.h>
+#else
+#	define LIBENCODER_SSE2 0
+#endif
+
+namespace libencoder {
+
+bool parse_scale_filter(const std::string& name, scale_filter& filter)
+{
+	if (name == "fast_bilinear")
+		filter = scale_fast_bilinear;
+	else if (name == "bilinear")
+		filter = scale_bilinear;
+	else if (name == "bicubic")
+		filter = scale_bicubic;
+	else if (name == "lanczos")
+		filter = scale_lanczos;
+	else
+		return false;
+	return true;
+}
+
+namespace {
+
+// BT.601 有限范围, 和 swscale 默认的系数一致.
+inline uint8_t rgb_to_y(int r, int g, int b)
+{
+	return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+inline uint8_t rgb_to_u(int r, int g, int b)
+{
+	return static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+inline uint8_t rgb_to_v(int r, int g, int b)
+{
+	return static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+#if LIBENCODER_SSE2
+// 8 个 BGR0 像素拆成 16 位的 B, G, R.
+inline void split_bgr0(const uint8_t* p, __m128i& b, __m128i& g, __m128i& r)
+{
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	__m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	__m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+	b = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+	g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask), _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+	r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask), _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+}
+
+inline __m128i luma8(__m128i b, __m128i g, __m128i r)
+{
+	// 最大 56228, 按无符号 16 位算不会溢出.
+	__m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+		_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+	y = _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+	return _mm_packus_epi16(y, y);
+}
+
+// 上下两行相邻两个像素的平均, 前 4 个 16 位有效.
+inline __m128i average2x2(__m128i top, __m128i bottom)
+{
+	__m128i sum = _mm_madd_epi16(_mm_add_epi16(top, bottom), _mm_set1_epi16(1));
+	sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+	return _mm_packs_epi32(sum, sum);
+}
+
+inline void store4(uint8_t* dst, __m128i v)
+{
+	int32_t value = _mm_cvtsi128_si32(v);
+	memcpy(dst, &value, 4);
+}
+#endif
+
+// 两行 BGR0 转成两行 Y 和一行 U, V, width 为偶数.
+void bgr0_to_yuv420_rows(const uint8_t* row0, const uint8_t* row1,
+	uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+{
+	int x = 0;
+#if LIBENCODER_SSE2
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i b0, g0, r0, b1, g1, r1;
+		split_bgr0(row0 + x * 4, b0, g0, r0);
+		split_bgr0(row1 + x * 4, b1, g1, r1);
+
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(y0 + x), luma8(b0, g0, r0));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(y1 + x), luma8(b1, g1, r1));
+
+		__m128i b = average2x2(b0, b1);
+		__m128i g = average2x2(g0, g1);
+		__m128i r = average2x2(r0, r1);
+		__m128i cb = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-38)), _mm_mullo_epi16(g, _mm_set1_epi16(-74))),
+			_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)), _mm_set1_epi16(128)));
+		__m128i cr = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)), _mm_mullo_epi16(g, _mm_set1_epi16(-94))),
+			_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(-18)), _mm_set1_epi16(128)));
+		cb = _mm_add_epi16(_mm_srai_epi16(cb, 8), _mm_set1_epi16(128));
+		cr = _mm_add_epi16(_mm_srai_epi16(cr, 8), _mm_set1_epi16(128));
+		__m128i uv = _mm_packus_epi16(cb, cr);
+		store4(u + x / 2, uv);
+		store4(v + x / 2, _mm_srli_si128(uv, 8));
+	}
+#endif
+	for (; x < width; x += 2)
+	{
+		const uint8_t* a = row0 + x * 4;
+		const uint8_t* b = row1 + x * 4;
+		y0[x] = rgb_to_y(a[2], a[1], a[0]);
+		y0[x + 1] = rgb_to_y(a[6], a[5], a[4]);
+		y1[x] = rgb_to_y(b[2], b[1], b[0]);
+		y1[x + 1] = rgb_to_y(b[6], b[5], b[4]);
+
+		int bl = (a[0] + a[4] + b[0] + b[4] + 2) >> 2;
+		int gr = (a[1] + a[5] + b[1] + b[5] + 2) >> 2;
+		int rd = (a[2] + a[6] + b[2] + b[6] + 2) >> 2;
+		u[x / 2] = rgb_to_u(rd, gr, bl);
+		v[x / 2] = rgb_to_v(rd, gr, bl);
+	}
+}
+
+// 把 factor 行 BGR0 按 factor x factor 的方块平均成一行.
+void box_bgr0_row(const uint8_t* src, int stride, int factor, uint8_t* dst, int dst_width)
+{
+	int x = 0;
+#if LIBENCODER_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	if (factor == 2)
+	{
+		for (; x + 2 <= dst_width; x += 2)
+		{
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 8));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + stride + x * 8));
+			__m128i v01 = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i v23 = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+			__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(v01, v23), _mm_unpackhi_epi64(v01, v23));
+			sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x * 4), _mm_packus_epi16(sum, sum));
+		}
+	}
+	else if (factor == 4)
+	{
+		for (; x < dst_width; x++)
+		{
+			__m128i sum = zero;
+			for (int row = 0; row < 4; row++)
+			{
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + row * stride + x * 16));
+				sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero)));
+			}
+			sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+			sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(8)), 4);
+			store4(dst + x * 4, _mm_packus_epi16(sum, sum));
+		}
+	}
+#endif
+	int area = factor * factor;
+	for (; x < dst_width; x++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			int sum = 0;
+			for (int row = 0; row < factor; row++)
+			{
+				const uint8_t* p = src + row * stride + x * factor * 4 + c;
+				for (int col = 0; col < factor; col++)
+					sum += p[col * 4];
+			}
+			dst[x * 4 + c] = static_cast<uint8_t>((sum + area / 2) / area);
+		}
+	}
+}
+
+// 单个平面按 factor x factor 的方块平均缩小.
+void box_plane(const uint8_t* src, int src_stride, int factor, uint8_t* dst, int dst_stride, int width, int height)
+{
+	int area = factor * factor;
+	for (int y = 0; y < height; y++, src += src_stride * factor, dst += dst_stride)
+	{
+		int x = 0;
+#if LIBENCODER_SSE2
+		const __m128i low = _mm_set1_epi16(0xFF);
+		if (factor == 2)
+		{
+			for (; x + 8 <= width; x += 8)
+			{
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 2));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + src_stride + x * 2));
+				__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8)),
+					_mm_add_epi16(_mm_and_si128(b, low), _mm_srli_epi16(b, 8)));
+				sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(sum, sum));
+			}
+		}
+		else if (factor == 4)
+		{
+			for (; x + 4 <= width; x += 4)
+			{
+				__m128i sum = _mm_setzero_si128();
+				for (int row = 0; row < 4; row++)
+				{
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + row * src_stride + x * 4));
+					sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8)));
+				}
+				__m128i quad = _mm_madd_epi16(sum, _mm_set1_epi16(1));
+				quad = _mm_srli_epi32(_mm_add_epi32(quad, _mm_set1_epi32(8)), 4);
+				quad = _mm_packs_epi32(quad, quad);
+				store4(dst + x, _mm_packus_epi16(quad, quad));
+			}
+		}
+#endif
+		for (; x < width; x++)
+		{
+			int sum = 0;
+			for (int row = 0; row < factor; row++)
+			{
+				const uint8_t* p = src + row * src_stride + x * factor;
+				for (int col = 0; col < factor; col++)
+					sum += p[col];
+			}
+			dst[x] = static_cast<uint8_t>((sum + area / 2) / area);
+		}
+	}
+}
+
+int path_factor(frame_scaler::path p)
+{
+	return p == frame_scaler::path_box4 ? 4 : p == frame_scaler::path_box2 ? 2 : 1;
+}
+
+}
+
+frame_scaler::frame_scaler(scale_filter filter)
+	: m_filter(filter)
+	, m_sws(NULL)
+	, m_path(path_none)
+{
+}
+
+frame_scaler::~frame_scaler()
+{
+	if (m_sws)
+		sws_freeContext(m_sws);
+}
+
+frame_scaler::path frame_scaler::choose(int width, int height, int dst_width, int dst_height) const
+{
+	// 快速路径按 2x2 的色度块处理, 输出尺寸必须是偶数.
+	if (dst_width % 2 || dst_height % 2)
+		return path_swscale;
+	if (width == dst_width && height == dst_height)
+		return path_identity;
+	if (m_filter == scale_lanczos)
+		return path_swscale;
+	if (width == dst_width * 2 && height == dst_height * 2)
+		return path_box2;
+	if (width == dst_width * 4 && height == dst_height * 4)
+		return path_box4;
+	return path_swscale;
+}
+
+SwsContext* frame_scaler::context(int width, int height, int src_format, int dst_width, int dst_height)
+{
+	static const int flags[] = { SWS_FAST_BILINEAR, SWS_BILINEAR, SWS_BICUBIC, SWS_LANCZOS };
+
+	// 输入尺寸不变时一直用同一个上下文.
+	m_sws = sws_getCachedContext(m_sws, width, height, static_cast<AVPixelFormat>(src_format), dst_width, dst_height,
+		AV_PIX_FMT_YUV420P, flags[m_filter], NULL, NULL, NULL);
+	return m_sws;
+}
+
+bool frame_scaler::scale_bgr0(const uint8_t* src, int src_stride, int width, int height,
+	uint8_t* const dst[], const int dst_linesize[], int dst_width, int dst_height)
+{
+	m_path = choose(width, height, dst_width, dst_height);
+	if (m_path == path_swscale)
+	{
+		if (!context(width, height, AV_PIX_FMT_BGR0, dst_width, dst_height))
+			return false;
+		const uint8_t* planes[4] = { src, NULL, NULL, NULL };
+		int linesize[4] = { src_stride, 0, 0, 0 };
+		sws_scale(m_sws, planes, linesize, 0, height, dst, dst_linesize);
+		return true;
+	}
+
+	int factor = path_factor(m_path);
+	if (factor > 1)
+		m_rows.resize(dst_width * 4 * 2);
+
+	for (int y = 0; y < dst_height; y += 2)
+	{
+		const uint8_t* row0 = src + static_cast<std::ptrdiff_t>(y) * factor * src_stride;
+		const uint8_t* row1 = row0 + static_cast<std::ptrdiff_t>(factor) * src_stride;
+		if (factor > 1)
+		{
+			box_bgr0_row(row0, src_stride, factor, &m_rows[0], dst_width);
+			box_bgr0_row(row1, src_stride, factor, &m_rows[dst_width * 4], dst_width);
+			row0 = &m_rows[0];
+			row1 = &m_rows[dst_width * 4];
+		}
+		bgr0_to_yuv420_rows(row0, row1,
+			dst[0] + y * dst_linesize[0], dst[0] + (y + 1) * dst_linesize[0],
+			dst[1] + y / 2 * dst_linesize[1], dst[2] + y / 2 * dst_linesize[2], dst_width);
+	}
+	return true;
+}
+
+bool frame_scaler::scale_yuv420(const uint8_t* const src[], const int src_linesize[], int width, int height,
+	uint8_t* const dst[], const int dst_linesize[], int dst_width, int dst_height)
+{
+	m_path = choose(width, height, dst_width, dst_height);
+	switch (m_path)
+	{
+	case path_identity:
+		av_image_copy(const_cast<uint8_t**>(dst), const_cast<int*>(dst_linesize), const_cast<const uint8_t**>(src), src_linesize,
+			AV_PIX_FMT_YUV420P, width, height);
+		return true;
+	case path_box2:
+	case path_box4:
+		for (int p = 0; p < 3; p++)
+		{
+			int w = p ? dst_width / 2 : dst_width;
+			int h = p ? dst_height / 2 : dst_height;
+			box_plane(src[p], src_linesize[p], path_factor(m_path), dst[p], dst_linesize[p], w, h);
+		}
+		return true;
+	default:
+		if (!context(width, height, AV_PIX_FMT_YUV420P, dst_width, dst_height))
+			return false;
+		sws_scale(m_sws, src, src_linesize, 0, height, dst, dst_linesize);
+		return true;
+	}
+}
+
+}
@@ -0,0 +1,84 @@
+﻿
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+struct SwsContext;
+
+namespace libencoder {
+
+// 任意比例缩放时 swscale 用的滤镜, 从快到好.
+enum scale_filter
+{
+	scale_fast_bilinear,
+	scale_bilinear,
+	scale_bicubic,
+	scale_lanczos,
+};
+
+// "fast_bilinear", "bilinear", "bicubic", "lanczos", 不认识的名字返回 false.
+bool parse_scale_filter(const std::string& name, scale_filter& filter);
+
+// 一帧输入视频, 数据由调用方持有.
+struct video_input
+{
+	enum pixel_format { bgr0, i420 };
+
+	pixel_format format;
+	// bgr0 只用 planes[0] / linesize[0].
+	const uint8_t* planes[3];
+	int linesize[3];
+	int width;
+	int height;
+	int64_t timestamp;
+	// 只对 bgr0 有效.
+	bool flip;
+};
+
+// 把 BGR0 或 YUV420P 的画面转换缩放成 YUV420P.
+// 输入输出尺寸相同, 或者输入正好是输出的 2 倍, 4 倍时直接用盒式滤波,
+// 缩小和颜色转换逐行一起做完, 不经过整帧的中间缓冲; 其他比例才交给缓存的 swscale 上下文.
+// lanczos 要的是锐度, 这时只保留尺寸相同的快速路径.
+class frame_scaler : public boost::noncopyable
+{
+public:
+	enum path
+	{
+		path_none,
+		path_identity,
+		path_box2,
+		path_box4,
+		path_swscale,
+	};
+
+	explicit frame_scaler(scale_filter filter = scale_bicubic);
+	~frame_scaler();
+
+	scale_filter filter() const { return m_filter; }
+
+	// 创建 swscale 上下文失败时返回 false.
+	bool scale_bgr0(const uint8_t* src, int src_stride, int width, int height,
+		uint8_t* const dst[], const int dst_linesize[], int dst_width, int dst_height);
+	bool scale_yuv420(const uint8_t* const src[], const int src_linesize[], int width, int height,
+		uint8_t* const dst[], const int dst_linesize[], int dst_width, int dst_height);
+
+	// 上一帧走的是哪条路径.
+	path last_path() const { return m_path; }
+
+private:
+	path choose(int width, int height, int dst_width, int dst_height) const;
+	SwsContext* context(int width, int height, int src_format, int dst_width, int dst_height);
+
+private:
+	scale_filter m_filter;
+	SwsContext* m_sws;
+	// 缩小后的两行 BGR0, 给颜色转换用.
+	std::vector<uint8_t> m_rows;
+	path m_path;
+};
+
+}
@@ -0,0 +1,157 @@
+﻿
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+
+extern "C"
+{
+#include "libavutil/log.h"
+}
+
+#include <boost/thread/shared_mutex.hpp>
+
+#include "log_ring.hpp"
+
+namespace libencoder {
+
+static boost::atomic<int> current_level(AV_LOG_WARNING);
+
+// sink 和 user 一起在锁里换, 回调期间拿着共享锁, 换 sink 的一方要等回调都结束.
+// has_sink 让没有 sink 时的日志不用碰锁.
+static boost::atomic<bool> has_sink(false);
+static log_sink current_sink = NULL;
+static void* current_user = NULL;
+
+static boost::shared_mutex& sink_mutex()
+{
+	// 和 log_ring 一样故意不析构.
+	static boost::shared_mutex* mutex = new boost::shared_mutex;
+	return *mutex;
+}
+
+log_ring& log_ring::instance()
+{
+	// FFmpeg 在别的静态对象析构时也可能打日志, 故意不析构.
+	static log_ring* ring = new log_ring;
+	return *ring;
+}
+
+log_ring::log_ring()
+	: m_next(0)
+{
+	for (int i = 0; i < slot_count; i++)
+	{
+		m_slots[i].seq = 0;
+		m_slots[i].level = 0;
+		m_slots[i].text[0] = 0;
+	}
+}
+
+void log_ring::write(int level, const char* message)
+{
+	uint64_t n = m_next.fetch_add(1, boost::memory_order_relaxed);
+	slot& s = m_slots[n % slot_count];
+
+	s.seq.store(n * 2 + 1, boost::memory_order_relaxed);
+	boost::atomic_thread_fence(boost::memory_order_release);
+
+	s.level = level;
+	strncpy(s.text, message, message_size - 1);
+	s.text[message_size - 1] = 0;
+
+	s.seq.store(n * 2 + 2, boost::memory_order_release);
+}
+
+static const char* level_name(int level)
+{
+	if (level <= AV_LOG_FATAL)
+		return "fatal";
+	if (level <= AV_LOG_ERROR)
+		return "error";
+	if (level <= AV_LOG_WARNING)
+		return "warning";
+	if (level <= AV_LOG_INFO)
+		return "info";
+	if (level <= AV_LOG_VERBOSE)
+		return "verbose";
+	return "debug";
+}
+
+std::string log_ring::dump() const
+{
+	std::string out;
+	uint64_t end = m_next.load(boost::memory_order_acquire);
+	uint64_t begin = end > static_cast<uint64_t>(slot_count) ? end - slot_count : 0;
+
+	char text[message_size];
+	for (uint64_t n = begin; n < end; n++)
+	{
+		const slot& s = m_slots[n % slot_count];
+
+		uint64_t seq = s.seq.load(boost::memory_order_acquire);
+		if (seq != n * 2 + 2)
+			continue;
+		int level = s.level;
+		memcpy(text, s.text, message_size);
+		boost::atomic_thread_fence(boost::memory_order_acquire);
+		if (s.seq.load(boost::memory_order_relaxed) != seq)
+			continue;
+
+		text[message_size - 1] = 0;
+		std::size_t length = strlen(text);
+		out += '[';
+		out += level_name(level);
+		out += "] ";
+		out.append(text, length);
+		if (length == 0 || text[length - 1] != '\n')
+			out += '\n';
+	}
+	return out;
+}
+
+void set_log_level(int level)
+{
+	current_level = level;
+	av_log_set_level(level);
+}
+
+int log_level()
+{
+	return current_level;
+}
+
+void set_log_sink(log_sink sink, void* user)
+{
+	boost::unique_lock<boost::shared_mutex> l(sink_mutex());
+	current_sink = sink;
+	current_user = sink ? user : NULL;
+	has_sink = sink != NULL;
+}
+
+static void log_callback(void* avcl, int level, const char* fmt, va_list args)
+{
+	// 高 8 位是颜色, 不是级别.
+	level &= 0xff;
+	if (level > current_level.load(boost::memory_order_relaxed))
+		return;
+
+	char line[log_ring::message_size];
+	int print_prefix = 1;
+	av_log_format_line(avcl, level, fmt, args, line, sizeof(line), &print_prefix);
+
+	log_ring::instance().write(level, line);
+
+	if (!has_sink.load(boost::memory_order_acquire))
+		return;
+	boost::shared_lock<boost::shared_mutex> l(sink_mutex());
+	if (current_sink)
+		current_sink(level, line, current_user);
+}
+
+void install_log_callback()
+{
+	av_log_set_level(current_level);
+	av_log_set_callback(&log_callback);
+}
+
+}
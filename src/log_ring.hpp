@@ -0,0 +1,55 @@
+﻿
+#pragma once
+
+#include <cstdarg>
+#include <string>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace libencoder {
+
+// 最近的日志, 固定大小的环形缓冲, 写入不加锁也不分配内存.
+// 写满之后覆盖最旧的, 出错时用 dump 取出来看.
+class log_ring : public boost::noncopyable
+{
+public:
+	enum { slot_count = 512, message_size = 248 };
+
+	static log_ring& instance();
+
+	// 把一条格式化好的日志拷到下一个槽里, 太长的截断.
+	void write(int level, const char* message);
+
+	// 从旧到新拼成多行文本, 正在被覆盖的槽跳过.
+	std::string dump() const;
+
+private:
+	log_ring();
+
+	struct slot
+	{
+		// 偶数表示写完了第 seq / 2 - 1 条, 奇数表示正在写.
+		boost::atomic<uint64_t> seq;
+		int level;
+		char text[message_size];
+	};
+
+	boost::atomic<uint64_t> m_next;
+	slot m_slots[slot_count];
+};
+
+// 级别和 FFmpeg 的 AV_LOG_* 一致, 高于这个级别的日志在格式化之前就丢掉.
+void set_log_level(int level);
+int log_level();
+
+// 除了写进 log_ring, 另外把格式化好的每条日志交给 sink, NULL 表示只写 log_ring.
+// 等正在进行的 sink 回调结束才返回, 不能在回调里调用.
+typedef void (*log_sink)(int level, const char* message, void* user);
+void set_log_sink(log_sink sink, void* user);
+
+// 接管 FFmpeg (包括 x264) 的日志输出.
+void install_log_callback();
+
+}
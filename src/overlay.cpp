@@ -0,0 +1,231 @@
+﻿
+#include <algorithm>
+
+#include "overlay.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define LIBENCODER_SSE2 1
+#	include <emmintrin.h>
+#else
+#	define LIBENCODER_SSE2 0
+#endif
+
+namespace libencoder {
+
+namespace {
+
+inline uint8_t clamp_byte(int v)
+{
+	return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// x / 255 四舍五入, x 不超过 65535.
+inline int div255(int x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+// 向下取整的除 2, 负数也一样.
+inline int floor_half(int v)
+{
+	return v >= 0 ? v / 2 : -((1 - v) / 2);
+}
+
+// 预乘的 out = src * ga + dst * (1 - a * ga).
+void blend_row(uint8_t* dst, const uint8_t* color, const uint8_t* alpha, int n, int global_alpha)
+{
+	int i = 0;
+#if LIBENCODER_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i ga = _mm_set1_epi16(static_cast<short>(global_alpha));
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(dst + i)), zero);
+		__m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(color + i)), zero);
+		__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(alpha + i)), zero);
+
+		__m128i s = _mm_add_epi16(_mm_mullo_epi16(c, ga), round);
+		s = _mm_srli_epi16(_mm_add_epi16(s, _mm_srli_epi16(s, 8)), 8);
+		__m128i ea = _mm_add_epi16(_mm_mullo_epi16(a, ga), round);
+		ea = _mm_srli_epi16(_mm_add_epi16(ea, _mm_srli_epi16(ea, 8)), 8);
+		__m128i t = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(full, ea)), round);
+		t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+		__m128i out = _mm_packus_epi16(_mm_add_epi16(s, t), zero);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), out);
+	}
+#endif
+	for (; i < n; i++)
+	{
+		int s = div255(color[i] * global_alpha);
+		int ea = div255(alpha[i] * global_alpha);
+		dst[i] = clamp_byte(s + div255(dst[i] * (255 - ea)));
+	}
+}
+
+}
+
+overlay_compositor::overlay_compositor()
+	: m_count(0)
+{
+}
+
+void overlay_compositor::convert(const uint8_t* bgra, int stride, int width, int height, sprite& s)
+{
+	s.width = width;
+	s.height = height;
+	s.luma.resize(static_cast<std::size_t>(width) * height);
+	s.luma_alpha.resize(s.luma.size());
+	s.luma_spans.assign(height, std::make_pair(width, 0));
+
+	// 预乘的 Y = a * Y / 255, 颜色已经乘过 alpha, 只有偏移量要乘.
+	for (int row = 0; row < height; row++)
+	{
+		const uint8_t* p = bgra + static_cast<std::ptrdiff_t>(row) * stride;
+		for (int col = 0; col < width; col++, p += 4)
+		{
+			int a = p[3];
+			std::size_t i = static_cast<std::size_t>(row) * width + col;
+			s.luma[i] = clamp_byte(((66 * p[2] + 129 * p[1] + 25 * p[0] + 128) >> 8) + div255(16 * a));
+			s.luma_alpha[i] = static_cast<uint8_t>(a);
+			if (a)
+			{
+				s.luma_spans[row].first = std::min(s.luma_spans[row].first, col);
+				s.luma_spans[row].second = col + 1;
+			}
+		}
+	}
+
+	// 色度取 2x2 的平均, 超出图片的像素当作全透明.
+	s.chroma_width = (width + 1) / 2;
+	s.chroma_height = (height + 1) / 2;
+	s.u.resize(static_cast<std::size_t>(s.chroma_width) * s.chroma_height);
+	s.v.resize(s.u.size());
+	s.chroma_alpha.resize(s.u.size());
+	s.chroma_spans.assign(s.chroma_height, std::make_pair(s.chroma_width, 0));
+
+	for (int row = 0; row < s.chroma_height; row++)
+	{
+		for (int col = 0; col < s.chroma_width; col++)
+		{
+			int r = 0, g = 0, b = 0, a = 0;
+			for (int dy = 0; dy < 2; dy++)
+			{
+				for (int dx = 0; dx < 2; dx++)
+				{
+					int sx = col * 2 + dx;
+					int sy = row * 2 + dy;
+					if (sx >= width || sy >= height)
+						continue;
+					const uint8_t* p = bgra + static_cast<std::ptrdiff_t>(sy) * stride + sx * 4;
+					b += p[0];
+					g += p[1];
+					r += p[2];
+					a += p[3];
+				}
+			}
+
+			std::size_t i = static_cast<std::size_t>(row) * s.chroma_width + col;
+			s.u[i] = clamp_byte(((-38 * r - 74 * g + 112 * b + 512) >> 10) + div255(128 * ((a + 2) / 4)));
+			s.v[i] = clamp_byte(((112 * r - 94 * g - 18 * b + 512) >> 10) + div255(128 * ((a + 2) / 4)));
+			s.chroma_alpha[i] = static_cast<uint8_t>((a + 2) / 4);
+			if (s.chroma_alpha[i])
+			{
+				s.chroma_spans[row].first = std::min(s.chroma_spans[row].first, col);
+				s.chroma_spans[row].second = col + 1;
+			}
+		}
+	}
+}
+
+bool overlay_compositor::set_image(int id, const uint8_t* bgra, int stride, int width, int height)
+{
+	if (!bgra || width <= 0 || height <= 0 || stride < width * 4)
+		return false;
+
+	// 转换在锁外做, 不耽误正在编码的帧.
+	sprite s;
+	convert(bgra, stride, width, height, s);
+
+	boost::mutex::scoped_lock l(m_mutex);
+	std::map<int, sprite>::iterator it = m_sprites.find(id);
+	if (it != m_sprites.end())
+	{
+		s.x = it->second.x;
+		s.y = it->second.y;
+		s.alpha = it->second.alpha;
+		std::swap(it->second, s);
+	}
+	else
+	{
+		std::swap(m_sprites[id], s);
+	}
+	m_count = static_cast<int>(m_sprites.size());
+	return true;
+}
+
+void overlay_compositor::remove(int id)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+	m_sprites.erase(id);
+	m_count = static_cast<int>(m_sprites.size());
+}
+
+void overlay_compositor::move(int id, int x, int y, int alpha)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+	std::map<int, sprite>::iterator it = m_sprites.find(id);
+	if (it == m_sprites.end())
+		return;
+	it->second.x = x;
+	it->second.y = y;
+	it->second.alpha = std::max(0, std::min(255, alpha));
+}
+
+void overlay_compositor::blend_plane(uint8_t* dst, int dst_linesize, int dst_width, int dst_height,
+	const uint8_t* color, const uint8_t* alpha, const spans& rows, int width, int x, int y, int global_alpha)
+{
+	int first_row = std::max(0, -y);
+	int last_row = std::min(static_cast<int>(rows.size()), dst_height - y);
+	for (int row = first_row; row < last_row; row++)
+	{
+		int begin = std::max(rows[row].first, -x);
+		int end = std::min(rows[row].second, dst_width - x);
+		if (begin >= end)
+			continue;
+
+		std::size_t offset = static_cast<std::size_t>(row) * width + begin;
+		blend_row(dst + static_cast<std::ptrdiff_t>(y + row) * dst_linesize + x + begin,
+			color + offset, alpha + offset, end - begin, global_alpha);
+	}
+}
+
+void overlay_compositor::blend(uint8_t* const planes[3], const int linesize[3], int width, int height)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	int chroma_width = (width + 1) / 2;
+	int chroma_height = (height + 1) / 2;
+	for (std::map<int, sprite>::const_iterator it = m_sprites.begin(); it != m_sprites.end(); ++it)
+	{
+		const sprite& s = it->second;
+		if (s.alpha == 0)
+			continue;
+
+		blend_plane(planes[0], linesize[0], width, height, &s.luma[0], &s.luma_alpha[0], s.luma_spans,
+			s.width, s.x, s.y, s.alpha);
+
+		// 奇数坐标的色度向左上对齐, 差半个像素看不出来.
+		int cx = floor_half(s.x);
+		int cy = floor_half(s.y);
+		blend_plane(planes[1], linesize[1], chroma_width, chroma_height, &s.u[0], &s.chroma_alpha[0], s.chroma_spans,
+			s.chroma_width, cx, cy, s.alpha);
+		blend_plane(planes[2], linesize[2], chroma_width, chroma_height, &s.v[0], &s.chroma_alpha[0], s.chroma_spans,
+			s.chroma_width, cx, cy, s.alpha);
+	}
+}
+
+}
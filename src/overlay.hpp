@@ -0,0 +1,72 @@
+﻿
+#pragma once
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace libencoder {
+
+// 把鼠标指针, 水印这类小图直接叠加到转换好的 YUV420P 上, 调用方不用再改自己的画面.
+// 图片设置时就转成预乘 alpha 的 YUVA, 每帧只混合图片覆盖到的行, 全透明的部分跳过.
+class overlay_compositor : public boost::noncopyable
+{
+public:
+	overlay_compositor();
+
+	// bgra 是预乘 alpha 的 BGRA. 已有的 id 换图时保留位置和透明度,
+	// 新的 id 放在 (0, 0), 不透明. id 大的叠在上面. 参数不对时返回 false.
+	bool set_image(int id, const uint8_t* bgra, int stride, int width, int height);
+	void remove(int id);
+
+	// 位置是输出画面上的像素 (裁剪和加黑边之后), 可以部分超出画面. alpha 为 0-255, 0 表示隐藏.
+	void move(int id, int x, int y, int alpha);
+
+	bool empty() const { return m_count == 0; }
+
+	// 叠加到一帧 YUV420P 上.
+	void blend(uint8_t* const planes[3], const int linesize[3], int width, int height);
+
+private:
+	// 一个平面上每行不透明部分的范围, 没有时 first >= second.
+	typedef std::vector<std::pair<int, int> > spans;
+
+	struct sprite
+	{
+		sprite() : x(0), y(0), alpha(255), width(0), height(0), chroma_width(0), chroma_height(0) {}
+
+		int x;
+		int y;
+		int alpha;
+
+		int width;
+		int height;
+		std::vector<uint8_t> luma;
+		std::vector<uint8_t> luma_alpha;
+		spans luma_spans;
+
+		int chroma_width;
+		int chroma_height;
+		std::vector<uint8_t> u;
+		std::vector<uint8_t> v;
+		std::vector<uint8_t> chroma_alpha;
+		spans chroma_spans;
+	};
+
+	static void convert(const uint8_t* bgra, int stride, int width, int height, sprite& s);
+	// 把图片的一个平面叠加到画面的一个平面上, (x, y) 是图片左上角在画面上的位置.
+	static void blend_plane(uint8_t* dst, int dst_linesize, int dst_width, int dst_height,
+		const uint8_t* color, const uint8_t* alpha, const spans& rows, int width, int x, int y, int global_alpha);
+
+private:
+	boost::mutex m_mutex;
+	std::map<int, sprite> m_sprites;
+	boost::atomic<int> m_count;
+};
+
+}
@@ -0,0 +1,768 @@
+﻿
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "packet_muxer.hpp"
+#include "trace.hpp"
+
+extern "C"
+{
+#include "libavutil/mathematics.h"
+#include "libavutil/opt.h"
+#include "libavutil/time.h"
+}
+
+// libavformat 57.33 开始 AVStream 用 codecpar 描述编码参数.
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 33, 100)
+#	define HAVE_AVSTREAM_CODECPAR 1
+#else
+#	define HAVE_AVSTREAM_CODECPAR 0
+#endif
+
+namespace libencoder {
+
+static const int64_t default_max_interleave_delta = 1000000;
+
+// 一个包最少的缓冲大小, 同 FF_MIN_BUFFER_SIZE, 新版本的 libavcodec 里没有这个宏了.
+static const int min_packet_capacity = 16384;
+// 缓冲末尾留给解析器的余量.
+static const int packet_padding = 64;
+
+static const int64_t latency_limits[latency_buckets - 1] =
+{
+	1000, 2000, 5000, 10000, 20000, 33000, 50000, 67000,
+	100000, 150000, 200000, 300000, 500000, 1000000, 2000000
+};
+
+int64_t latency_bucket_limit(int bucket)
+{
+	if (bucket < 0 || bucket >= latency_buckets - 1)
+		return INT64_MAX;
+	return latency_limits[bucket];
+}
+
+packet_muxer::mux_stream::mux_stream()
+	: st(NULL)
+	, type(AVMEDIA_TYPE_UNKNOWN)
+	, packet_capacity(min_packet_capacity)
+	, spare(NULL)
+	, allocations(0)
+	, depth(0)
+	, max_depth(0)
+	, last_pushed_dts(AV_NOPTS_VALUE)
+	, finished(false)
+	, last_written_dts(AV_NOPTS_VALUE)
+{
+	codec_time_base.num = 0;
+	codec_time_base.den = 1;
+}
+
+packet_muxer::packet_muxer(const std::string& filename, const std::string& fmt, const std::string& version)
+	: m_fmt_ctx(NULL)
+	, m_fmt_name(fmt)
+	, m_version(version)
+	, m_space_waiters(0)
+	, m_draining(false)
+	, m_max_interleave_delta(default_max_interleave_delta)
+	, m_fragment_interval(0)
+	, m_fragmented(false)
+	, m_fragment_start(AV_NOPTS_VALUE)
+	, m_fragments_written(0)
+	, m_rotate_bytes(0)
+	, m_rotate_duration(0)
+	, m_segment(0)
+	, m_file_start(0)
+	, m_file_first_dts(AV_NOPTS_VALUE)
+	, m_rotations(0)
+	, m_current_file(filename)
+	, m_packets_written(0)
+	, m_bytes_written(0)
+	, m_write_busy(0)
+	, m_queued_bytes(0)
+	, m_interleave_forced(0)
+	, m_latency_samples(0)
+	, m_latency_total(0)
+	, m_latency_max(0)
+{
+	memset(m_latency_histogram, 0, sizeof(m_latency_histogram));
+
+	m_fmt_ctx = open_output(filename);
+}
+
+AVFormatContext* packet_muxer::open_output(const std::string& filename)
+{
+	AVFormatContext* ctx = avformat_alloc_context();
+	if (!ctx)
+		throw std::bad_alloc();
+
+	ctx->oformat = av_guess_format(m_fmt_name.c_str(), NULL, NULL);
+	if (!ctx->oformat)
+	{
+		m_fmt_name = "mpegts";
+		ctx->oformat = av_guess_format("mpegts", NULL, NULL);
+	}
+	if (!ctx->oformat)
+	{
+		avformat_free_context(ctx);
+		throw std::runtime_error("Could not guess format: ");
+	}
+
+	if (ts_sender::is_url(filename))
+	{
+		// 数据报输出不经过 avio 的协议层, 复用器写出的 TS 直接交给 ts_sender 拼包和定时发送.
+		// 一个复用器只有一个发送端, 不支持文件切分.
+		if (m_sender)
+		{
+			avformat_free_context(ctx);
+			throw std::runtime_error("Could not rotate paced output " + filename);
+		}
+		try
+		{
+			m_sender.reset(new ts_sender(filename));
+		}
+		catch (std::exception&)
+		{
+			avformat_free_context(ctx);
+			throw;
+		}
+
+		uint8_t* buffer = static_cast<uint8_t*>(av_malloc(ts_sender::datagram_size));
+		ctx->pb = buffer ? avio_alloc_context(buffer, ts_sender::datagram_size, 1, m_sender.get(), NULL, &ts_sender::avio_write, NULL) : NULL;
+		if (!ctx->pb)
+			av_free(buffer);
+		ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
+	else
+	{
+		avio_open2(&ctx->pb, filename.c_str(), AVIO_FLAG_READ_WRITE, NULL, NULL);
+	}
+
+	av_dict_free(&ctx->metadata);
+	std::string name = "libencoder-" + m_version;
+	if (!m_version.empty())
+		name = "libencoder-" + m_version;
+	av_dict_set(&ctx->metadata, "service_name", name.c_str(), 0);
+	av_dict_set(&ctx->metadata, "title", "", 0);
+	av_dict_set(&ctx->metadata, "service_provider", "wanin.net", 0);
+	return ctx;
+}
+
+packet_muxer::~packet_muxer()
+{
+	stop_mux_thread();
+
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+	{
+		AVPacket* pkt;
+		while (m_streams[i]->queue.pop(pkt))
+			free_packet(pkt);
+		while (m_streams[i]->free_packets.pop(pkt))
+			free_packet(pkt);
+		if (m_streams[i]->spare)
+			free_packet(m_streams[i]->spare);
+		delete m_streams[i];
+	}
+
+	close_output(m_fmt_ctx);
+	avformat_free_context(m_fmt_ctx);
+}
+
+bool packet_muxer::need_global_header() const
+{
+	return (m_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) != 0;
+}
+
+int packet_muxer::add_stream(AVCodecContext* ctx)
+{
+	AVStream* st = avformat_new_stream(m_fmt_ctx, NULL);
+	if (!st)
+		throw std::runtime_error("Could not allocate stream!");
+
+#if HAVE_AVSTREAM_CODECPAR
+	if (avcodec_parameters_from_context(st->codecpar, ctx) < 0)
+		throw std::runtime_error("Could not copy codec parameters!");
+#else
+	if (avcodec_copy_context(st->codec, ctx) < 0)
+		throw std::runtime_error("Could not copy codec parameters!");
+	st->codec->codec_tag = 0;
+#endif
+	st->time_base = ctx->time_base;
+
+	mux_stream* s = new mux_stream;
+	s->st = st;
+	s->type = ctx->codec_type;
+	s->codec_time_base = ctx->time_base;
+#if HAVE_AVCODEC_SEND_RECEIVE
+	// avcodec_receive_packet 不用调用方的缓冲, 包里的数据是编码器给的引用, 池里只留 AVPacket 本身.
+	s->packet_capacity = 0;
+#else
+	// 视频包不会比一帧原始图像还大, 超出时编码器会自己另外分配.
+	if (ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+		s->packet_capacity = std::max(min_packet_capacity, avpicture_get_size(ctx->pix_fmt, ctx->width, ctx->height) + min_packet_capacity);
+	else
+		s->packet_capacity = min_packet_capacity * std::max(1, ctx->channels);
+#endif
+	m_streams.push_back(s);
+
+	for (int i = 0; i < preallocated_packets; i++)
+		s->free_packets.push(new_packet(*s));
+
+	return st->index;
+}
+
+AVStream* packet_muxer::stream(int index) const
+{
+	return m_streams[index]->st;
+}
+
+void packet_muxer::set_rotation(const std::string& name_template, int64_t max_bytes, int64_t max_duration)
+{
+	m_rotate_template = name_template;
+	m_rotate_bytes = max_bytes;
+	m_rotate_duration = max_duration;
+}
+
+int packet_muxer::write_header()
+{
+	// 只有 mov 一族的格式有 movflags.
+	const AVClass* priv_class = m_fmt_ctx->oformat->priv_class;
+	m_fragmented = m_fragment_interval != 0 && priv_class
+		&& av_opt_find(&priv_class, "movflags", NULL, 0, AV_OPT_SEARCH_FAKE_OBJ);
+
+	// 输出没有打开时 (文件打不开, 连不上) 不能写.
+	if (!m_fmt_ctx->pb && !(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+		return AVERROR(EIO);
+
+	int ret = start_output(m_fmt_ctx);
+	if (ret < 0)
+		return ret;
+
+	m_mux_thread = boost::thread(boost::bind(&packet_muxer::mux_thread, this));
+	return ret;
+}
+
+int packet_muxer::start_output(AVFormatContext* ctx)
+{
+	AVDictionary* dict = NULL;
+
+	if (m_fragmented)
+	{
+		// 开头写一个空的 moov, 之后每个分片自带样本表, 写完就释放,
+		// 内存不随录制时长增长, 写文件尾也不用再写整个 moov, 中途崩溃之前的分片都能播放.
+		// 分片由复用线程在关键帧处用 av_write_frame(NULL) 切分.
+		av_dict_set(&dict, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+	}
+
+	int ret = avformat_write_header(ctx, &dict);
+	av_dict_free(&dict);
+	return ret;
+}
+
+void packet_muxer::finish_output(AVFormatContext* ctx, int64_t duration)
+{
+	if (!ctx->pb)
+		return;
+
+	ctx->duration = duration;
+	// 分片模式下这里只写最后一个分片和很小的随机访问索引.
+	if (av_write_trailer(ctx) >= 0 && m_fragmented && m_fragment_start != AV_NOPTS_VALUE)
+		++m_fragments_written;
+	close_output(ctx);
+}
+
+void packet_muxer::close_output(AVFormatContext* ctx)
+{
+	if (!ctx->pb)
+		return;
+
+	if (ctx->flags & AVFMT_FLAG_CUSTOM_IO)
+	{
+		avio_flush(ctx->pb);
+		if (m_sender)
+			m_sender->close();
+		av_free(ctx->pb->buffer);
+		av_free(ctx->pb);
+	}
+	else
+	{
+		avio_close(ctx->pb);
+	}
+	ctx->pb = NULL;
+}
+
+AVPacket* packet_muxer::new_packet(const mux_stream& s)
+{
+	packet_slot* slot = new packet_slot;
+	slot->capacity = s.packet_capacity;
+	slot->data = slot->capacity ? static_cast<uint8_t*>(av_malloc(slot->capacity + packet_padding)) : NULL;
+	if (slot->capacity && !slot->data)
+	{
+		delete slot;
+		throw std::bad_alloc();
+	}
+	av_init_packet(&slot->pkt);
+	reset_packet(&slot->pkt);
+	return &slot->pkt;
+}
+
+void packet_muxer::reset_packet(AVPacket* pkt)
+{
+	packet_slot* slot = reinterpret_cast<packet_slot*>(pkt);
+
+	// 编码器缓冲不够时会给包另外分配 buf, 这里释放掉, 换回包自带的缓冲.
+	av_packet_unref(pkt);
+	pkt->data = slot->data;
+	pkt->size = slot->capacity;
+}
+
+void packet_muxer::free_packet(AVPacket* pkt)
+{
+	packet_slot* slot = reinterpret_cast<packet_slot*>(pkt);
+
+	av_packet_unref(pkt);
+	av_free(slot->data);
+	delete slot;
+}
+
+AVPacket* packet_muxer::acquire_packet(int index)
+{
+	mux_stream& s = *m_streams[index];
+
+	AVPacket* pkt = s.spare;
+	s.spare = NULL;
+	if (!pkt && !s.free_packets.pop(pkt))
+	{
+		// 池里的包都在排队, 只能新分配一个, 写完之后它也会留在池里.
+		pkt = new_packet(s);
+		++s.allocations;
+	}
+	reset_packet(pkt);
+	return pkt;
+}
+
+void packet_muxer::release_packet(int index, AVPacket* pkt)
+{
+	mux_stream& s = *m_streams[index];
+
+	if (s.spare)
+		free_packet(s.spare);
+	s.spare = pkt;
+}
+
+void packet_muxer::recycle_packet(mux_stream& s, AVPacket* pkt)
+{
+	av_packet_unref(pkt);
+	if (!s.free_packets.push(pkt))
+		free_packet(pkt);
+}
+
+void packet_muxer::push_packet(int index, AVPacket* pkt)
+{
+	mux_stream& s = *m_streams[index];
+
+	int64_t dts = packet_dts_us(s, pkt);
+
+	m_queued_bytes += pkt->size;
+	int depth = ++s.depth;
+	int max_depth = s.max_depth;
+	while (depth > max_depth && !s.max_depth.compare_exchange_weak(max_depth, depth))
+		;
+
+	// 队列满了说明输出跟不上, 让编码线程等复用线程写出一个包, 内存不会无限增长.
+	if (!s.queue.push(pkt))
+	{
+		boost::unique_lock<boost::mutex> l(m_space_mutex);
+		++m_space_waiters;
+		while (!s.queue.push(pkt))
+		{
+			m_wait_cond.notify_one();
+			m_space_cond.wait(l);
+		}
+		--m_space_waiters;
+	}
+
+	if (dts != AV_NOPTS_VALUE)
+		s.last_pushed_dts = dts;
+
+	m_wait_cond.notify_one();
+}
+
+void packet_muxer::mark_input(int index, int64_t pts, int64_t input_time)
+{
+	input_slot& slot = m_streams[index]->inputs[static_cast<uint64_t>(pts) % input_slots];
+	slot.input_time = input_time;
+	slot.pts.store(pts, boost::memory_order_release);
+}
+
+void packet_muxer::end_of_stream(int index)
+{
+	m_streams[index]->finished = true;
+	m_wait_cond.notify_one();
+}
+
+void packet_muxer::write_trailer(int64_t duration)
+{
+	stop_mux_thread();
+
+	if (!m_fmt_ctx->pb)
+		return;
+
+	finish_output(m_fmt_ctx, std::max<int64_t>(0, duration - m_file_start));
+}
+
+mux_stats packet_muxer::stats() const
+{
+	mux_stats st = mux_stats();
+
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+	{
+		const mux_stream& s = *m_streams[i];
+
+		if (s.type == AVMEDIA_TYPE_VIDEO)
+		{
+			st.video_queue_depth = s.depth;
+			st.video_queue_max = s.max_depth;
+		}
+		else
+		{
+			st.audio_queue_depth = s.depth;
+			st.audio_queue_max = s.max_depth;
+		}
+	}
+
+	st.packets_written = m_packets_written;
+	st.bytes_written = m_bytes_written;
+	st.interleave_forced = m_interleave_forced;
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+		st.pool_allocations += m_streams[i]->allocations;
+	st.fragments_written = m_fragments_written;
+	st.rotations = m_rotations;
+	if (m_sender)
+	{
+		st.paced_datagrams = m_sender->datagrams_sent();
+		st.paced_batches = m_sender->batches_sent();
+		st.paced_send_errors = m_sender->send_errors();
+	}
+	{
+		boost::mutex::scoped_lock l(m_file_mutex);
+		st.current_file = m_current_file;
+	}
+
+	boost::mutex::scoped_lock l(m_latency_mutex);
+	memcpy(st.latency_histogram, m_latency_histogram, sizeof(st.latency_histogram));
+	st.latency_samples = m_latency_samples;
+	st.latency_total = m_latency_total;
+	st.latency_max = m_latency_max;
+	return st;
+}
+
+void packet_muxer::stop_mux_thread()
+{
+	if (!m_mux_thread.joinable())
+		return;
+
+	m_draining = true;
+	m_wait_cond.notify_one();
+	m_mux_thread.join();
+}
+
+void packet_muxer::mux_thread()
+{
+	pin_current_thread(m_cpus);
+
+	for (;;)
+	{
+		bool draining = m_draining;
+
+		int index = pick_stream(draining);
+		if (index >= 0)
+		{
+			mux_stream& s = *m_streams[index];
+			AVPacket* pkt = s.queue.front();
+			s.queue.pop();
+			--s.depth;
+			if (m_space_waiters.load())
+			{
+				boost::mutex::scoped_lock l(m_space_mutex);
+				m_space_cond.notify_all();
+			}
+
+			int size = pkt->size;
+			write_packet(s, pkt);
+			m_queued_bytes -= size;
+			continue;
+		}
+
+		// 停止的时候队列已经写空了.
+		if (draining)
+			break;
+
+		boost::unique_lock<boost::mutex> l(m_wait_mutex);
+		m_wait_cond.wait_for(l, boost::chrono::milliseconds(10));
+	}
+}
+
+int packet_muxer::pick_stream(bool draining)
+{
+	int best = -1;
+	int64_t best_dts = 0;
+	int64_t waiting_dts = INT64_MAX;
+	bool waiting = false;
+
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+	{
+		mux_stream& s = *m_streams[i];
+
+		if (s.queue.read_available() == 0)
+		{
+			if (!draining && !s.finished)
+			{
+				// 这一路流还会有包过来, 它之后的包不会早于已经写出去的.
+				waiting = true;
+				if (s.last_written_dts == AV_NOPTS_VALUE)
+					waiting_dts = INT64_MIN;
+				else
+					waiting_dts = std::min(waiting_dts, s.last_written_dts);
+			}
+			continue;
+		}
+
+		int64_t dts = dts_us(s, s.queue.front());
+		if (best < 0 || dts < best_dts)
+		{
+			best = static_cast<int>(i);
+			best_dts = dts;
+		}
+	}
+
+	if (best < 0 || !waiting)
+		return best;
+
+	// 不会比正在等的流更早, 直接写.
+	if (best_dts <= waiting_dts)
+		return best;
+
+	// 等待的流太久没数据, 为了不无限缓存, 超过最大交织间隔就不等了.
+	mux_stream& s = *m_streams[best];
+	int64_t buffered = s.last_pushed_dts - best_dts;
+	if (buffered >= m_max_interleave_delta || s.queue.write_available() == 0)
+	{
+		++m_interleave_forced;
+		return best;
+	}
+	return -1;
+}
+
+void packet_muxer::write_packet(mux_stream& s, AVPacket* pkt)
+{
+	s.last_written_dts = dts_us(s, pkt);
+	record_latency(s, pkt);
+
+	if (s.type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY))
+	{
+		if (rotation_due(s.last_written_dts))
+			rotate_output(s.last_written_dts);
+		if (m_fragmented)
+			cut_fragment(s);
+	}
+	if (m_file_first_dts == AV_NOPTS_VALUE)
+		m_file_first_dts = s.last_written_dts;
+
+	// 切换过文件之后, 时间戳从新文件的第一个关键帧开始算.
+	if (m_file_start)
+	{
+		int64_t offset = av_rescale_q(m_file_start, AV_TIME_BASE_Q, s.codec_time_base);
+		if (pkt->pts != AV_NOPTS_VALUE)
+			pkt->pts -= offset;
+		if (pkt->dts != AV_NOPTS_VALUE)
+			pkt->dts -= offset;
+	}
+
+	pkt->stream_index = s.st->index;
+	av_packet_rescale_ts(pkt, s.codec_time_base, s.st->time_base);
+
+	int size = pkt->size;
+	int ret;
+	{
+		trace_span span(trace_mux_write, pkt->pts);
+		int64_t start = av_gettime_relative();
+		ret = av_write_frame(m_fmt_ctx, pkt);
+		m_write_busy += av_gettime_relative() - start;
+	}
+	if (ret >= 0)
+	{
+		++m_packets_written;
+		m_bytes_written += size;
+	}
+
+	recycle_packet(s, pkt);
+}
+
+// "%N" 换成文件序号, 其余交给 strftime; "%%" 原样留给 strftime 变成 "%".
+static std::string expand_name_template(const std::string& name_template, int segment)
+{
+	std::string format;
+	for (std::size_t i = 0; i < name_template.size(); i++)
+	{
+		if (name_template[i] == '%' && i + 1 < name_template.size() && name_template[i + 1] == 'N')
+		{
+			format += boost::lexical_cast<std::string>(segment);
+			i++;
+		}
+		else if (name_template[i] == '%' && i + 1 < name_template.size() && name_template[i + 1] == '%')
+		{
+			format += "%%";
+			i++;
+		}
+		else
+		{
+			format += name_template[i];
+		}
+	}
+
+	time_t now = time(NULL);
+	struct tm local;
+#ifdef _WIN32
+	localtime_s(&local, &now);
+#else
+	localtime_r(&now, &local);
+#endif
+	char name[1024];
+	std::size_t size = strftime(name, sizeof(name), format.c_str(), &local);
+	return size ? std::string(name, size) : format;
+}
+
+bool packet_muxer::rotation_due(int64_t dts) const
+{
+	if (m_rotate_template.empty() || m_file_first_dts == AV_NOPTS_VALUE)
+		return false;
+	if (m_rotate_duration > 0 && dts - m_file_first_dts >= m_rotate_duration)
+		return true;
+	return m_rotate_bytes > 0 && m_fmt_ctx->pb && avio_tell(m_fmt_ctx->pb) >= m_rotate_bytes;
+}
+
+void packet_muxer::rotate_output(int64_t dts)
+{
+	std::string filename = expand_name_template(m_rotate_template, m_segment + 1);
+
+	// 先把新文件准备好, 失败时当前文件不受影响.
+	AVFormatContext* ctx = NULL;
+	try
+	{
+		ctx = open_output(filename);
+		if (!ctx->pb)
+			throw std::runtime_error("Could not open " + filename);
+
+		for (std::size_t i = 0; i < m_streams.size(); i++)
+		{
+			const mux_stream& s = *m_streams[i];
+			AVStream* st = avformat_new_stream(ctx, NULL);
+			if (!st)
+				throw std::runtime_error("Could not allocate stream!");
+
+#if HAVE_AVSTREAM_CODECPAR
+			if (avcodec_parameters_copy(st->codecpar, s.st->codecpar) < 0)
+				throw std::runtime_error("Could not copy codec parameters!");
+			st->codecpar->codec_tag = 0;
+#else
+			if (avcodec_copy_context(st->codec, s.st->codec) < 0)
+				throw std::runtime_error("Could not copy codec parameters!");
+			st->codec->codec_tag = 0;
+#endif
+			st->time_base = s.codec_time_base;
+			st->id = s.st->id;
+			st->avg_frame_rate = s.st->avg_frame_rate;
+		}
+
+		if (start_output(ctx) < 0)
+			throw std::runtime_error("Could not write header to " + filename);
+	}
+	catch (std::exception&)
+	{
+		if (ctx)
+		{
+			close_output(ctx);
+			avformat_free_context(ctx);
+		}
+		return;
+	}
+
+	finish_output(m_fmt_ctx, dts - m_file_first_dts);
+	avformat_free_context(m_fmt_ctx);
+
+	m_fmt_ctx = ctx;
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+		m_streams[i]->st = ctx->streams[i];
+
+	m_segment++;
+	m_file_start = dts;
+	m_file_first_dts = AV_NOPTS_VALUE;
+	m_fragment_start = AV_NOPTS_VALUE;
+	++m_rotations;
+
+	boost::mutex::scoped_lock l(m_file_mutex);
+	m_current_file = filename;
+}
+
+void packet_muxer::cut_fragment(const mux_stream& s)
+{
+	int64_t dts = s.last_written_dts;
+
+	if (m_fragment_start != AV_NOPTS_VALUE && (m_fragment_interval < 0 || dts - m_fragment_start >= m_fragment_interval))
+	{
+		// 写出当前分片, 并且让它真正进到文件里.
+		if (av_write_frame(m_fmt_ctx, NULL) >= 0)
+			++m_fragments_written;
+		avio_flush(m_fmt_ctx->pb);
+		m_fragment_start = AV_NOPTS_VALUE;
+	}
+
+	if (m_fragment_start == AV_NOPTS_VALUE)
+		m_fragment_start = dts;
+}
+
+void packet_muxer::record_latency(mux_stream& s, const AVPacket* pkt)
+{
+	if (pkt->pts == AV_NOPTS_VALUE)
+		return;
+
+	input_slot& slot = s.inputs[static_cast<uint64_t>(pkt->pts) % input_slots];
+	if (slot.pts.load(boost::memory_order_acquire) != pkt->pts)
+		return;
+
+	int64_t latency = av_gettime_relative() - slot.input_time;
+	slot.pts.store(AV_NOPTS_VALUE, boost::memory_order_relaxed);
+
+	int bucket = 0;
+	while (bucket < latency_buckets - 1 && latency > latency_limits[bucket])
+		bucket++;
+
+	boost::mutex::scoped_lock l(m_latency_mutex);
+	m_latency_histogram[bucket]++;
+	m_latency_samples++;
+	m_latency_total += latency;
+	m_latency_max = std::max(m_latency_max, latency);
+}
+
+int64_t packet_muxer::packet_dts_us(const mux_stream& s, const AVPacket* pkt)
+{
+	int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+	if (dts == AV_NOPTS_VALUE)
+		return AV_NOPTS_VALUE;
+	return av_rescale_q(dts, s.codec_time_base, AV_TIME_BASE_Q);
+}
+
+int64_t packet_muxer::dts_us(const mux_stream& s, const AVPacket* pkt) const
+{
+	int64_t dts = packet_dts_us(s, pkt);
+	if (dts == AV_NOPTS_VALUE)
+		return s.last_written_dts == AV_NOPTS_VALUE ? 0 : s.last_written_dts;
+	return dts;
+}
+
+}
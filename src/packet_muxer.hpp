@@ -0,0 +1,278 @@
+﻿
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+}
+
+// libavcodec 57.37 开始提供 avcodec_send_frame/avcodec_receive_packet.
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 37, 100)
+#	define HAVE_AVCODEC_SEND_RECEIVE 1
+#else
+#	define HAVE_AVCODEC_SEND_RECEIVE 0
+#endif
+
+#include "affinity.hpp"
+#include "ts_sender.hpp"
+
+namespace libencoder {
+
+enum { latency_buckets = 16 };
+
+// 第 i 个延迟区间的上限 (微秒), 最后一个区间没有上限.
+int64_t latency_bucket_limit(int bucket);
+
+struct mux_stats
+{
+	// 当前排队的包数, 以及出现过的最大值.
+	int video_queue_depth;
+	int video_queue_max;
+	int audio_queue_depth;
+	int audio_queue_max;
+
+	int64_t packets_written;
+	int64_t bytes_written;
+	// 因为超过最大交织间隔而不再等待另一路流的次数.
+	int64_t interleave_forced;
+
+	// 视频帧从进入编码库到写出的延迟分布.
+	int64_t latency_histogram[latency_buckets];
+	int64_t latency_samples;
+	int64_t latency_total;
+	int64_t latency_max;
+
+	// 包池不够用时新分配的包数.
+	int64_t pool_allocations;
+
+	// 分片 MP4 已经写出的分片数.
+	int64_t fragments_written;
+
+	// 切换过的文件数, 以及当前正在写的文件.
+	int64_t rotations;
+	std::string current_file;
+
+	// paced-udp:// 和 paced-unix:// 输出发出的数据报数, 发送批数, 发送失败丢掉的数据报数.
+	int64_t paced_datagrams;
+	int64_t paced_batches;
+	int64_t paced_send_errors;
+};
+
+// 复用线程.
+// 音频和视频的编码线程各自把包放进自己的无锁队列, 由复用线程按 DTS 交织后
+// 用 av_write_frame 写入文件, 写文件慢不会阻塞编码线程.
+// 每个队列只能有一个生产者.
+// 包和包的数据缓冲都从每路流自己的池里取, 写完之后由复用线程还回去, 稳定后池不再增长.
+class packet_muxer : public boost::noncopyable
+{
+public:
+	enum { queue_capacity = 1024 };
+	// 每路流预先分配的包数.
+	enum { preallocated_packets = 16 };
+
+	packet_muxer(const std::string& filename, const std::string& fmt, const std::string& version);
+	~packet_muxer();
+
+public:
+	const std::string& format_name() const { return m_fmt_name; }
+
+	// 输出格式要求编码器生成全局头.
+	bool need_global_header() const;
+
+	// 为打开好的编码器建立一路输出流, 返回流序号.
+	int add_stream(AVCodecContext* ctx);
+	AVStream* stream(int index) const;
+
+	// 复用线程绑定到这组 cpu 上, 要在 write_header 之前设置.
+	void set_cpu_affinity(const cpu_set& cpus) { m_cpus = cpus; }
+
+	// 分片 MP4: interval_us 为 0 时不分片, 小于 0 时每个视频关键帧开始一个分片,
+	// 否则超过这个间隔之后的第一个关键帧开始新的分片. 要在 write_header 之前设置, 格式不支持时忽略.
+	void set_fragment_interval(int64_t interval_us) { m_fragment_interval = interval_us; }
+
+	// 文件切分: 当前文件超过 max_bytes 字节或者 max_duration 微秒 (0 表示不限) 之后,
+	// 在下一个视频关键帧处换到新文件, 新文件的时间戳从 0 开始, 编码器不受影响.
+	// 新文件名由 name_template 生成, "%N" 换成文件序号 (从 1 开始), 其余按 strftime 展开.
+	// 要在 write_header 之前设置.
+	void set_rotation(const std::string& name_template, int64_t max_bytes, int64_t max_duration);
+
+	// 写入文件头, 并启动复用线程. 失败时返回 AVERROR, 不启动复用线程.
+	int write_header();
+
+	// 从流的包池里取一个包, data/size 指向包自带的缓冲, 可以直接交给编码器.
+	// 只能在这路流的编码线程里调用.
+	AVPacket* acquire_packet(int index);
+	// 没用上的包还回去, 只能在这路流的编码线程里调用.
+	void release_packet(int index, AVPacket* pkt);
+
+	// 把包交给复用线程, 包的所有权随之转移, pkt 的时间戳以编码器的 time_base 为单位.
+	// pkt 必须是 acquire_packet 取得的.
+	void push_packet(int index, AVPacket* pkt);
+
+	// 记录一帧进入编码库时的时钟, 这一帧的包写出时统计延迟. pts 以编码器的 time_base 为单位.
+	void mark_input(int index, int64_t pts, int64_t input_time);
+
+	// 这一路流不会再有新的包了, 复用线程不用再等它.
+	void end_of_stream(int index);
+
+	// 写完队列里剩下的包, 然后写入文件尾并关闭文件.
+	void write_trailer(int64_t duration);
+
+	// 一路流没有数据时, 另一路最多缓存多长时间 (微秒) 的包.
+	void set_max_interleave_delta(int64_t us) { m_max_interleave_delta = us; }
+
+	mux_stats stats() const;
+
+	// 这路流的包池不够用时新分配的次数.
+	int64_t pool_allocations(int index) const { return m_streams[index]->allocations; }
+
+	// 给码率调整用的输出状况, 每帧都可以读: 写出的总字节数, 写出累计花的时间 (微秒), 队列里还没写出的字节数.
+	int64_t bytes_written() const { return m_bytes_written; }
+	int64_t write_busy_us() const { return m_write_busy; }
+	int64_t queued_bytes() const { return m_queued_bytes; }
+
+private:
+	typedef boost::lockfree::spsc_queue<AVPacket*, boost::lockfree::capacity<queue_capacity> > packet_queue;
+
+	// 池里的包, pkt 必须是第一个成员, 这样 AVPacket* 可以直接转回来.
+	struct packet_slot
+	{
+		AVPacket pkt;
+		uint8_t* data;
+		int capacity;
+	};
+
+	enum { input_slots = 512 };
+
+	// pts 到输入时刻的映射, 按 pts 取模放在固定的槽里, 编码线程写, 复用线程读.
+	struct input_slot
+	{
+		input_slot() : pts(AV_NOPTS_VALUE), input_time(0) {}
+
+		boost::atomic<int64_t> pts;
+		int64_t input_time;
+	};
+
+	struct mux_stream
+	{
+		mux_stream();
+
+		AVStream* st;
+		AVMediaType type;
+		AVRational codec_time_base;
+		packet_queue queue;
+
+		// 每个包自带的缓冲大小, 够编码器写一帧.
+		int packet_capacity;
+		// 复用线程写完的包放回这里, 编码线程从这里取.
+		packet_queue free_packets;
+		// 编码线程自己留着的一个包, 不经过队列.
+		AVPacket* spare;
+		boost::atomic<int64_t> allocations;
+
+		boost::atomic<int> depth;
+		boost::atomic<int> max_depth;
+		boost::atomic<int64_t> last_pushed_dts;
+		boost::atomic<bool> finished;
+
+		// 以下只在复用线程里访问.
+		int64_t last_written_dts;
+
+		input_slot inputs[input_slots];
+	};
+
+	void record_latency(mux_stream& s, const AVPacket* pkt);
+
+	AVPacket* new_packet(const mux_stream& s);
+	static void reset_packet(AVPacket* pkt);
+	static void free_packet(AVPacket* pkt);
+	// 复用线程写完之后把包还给池.
+	void recycle_packet(mux_stream& s, AVPacket* pkt);
+
+	void mux_thread();
+	// 选出下一个该写的流, 没有可写的返回 -1.
+	int pick_stream(bool draining);
+	void write_packet(mux_stream& s, AVPacket* pkt);
+
+	// 创建输出上下文并打开文件, 打开失败时 pb 为 NULL.
+	AVFormatContext* open_output(const std::string& filename);
+	int start_output(AVFormatContext* ctx);
+	// 写文件尾并关闭文件, 不释放上下文.
+	void finish_output(AVFormatContext* ctx, int64_t duration);
+	// 关闭 pb, 自己接管 IO 的输出先把剩下的数据报发完.
+	void close_output(AVFormatContext* ctx);
+	bool rotation_due(int64_t dts) const;
+	// 换到下一个文件, 新文件打不开时继续写当前文件, 下一个关键帧再试.
+	void rotate_output(int64_t dts);
+	// 在视频关键帧之前决定要不要结束当前分片.
+	void cut_fragment(const mux_stream& s);
+	// 包的 DTS (没有时用 PTS), 换算成微秒, 都没有时返回 AV_NOPTS_VALUE. 哪个线程都可以调用.
+	static int64_t packet_dts_us(const mux_stream& s, const AVPacket* pkt);
+	// 同上, 都没有时用这一路上一个写出的包的 DTS, 只能在复用线程里调用.
+	int64_t dts_us(const mux_stream& s, const AVPacket* pkt) const;
+	void stop_mux_thread();
+
+private:
+	AVFormatContext* m_fmt_ctx;
+	std::string m_fmt_name;
+	std::string m_version;
+
+	std::vector<mux_stream*> m_streams;
+
+	cpu_set m_cpus;
+	boost::thread m_mux_thread;
+	boost::mutex m_wait_mutex;
+	boost::condition_variable m_wait_cond;
+	// 队列满了的编码线程在这里等复用线程腾出位置, m_space_waiters 是在等的线程数.
+	boost::mutex m_space_mutex;
+	boost::condition_variable m_space_cond;
+	boost::atomic<int> m_space_waiters;
+	boost::atomic<bool> m_draining;
+
+	int64_t m_max_interleave_delta;
+
+	int64_t m_fragment_interval;
+	bool m_fragmented;
+	// 当前分片第一个关键帧的 DTS, 只在复用线程里访问.
+	int64_t m_fragment_start;
+	boost::atomic<int64_t> m_fragments_written;
+
+	std::string m_rotate_template;
+	int64_t m_rotate_bytes;
+	int64_t m_rotate_duration;
+	int m_segment;
+	// 当前文件的时间戳从这里开始, 写入前减掉; 当前文件第一个包的 DTS. 只在复用线程里访问.
+	int64_t m_file_start;
+	int64_t m_file_first_dts;
+	boost::atomic<int64_t> m_rotations;
+	mutable boost::mutex m_file_mutex;
+	std::string m_current_file;
+
+	// 按 PCR 均匀发送的 UDP / Unix 数据报输出, 其他输出为空.
+	boost::scoped_ptr<ts_sender> m_sender;
+
+	boost::atomic<int64_t> m_packets_written;
+	boost::atomic<int64_t> m_bytes_written;
+	boost::atomic<int64_t> m_write_busy;
+	boost::atomic<int64_t> m_queued_bytes;
+	boost::atomic<int64_t> m_interleave_forced;
+
+	mutable boost::mutex m_latency_mutex;
+	int64_t m_latency_histogram[latency_buckets];
+	int64_t m_latency_samples;
+	int64_t m_latency_total;
+	int64_t m_latency_max;
+};
+
+}
@@ -0,0 +1,146 @@
+﻿
+#include <algorithm>
+#include <cstring>
+
+#include <boost/make_shared.hpp>
+
+#include "pip.hpp"
+
+namespace libencoder {
+
+pip_compositor::pip_compositor(scale_filter filter)
+	: m_filter(filter)
+	, m_count(0)
+{
+}
+
+bool pip_compositor::set_layout(int id, const pip_layout& layout)
+{
+	pip_layout l = layout;
+	l.x &= ~1;
+	l.y &= ~1;
+	l.width &= ~1;
+	l.height &= ~1;
+	if (l.width <= 0 || l.height <= 0 || l.crop_left < 0 || l.crop_top < 0
+		|| l.crop_right < l.crop_left || l.crop_bottom < l.crop_top)
+		return false;
+
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	boost::shared_ptr<source>& s = m_sources[id];
+	if (!s)
+		s = boost::make_shared<source>(m_filter);
+	s->layout = l;
+	m_count = static_cast<int>(m_sources.size());
+	return true;
+}
+
+void pip_compositor::remove(int id)
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	m_sources.erase(id);
+	m_count = static_cast<int>(m_sources.size());
+}
+
+bool pip_compositor::feed(int id, const video_input& frame)
+{
+	boost::shared_ptr<source> s;
+	pip_layout layout;
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+
+		std::map<int, boost::shared_ptr<source> >::iterator it = m_sources.find(id);
+		if (it == m_sources.end())
+			return false;
+		s = it->second;
+		layout = s->layout;
+	}
+
+	// 裁剪区域限制在画面内, YUV420P 的起点要对齐到偶数, 色度平面才能跟着偏移.
+	int left = 0, top = 0, right = frame.width, bottom = frame.height;
+	if (layout.crop_right > layout.crop_left && layout.crop_bottom > layout.crop_top)
+	{
+		left = std::min(layout.crop_left, frame.width);
+		top = std::min(layout.crop_top, frame.height);
+		right = std::min(layout.crop_right, frame.width);
+		bottom = std::min(layout.crop_bottom, frame.height);
+	}
+	if (frame.format == video_input::i420)
+	{
+		left &= ~1;
+		top &= ~1;
+	}
+	if (right <= left || bottom <= top)
+		return false;
+
+	int w = layout.width;
+	int h = layout.height;
+	s->back.resize(w * h * 3 / 2);
+	uint8_t* dst[3] = { &s->back[0], &s->back[w * h], &s->back[w * h + (w / 2) * (h / 2)] };
+	int dst_linesize[3] = { w, w / 2, w / 2 };
+
+	bool ok;
+	if (frame.format == video_input::bgr0)
+	{
+		// 上下颠倒的画面从最后一行往前走.
+		int stride = frame.linesize[0];
+		const uint8_t* src = frame.planes[0] + static_cast<std::ptrdiff_t>(frame.flip ? frame.height - 1 - top : top) * stride + left * 4;
+		ok = s->scaler.scale_bgr0(src, frame.flip ? -stride : stride, right - left, bottom - top, dst, dst_linesize, w, h);
+	}
+	else
+	{
+		const uint8_t* src[3] =
+		{
+			frame.planes[0] + static_cast<std::ptrdiff_t>(top) * frame.linesize[0] + left,
+			frame.planes[1] + static_cast<std::ptrdiff_t>(top / 2) * frame.linesize[1] + left / 2,
+			frame.planes[2] + static_cast<std::ptrdiff_t>(top / 2) * frame.linesize[2] + left / 2,
+		};
+		ok = s->scaler.scale_yuv420(src, frame.linesize, right - left, bottom - top, dst, dst_linesize, w, h);
+	}
+	if (!ok)
+		return false;
+
+	boost::mutex::scoped_lock lock(s->front_mutex);
+	s->front.swap(s->back);
+	s->width = w;
+	s->height = h;
+	s->has_frame = true;
+	return true;
+}
+
+void pip_compositor::copy_plane(uint8_t* dst, int dst_linesize, int dst_width, int dst_height,
+	const uint8_t* src, int width, int height, int x, int y)
+{
+	// 只拷画面内的部分.
+	int x0 = std::max(0, x), x1 = std::min(dst_width, x + width);
+	int y0 = std::max(0, y), y1 = std::min(dst_height, y + height);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	for (int row = y0; row < y1; row++)
+		memcpy(dst + static_cast<std::ptrdiff_t>(row) * dst_linesize + x0, src + (row - y) * width + (x0 - x), x1 - x0);
+}
+
+void pip_compositor::compose(uint8_t* const planes[3], const int linesize[3], int width, int height)
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	for (std::map<int, boost::shared_ptr<source> >::iterator it = m_sources.begin(); it != m_sources.end(); ++it)
+	{
+		source& s = *it->second;
+		boost::mutex::scoped_lock front_lock(s.front_mutex);
+		if (!s.has_frame)
+			continue;
+
+		int w = s.width, h = s.height;
+		const uint8_t* y = &s.front[0];
+		const uint8_t* u = y + w * h;
+		const uint8_t* v = u + (w / 2) * (h / 2);
+		copy_plane(planes[0], linesize[0], width, height, y, w, h, s.layout.x, s.layout.y);
+		copy_plane(planes[1], linesize[1], width / 2, height / 2, u, w / 2, h / 2, s.layout.x / 2, s.layout.y / 2);
+		copy_plane(planes[2], linesize[2], width / 2, height / 2, v, w / 2, h / 2, s.layout.x / 2, s.layout.y / 2);
+	}
+}
+
+}
@@ -0,0 +1,79 @@
+﻿
+#pragma once
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "frame_scaler.hpp"
+
+namespace libencoder {
+
+// 画中画的一个源在输出画面上的位置, 以及从源画面上取的区域.
+struct pip_layout
+{
+	// 输出画面上的像素, 可以部分超出画面, 会向下对齐到偶数.
+	int x;
+	int y;
+	int width;
+	int height;
+	// 源画面上的区域, right/bottom 不含, 全为 0 表示整幅画面.
+	int crop_left;
+	int crop_top;
+	int crop_right;
+	int crop_bottom;
+};
+
+// 把摄像头这类额外的视频源合成到主画面转换好的 YUV420P 上.
+// 每个源输入时就在输入线程上裁剪缩放成布局的大小存起来, 合成时只按行拷贝最近的一帧,
+// 慢的源一直用它最近的一帧. 主画面不用先在 BGRA 上混合再整帧转换.
+class pip_compositor : public boost::noncopyable
+{
+public:
+	explicit pip_compositor(scale_filter filter);
+
+	// 设置或修改一个源的布局, id 大的叠在上面. 尺寸变了之后要等下一帧输入才会显示. 参数不对时返回 false.
+	bool set_layout(int id, const pip_layout& layout);
+	void remove(int id);
+
+	bool empty() const { return m_count == 0; }
+
+	// 输入一帧源画面, 同一个源的输入要串行. 没有设置布局, 裁剪区域为空或者缩放失败时返回 false.
+	bool feed(int id, const video_input& frame);
+
+	// 把每个源最近的一帧拷到输出画面上, 还没有输入过的源跳过.
+	void compose(uint8_t* const planes[3], const int linesize[3], int width, int height);
+
+private:
+	struct source : public boost::noncopyable
+	{
+		explicit source(scale_filter filter) : scaler(filter), width(0), height(0), has_frame(false) {}
+
+		pip_layout layout;
+		frame_scaler scaler;
+
+		// 缩放好的 YUV420P, 三个平面连着放. back 只由输入线程写, 写完和 front 交换.
+		std::vector<uint8_t> back;
+		boost::mutex front_mutex;
+		std::vector<uint8_t> front;
+		int width;
+		int height;
+		bool has_frame;
+	};
+
+	static void copy_plane(uint8_t* dst, int dst_linesize, int dst_width, int dst_height,
+		const uint8_t* src, int width, int height, int x, int y);
+
+private:
+	scale_filter m_filter;
+	boost::mutex m_mutex;
+	std::map<int, boost::shared_ptr<source> > m_sources;
+	boost::atomic<int> m_count;
+};
+
+}
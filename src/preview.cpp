@@ -0,0 +1,279 @@
+﻿
+#include <algorithm>
+#include <cstring>
+
+#include <boost/bind.hpp>
+
+#include "preview.hpp"
+
+extern "C"
+{
+#include "libswscale/swscale.h"
+#include "libavutil/time.h"
+}
+
+namespace libencoder {
+
+preview_tap::preview_tap(const preview_config& config, const preview_callback& callback, int out_width, int out_height)
+	: m_config(config)
+	, m_callback(callback)
+	, m_width(config.width)
+	, m_height(config.height)
+	, m_scaler(scale_bilinear)
+	, m_last_time(AV_NOPTS_VALUE)
+	, m_busy(false)
+	, m_sws(NULL)
+	, m_jpeg(NULL)
+	, m_jpeg_frame(NULL)
+{
+	// 没给的边按输出的比例补上, 宽高取偶数.
+	if (m_width <= 0 && m_height <= 0)
+	{
+		m_width = out_width / 4;
+		m_height = out_height / 4;
+	}
+	else if (m_width <= 0)
+		m_width = static_cast<int>(static_cast<int64_t>(out_width) * m_height / out_height);
+	else if (m_height <= 0)
+		m_height = static_cast<int>(static_cast<int64_t>(out_height) * m_width / out_width);
+	m_width = std::max(2, std::min(out_width, m_width) & ~1);
+	m_height = std::max(2, std::min(out_height, m_height) & ~1);
+
+	int chroma = (m_width / 2) * (m_height / 2);
+	m_small.resize(m_width * m_height + chroma * 2);
+	m_planes[0] = &m_small[0];
+	m_planes[1] = m_planes[0] + m_width * m_height;
+	m_planes[2] = m_planes[1] + chroma;
+	m_linesize[0] = m_width;
+	m_linesize[1] = m_width / 2;
+	m_linesize[2] = m_width / 2;
+
+	try
+	{
+		init_converter();
+	}
+	catch (...)
+	{
+		release();
+		throw;
+	}
+}
+
+void preview_tap::init_converter()
+{
+	if (m_config.format == ENCODER_PREVIEW_BGRA)
+	{
+		m_converted.resize(m_width * m_height * 4);
+		m_sws = sws_getContext(m_width, m_height, AV_PIX_FMT_YUV420P, m_width, m_height, AV_PIX_FMT_BGRA,
+			SWS_POINT, NULL, NULL, NULL);
+		if (!m_sws)
+			throw std::runtime_error("Could not create preview converter!");
+	}
+	else if (m_config.format == ENCODER_PREVIEW_JPEG)
+	{
+		// JPEG 是全范围的, 先从有限范围转成 YUVJ420P.
+		int chroma = (m_width / 2) * (m_height / 2);
+		m_converted.resize(m_width * m_height + chroma * 2);
+		m_sws = sws_getContext(m_width, m_height, AV_PIX_FMT_YUV420P, m_width, m_height, AV_PIX_FMT_YUVJ420P,
+			SWS_POINT, NULL, NULL, NULL);
+		if (!m_sws)
+			throw std::runtime_error("Could not create preview converter!");
+
+		AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+		if (!codec)
+			throw std::runtime_error("Could not find JPEG encoder!");
+		m_jpeg = avcodec_alloc_context3(codec);
+		m_jpeg_frame = av_frame_alloc();
+		if (!m_jpeg || !m_jpeg_frame)
+			throw std::runtime_error("Could not allocate JPEG encoder!");
+
+		m_jpeg->width = m_width;
+		m_jpeg->height = m_height;
+		m_jpeg->pix_fmt = AV_PIX_FMT_YUVJ420P;
+		m_jpeg->time_base.num = 1;
+		m_jpeg->time_base.den = 25;
+		// 质量 1-100 换算成 qscale 31-2.
+		int quality = std::max(1, std::min(100, m_config.jpeg_quality));
+		int qscale = 31 - (quality - 1) * 29 / 99;
+		m_jpeg->flags |= CODEC_FLAG_QSCALE;
+		m_jpeg->global_quality = qscale * FF_QP2LAMBDA;
+		m_jpeg->qmin = m_jpeg->qmax = qscale;
+		if (avcodec_open2(m_jpeg, codec, NULL) < 0)
+			throw std::runtime_error("Could not open JPEG encoder!");
+		m_jpeg_pipe.reset(m_jpeg);
+
+		m_jpeg_frame->format = AV_PIX_FMT_YUVJ420P;
+		m_jpeg_frame->width = m_width;
+		m_jpeg_frame->height = m_height;
+		m_jpeg_frame->quality = m_jpeg->global_quality;
+		m_jpeg_frame->data[0] = &m_converted[0];
+		m_jpeg_frame->data[1] = m_jpeg_frame->data[0] + m_width * m_height;
+		m_jpeg_frame->data[2] = m_jpeg_frame->data[1] + chroma;
+		m_jpeg_frame->linesize[0] = m_width;
+		m_jpeg_frame->linesize[1] = m_width / 2;
+		m_jpeg_frame->linesize[2] = m_width / 2;
+		m_jpeg_buffer.resize(m_width * m_height * 3 + FF_MIN_BUFFER_SIZE);
+	}
+}
+
+void preview_tap::release()
+{
+	sws_freeContext(m_sws);
+	m_sws = NULL;
+	m_jpeg_pipe.reset(NULL);
+	avcodec_free_context(&m_jpeg);
+	av_frame_free(&m_jpeg_frame);
+}
+
+preview_tap::~preview_tap()
+{
+	wait_idle();
+	release();
+}
+
+void preview_tap::on_frame(uint8_t* const planes[3], const int linesize[3], int width, int height, int64_t timestamp,
+	boost::asio::io_service& io_service)
+{
+	int64_t now = av_gettime_relative();
+	if (m_last_time != AV_NOPTS_VALUE && now - m_last_time < m_config.interval_ms * static_cast<int64_t>(1000))
+		return;
+
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		if (m_busy)
+			return;
+		m_busy = true;
+	}
+
+	const uint8_t* const src[3] = { planes[0], planes[1], planes[2] };
+	if (!m_scaler.scale_yuv420(src, linesize, width, height, m_planes, m_linesize, m_width, m_height))
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_busy = false;
+		m_idle.notify_all();
+		return;
+	}
+
+	m_last_time = now;
+	io_service.post(boost::bind(&preview_tap::deliver, this, timestamp));
+}
+
+bool preview_tap::encode_jpeg(encoder_preview& preview)
+{
+	sws_scale(m_sws, m_planes, m_linesize, 0, m_height, m_jpeg_frame->data, m_jpeg_frame->linesize);
+
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = &m_jpeg_buffer[0];
+	pkt.size = static_cast<int>(m_jpeg_buffer.size());
+
+	if (m_jpeg_pipe.send_frame(m_jpeg_frame) < 0 || m_jpeg_pipe.receive_packet(&pkt) < 0)
+		return false;
+
+	// 新版本的编码器不用调用方的缓冲, 拷回来以便统一释放.
+	if (pkt.data != &m_jpeg_buffer[0])
+	{
+		int size = std::min(pkt.size, static_cast<int>(m_jpeg_buffer.size()));
+		memcpy(&m_jpeg_buffer[0], pkt.data, size);
+		pkt.size = size;
+		av_packet_unref(&pkt);
+	}
+
+	preview.data[0] = &m_jpeg_buffer[0];
+	preview.size = pkt.size;
+	return true;
+}
+
+void preview_tap::deliver(int64_t timestamp)
+{
+	encoder_preview preview;
+	memset(&preview, 0, sizeof(preview));
+	preview.format = m_config.format;
+	preview.width = m_width;
+	preview.height = m_height;
+	preview.timestamp = timestamp;
+
+	bool ok = true;
+	if (m_config.format == ENCODER_PREVIEW_BGRA)
+	{
+		uint8_t* dst[4] = { &m_converted[0], NULL, NULL, NULL };
+		int dst_linesize[4] = { m_width * 4, 0, 0, 0 };
+		sws_scale(m_sws, m_planes, m_linesize, 0, m_height, dst, dst_linesize);
+		preview.data[0] = &m_converted[0];
+		preview.linesize[0] = m_width * 4;
+		preview.size = static_cast<int>(m_converted.size());
+	}
+	else if (m_config.format == ENCODER_PREVIEW_JPEG)
+	{
+		ok = encode_jpeg(preview);
+	}
+	else
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			preview.data[i] = m_planes[i];
+			preview.linesize[i] = m_linesize[i];
+		}
+		preview.size = static_cast<int>(m_small.size());
+	}
+
+	if (ok)
+		m_callback(preview);
+
+	boost::mutex::scoped_lock l(m_mutex);
+	m_busy = false;
+	m_idle.notify_all();
+}
+
+void preview_tap::wait_idle()
+{
+	boost::mutex::scoped_lock l(m_mutex);
+	while (m_busy)
+		m_idle.wait(l);
+}
+
+preview_taps::~preview_taps()
+{
+	// 每个 preview_tap 析构时等自己的回调结束.
+	m_taps.clear();
+}
+
+void preview_taps::wait_idle()
+{
+	boost::mutex::scoped_lock l(m_mutex);
+	for (std::map<int, boost::shared_ptr<preview_tap> >::iterator it = m_taps.begin(); it != m_taps.end(); ++it)
+		it->second->wait_idle();
+}
+
+void preview_taps::set(int id, const preview_config& config, const preview_callback& callback, int out_width, int out_height)
+{
+	boost::shared_ptr<preview_tap> tap;
+	if (callback)
+		tap.reset(new preview_tap(config, callback, out_width, out_height));
+
+	boost::shared_ptr<preview_tap> old;
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		std::map<int, boost::shared_ptr<preview_tap> >::iterator it = m_taps.find(id);
+		if (it != m_taps.end())
+		{
+			old = it->second;
+			m_taps.erase(it);
+		}
+		if (tap)
+			m_taps[id] = tap;
+		m_count = static_cast<int>(m_taps.size());
+	}
+	// 旧的在锁外析构, 等它正在进行的回调结束.
+	old.reset();
+}
+
+void preview_taps::on_frame(uint8_t* const planes[3], const int linesize[3], int width, int height, int64_t timestamp,
+	boost::asio::io_service& io_service)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+	for (std::map<int, boost::shared_ptr<preview_tap> >::iterator it = m_taps.begin(); it != m_taps.end(); ++it)
+		it->second->on_frame(planes, linesize, width, height, timestamp, io_service);
+}
+
+}
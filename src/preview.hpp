@@ -0,0 +1,106 @@
+﻿
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <libencoder_api.hpp>
+#include "ffmpeg_encoder.hpp"
+#include "frame_scaler.hpp"
+
+namespace libencoder {
+
+struct preview_config
+{
+	preview_config() : format(ENCODER_PREVIEW_I420), width(0), height(0), interval_ms(0), jpeg_quality(75) {}
+
+	// encoder_preview_format.
+	int format;
+	// 为 0 时按输出画面的比例算, 两个都为 0 时是输出的 1/4.
+	int width;
+	int height;
+	// 两次预览之间至少间隔多久, 0 表示每帧都要.
+	int interval_ms;
+	// 1-100.
+	int jpeg_quality;
+};
+
+typedef boost::function<void(const encoder_preview&)> preview_callback;
+
+// 从转换好的 YUV 画面上取一个小图.
+// 缩小在送帧的线程上做 (只读一遍整帧, 写一个小图), 转 BGRA, 压 JPEG 和回调放到共享线程池里.
+// 上一张还没交出去时这一帧直接跳过, 不排队.
+class preview_tap : public boost::noncopyable
+{
+public:
+	preview_tap(const preview_config& config, const preview_callback& callback, int out_width, int out_height);
+	~preview_tap();
+
+	// 到时间并且空闲时缩小这一帧, 然后投递到 io_service 上.
+	void on_frame(uint8_t* const planes[3], const int linesize[3], int width, int height, int64_t timestamp,
+		boost::asio::io_service& io_service);
+
+	// 等正在进行的回调结束.
+	void wait_idle();
+
+private:
+	void init_converter();
+	void release();
+	void deliver(int64_t timestamp);
+	bool encode_jpeg(encoder_preview& preview);
+
+private:
+	preview_config m_config;
+	preview_callback m_callback;
+	int m_width;
+	int m_height;
+
+	frame_scaler m_scaler;
+	int64_t m_last_time;
+
+	boost::mutex m_mutex;
+	boost::condition_variable m_idle;
+	bool m_busy;
+
+	// 缩小后的 I420, 以及转换后的 BGRA 或者送给 JPEG 编码器的 YUVJ420P.
+	std::vector<uint8_t> m_small;
+	uint8_t* m_planes[3];
+	int m_linesize[3];
+	std::vector<uint8_t> m_converted;
+	SwsContext* m_sws;
+	AVCodecContext* m_jpeg;
+	encode_pipe m_jpeg_pipe;
+	AVFrame* m_jpeg_frame;
+	std::vector<uint8_t> m_jpeg_buffer;
+};
+
+// 一个会话上的所有预览, 按 id 区分, 例如界面上的实时预览和后台每分钟一张的缩略图.
+class preview_taps : public boost::noncopyable
+{
+public:
+	preview_taps() : m_count(0) {}
+	~preview_taps();
+
+	// callback 为空时删除这个 id.
+	void set(int id, const preview_config& config, const preview_callback& callback, int out_width, int out_height);
+
+	bool empty() const { return m_count == 0; }
+	// 等所有已经投递的预览做完.
+	void wait_idle();
+	void on_frame(uint8_t* const planes[3], const int linesize[3], int width, int height, int64_t timestamp,
+		boost::asio::io_service& io_service);
+
+private:
+	boost::mutex m_mutex;
+	std::map<int, boost::shared_ptr<preview_tap> > m_taps;
+	boost::atomic<int> m_count;
+};
+
+}
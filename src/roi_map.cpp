@@ -0,0 +1,131 @@
+﻿
+#include <algorithm>
+#include <cstring>
+
+#include "roi_map.hpp"
+
+namespace libencoder {
+
+dirty_tracker::dirty_tracker()
+	: m_width(0)
+	, m_height(0)
+{
+}
+
+void dirty_tracker::update(const uint8_t* y, int linesize, int width, int height,
+	int dirty_qoffset, int static_qoffset, std::vector<roi_rect>& rois)
+{
+	int bw = (width + block_size - 1) / block_size;
+	int bh = (height + block_size - 1) / block_size;
+
+	if (width != m_width || height != m_height)
+	{
+		m_width = width;
+		m_height = height;
+		m_prev.resize(static_cast<std::size_t>(width) * height);
+		m_dirty.resize(static_cast<std::size_t>(bw) * bh);
+		for (int row = 0; row < height; row++)
+			memcpy(&m_prev[static_cast<std::size_t>(row) * width], y + static_cast<std::ptrdiff_t>(row) * linesize, width);
+		return;
+	}
+
+	// 逐行比较, 整行相同时跳过, 不同的行再按宏块细分.
+	std::fill(m_dirty.begin(), m_dirty.end(), 0);
+	bool any = false;
+	for (int row = 0; row < height; row++)
+	{
+		const uint8_t* cur = y + static_cast<std::ptrdiff_t>(row) * linesize;
+		uint8_t* prev = &m_prev[static_cast<std::size_t>(row) * width];
+		if (memcmp(cur, prev, width) == 0)
+			continue;
+
+		uint8_t* dirty = &m_dirty[static_cast<std::size_t>(row / block_size) * bw];
+		for (int bx = 0; bx < bw; bx++)
+		{
+			int x = bx * block_size;
+			int n = std::min<int>(block_size, width - x);
+			if (!dirty[bx] && memcmp(cur + x, prev + x, n) != 0)
+				dirty[bx] = 1;
+		}
+		memcpy(prev, cur, width);
+		any = true;
+	}
+
+	// 每行连续的脏宏块连成一段, 和上一行横向范围相同的段向下延伸.
+	m_rects.clear();
+	std::size_t open_begin = 0;
+	for (int by = 0; any && by < bh; by++)
+	{
+		std::size_t row_begin = m_rects.size();
+		const uint8_t* dirty = &m_dirty[static_cast<std::size_t>(by) * bw];
+		for (int bx = 0; bx < bw; )
+		{
+			if (!dirty[bx])
+			{
+				bx++;
+				continue;
+			}
+			int end = bx;
+			while (end < bw && dirty[end])
+				end++;
+
+			roi_rect r = { bx, by, end, by + 1, dirty_qoffset };
+			bool extended = false;
+			for (std::size_t i = open_begin; i < row_begin; i++)
+			{
+				if (m_rects[i].left == r.left && m_rects[i].right == r.right && m_rects[i].bottom == by)
+				{
+					m_rects[i].bottom = by + 1;
+					extended = true;
+					break;
+				}
+			}
+			if (!extended)
+				m_rects.push_back(r);
+			bx = end;
+		}
+
+		// 上一行没有延伸的段不会再变, 只在最近两行之间找.
+		std::size_t next_open = m_rects.size();
+		for (std::size_t i = open_begin; i < m_rects.size(); i++)
+		{
+			if (m_rects[i].bottom == by + 1)
+			{
+				next_open = i;
+				break;
+			}
+		}
+		open_begin = next_open;
+	}
+
+	if (m_rects.size() > static_cast<std::size_t>(max_rects))
+	{
+		roi_rect box = m_rects[0];
+		for (std::size_t i = 1; i < m_rects.size(); i++)
+		{
+			box.left = std::min(box.left, m_rects[i].left);
+			box.top = std::min(box.top, m_rects[i].top);
+			box.right = std::max(box.right, m_rects[i].right);
+			box.bottom = std::max(box.bottom, m_rects[i].bottom);
+		}
+		m_rects.assign(1, box);
+	}
+
+	for (std::size_t i = 0; i < m_rects.size(); i++)
+	{
+		roi_rect r = m_rects[i];
+		r.left *= block_size;
+		r.top *= block_size;
+		r.right = std::min(r.right * block_size, width);
+		r.bottom = std::min(r.bottom * block_size, height);
+		rois.push_back(r);
+	}
+
+	if (static_qoffset)
+	{
+		roi_rect all = { 0, 0, width, height, static_qoffset };
+		rois.push_back(all);
+	}
+}
+
+}
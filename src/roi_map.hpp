@@ -0,0 +1,38 @@
+﻿
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+
+#include "ffmpeg_encoder.hpp"
+
+namespace libencoder {
+
+// 比较相邻两帧的亮度, 找出变化过的区域.
+// 屏幕内容大部分时间只有很小一块在变, 变化的区域 (正在输入的文字, 活动窗口) 提高画质,
+// 其余不变的区域降低画质, 同样的观感可以省下不少码率.
+class dirty_tracker : public boost::noncopyable
+{
+public:
+	// 以 16x16 的宏块为单位比较, 区域太碎时合并成一个外接矩形.
+	enum { block_size = 16, max_rects = 32 };
+
+	dirty_tracker();
+
+	// y 是这一帧的亮度平面, 把变化的区域 (qoffset 为 dirty_qoffset) 追加到 rois,
+	// static_qoffset 不为 0 时最后再追加一个整幅画面的区域作为其余部分的偏移.
+	// 第一帧和尺寸变化后的第一帧只记录, 不输出区域.
+	void update(const uint8_t* y, int linesize, int width, int height,
+		int dirty_qoffset, int static_qoffset, std::vector<roi_rect>& rois);
+
+private:
+	int m_width;
+	int m_height;
+	std::vector<uint8_t> m_prev;
+	std::vector<uint8_t> m_dirty;
+	std::vector<roi_rect> m_rects;
+};
+
+}
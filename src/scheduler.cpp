@@ -0,0 +1,297 @@
+﻿
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+#include "scheduler.hpp"
+
+namespace libencoder {
+
+// 单个 x264 实例超过 16 线程基本没有收益.
+static const int max_codec_threads = 16;
+
+scheduler& scheduler::instance()
+{
+	// 故意不析构, 进程退出时线程池的线程随进程结束, 不用担心静态对象的析构顺序.
+	static scheduler* s = new scheduler;
+	return *s;
+}
+
+namespace {
+
+// 让线程池里的一个线程退出 run.
+struct pool_exit {};
+
+void leave_pool()
+{
+	throw pool_exit();
+}
+
+}
+
+scheduler::pool::pool(const cpu_set& cpus_, int count)
+	: cpus(cpus_)
+	, work(new boost::asio::io_service::work(io_service))
+	, leaving(0)
+	, sessions(0)
+{
+	resize(count);
+}
+
+scheduler::pool::~pool()
+{
+	work.reset();
+	io_service.stop();
+	threads.join_all();
+}
+
+void scheduler::pool::run()
+{
+	pin_current_thread(cpus);
+	try
+	{
+		io_service.run();
+	}
+	catch (pool_exit&)
+	{
+		boost::mutex::scoped_lock l(threads_mutex);
+		thread_ids.erase(std::find(thread_ids.begin(), thread_ids.end(), boost::this_thread::get_id()));
+		leaving--;
+	}
+}
+
+void scheduler::pool::resize(int count)
+{
+	boost::mutex::scoped_lock l(threads_mutex);
+
+	int current = static_cast<int>(thread_ids.size()) - leaving;
+	for (; current < count; current++)
+	{
+		boost::thread* t = threads.create_thread(boost::bind(&pool::run, this));
+		thread_ids.push_back(t->get_id());
+	}
+	for (; current > count; current--)
+	{
+		leaving++;
+		io_service.post(&leave_pool);
+	}
+}
+
+int scheduler::pool::thread_count() const
+{
+	boost::mutex::scoped_lock l(threads_mutex);
+	return static_cast<int>(thread_ids.size()) - leaving;
+}
+
+bool scheduler::pool::contains_current_thread() const
+{
+	boost::mutex::scoped_lock l(threads_mutex);
+	return std::find(thread_ids.begin(), thread_ids.end(), boost::this_thread::get_id()) != thread_ids.end();
+}
+
+scheduler::scheduler()
+	: m_default_pool(NULL)
+	, m_core_budget(std::max(1u, boost::thread::hardware_concurrency()))
+	, m_expected_sessions(1)
+	, m_next_session(1)
+	, m_total_priority(0)
+{
+	m_default_pool = new pool(cpu_set(), m_core_budget);
+}
+
+scheduler::~scheduler()
+{
+	for (std::map<std::string, pool*>::iterator it = m_pinned_pools.begin(); it != m_pinned_pools.end(); ++it)
+		delete it->second;
+	delete m_default_pool;
+}
+
+void scheduler::configure(int core_budget, int expected_sessions)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	if (expected_sessions > 0)
+		m_expected_sessions = expected_sessions;
+	if (core_budget <= 0 || core_budget == m_core_budget)
+		return;
+
+	m_core_budget = core_budget;
+	m_default_pool->resize(pool_size(cpu_set()));
+	for (std::map<std::string, pool*>::iterator it = m_pinned_pools.begin(); it != m_pinned_pools.end(); ++it)
+		it->second->resize(pool_size(it->second->cpus));
+}
+
+int scheduler::pool_size(const cpu_set& cpus) const
+{
+	return cpus.empty() ? m_core_budget : std::min(cpus.size(), m_core_budget);
+}
+
+int scheduler::core_budget() const
+{
+	boost::mutex::scoped_lock l(m_mutex);
+	return m_core_budget;
+}
+
+int scheduler::register_session(int priority, const cpu_set& cpus)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	if (priority <= 0)
+		priority = default_priority;
+
+	m_total_priority += priority;
+
+	pool* workers = m_default_pool;
+	if (!cpus.empty())
+	{
+		std::string key = cpus.to_string();
+		std::map<std::string, pool*>::iterator it = m_pinned_pools.find(key);
+		if (it == m_pinned_pools.end())
+			it = m_pinned_pools.insert(std::make_pair(key, new pool(cpus, pool_size(cpus)))).first;
+		workers = it->second;
+	}
+	workers->sessions++;
+
+	session_info info = { priority, 0, workers };
+	int session = m_next_session++;
+	m_sessions[session] = info;
+	return session;
+}
+
+void scheduler::unregister_session(int session)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	std::map<int, session_info>::iterator it = m_sessions.find(session);
+	if (it == m_sessions.end())
+		return;
+	m_total_priority -= it->second.priority;
+
+	pool* workers = it->second.workers;
+	m_sessions.erase(it);
+
+	// 绑定的线程池没人用了就拆掉. 注销可能就发生在这个池的线程上, 不能在这里等它的线程退出.
+	if (--workers->sessions == 0 && workers != m_default_pool)
+	{
+		m_pinned_pools.erase(workers->cpus.to_string());
+		boost::thread(boost::bind(&delete_pool, workers)).detach();
+	}
+}
+
+void scheduler::delete_pool(pool* p)
+{
+	delete p;
+}
+
+int scheduler::session_threads(int session)
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	std::map<int, session_info>::iterator it = m_sessions.find(session);
+	if (it == m_sessions.end())
+		return 1;
+
+	// 按优先级分核, 预计会有多个会话时按预计的会话数留出份额.
+	int total = std::max(m_total_priority, m_expected_sessions * static_cast<int>(default_priority));
+	int threads = static_cast<int>(static_cast<int64_t>(m_core_budget) * it->second.priority / total);
+
+	// 别的会话已经占用的线程不再分出去, 所有会话加起来不超过预算.
+	int claimed = 0;
+	for (std::map<int, session_info>::const_iterator s = m_sessions.begin(); s != m_sessions.end(); ++s)
+	{
+		if (s != it)
+			claimed += s->second.threads;
+	}
+	threads = std::min(threads, m_core_budget - claimed);
+
+	const cpu_set& cpus = it->second.workers->cpus;
+	if (!cpus.empty())
+		threads = std::min(threads, cpus.size());
+	threads = std::max(1, std::min(threads, max_codec_threads));
+
+	it->second.threads = threads;
+	return threads;
+}
+
+cpu_set scheduler::session_cpus(int session) const
+{
+	return session_pool(session)->cpus;
+}
+
+boost::asio::io_service& scheduler::io_service(int session)
+{
+	return session_pool(session)->io_service;
+}
+
+scheduler::pool* scheduler::session_pool(int session) const
+{
+	boost::mutex::scoped_lock l(m_mutex);
+
+	std::map<int, session_info>::const_iterator it = m_sessions.find(session);
+	return it == m_sessions.end() ? m_default_pool : it->second.workers;
+}
+
+namespace {
+
+struct parallel_join
+{
+	boost::mutex mutex;
+	boost::condition_variable cond;
+	int pending;
+
+	void done()
+	{
+		boost::mutex::scoped_lock l(mutex);
+		if (--pending == 0)
+			cond.notify_one();
+	}
+};
+
+void run_range(const boost::function<void(int, int)>* fn, int begin, int end, parallel_join* join)
+{
+	(*fn)(begin, end);
+	join->done();
+}
+
+}
+
+void scheduler::parallel_for(int session, int count, int grain, const boost::function<void(int, int)>& fn)
+{
+	if (count <= 0)
+		return;
+
+	pool* workers = session_pool(session);
+	int chunks = std::min(workers->thread_count(), count / std::max(1, grain));
+
+	// 任务太小, 或者本身就在线程池里 (避免所有线程互相等待).
+	if (chunks <= 1 || workers->contains_current_thread())
+	{
+		fn(0, count);
+		return;
+	}
+
+	parallel_join join;
+	join.pending = chunks - 1;
+
+	int step = (count + chunks - 1) / chunks;
+	for (int i = 1; i < chunks; i++)
+	{
+		int begin = i * step;
+		int end = std::min(count, begin + step);
+		if (begin >= end)
+		{
+			join.done();
+			continue;
+		}
+		workers->io_service.post(boost::bind(&run_range, &fn, begin, end, &join));
+	}
+
+	// 第一段在调用线程上做.
+	fn(0, std::min(count, step));
+
+	boost::mutex::scoped_lock l(join.mutex);
+	while (join.pending > 0)
+		join.cond.wait(l);
+}
+
+}
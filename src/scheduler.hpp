@@ -0,0 +1,105 @@
+﻿
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "affinity.hpp"
+
+namespace libencoder {
+
+// 进程内所有编码会话共用的调度器.
+// 全局的核预算按优先级分给各个会话, 决定各自 x264 的线程数;
+// 格式转换和音频编码这类工作统一投递到一个共享线程池里, 不再每个会话各开线程.
+// 指定了 cpu 集合的会话使用绑定在这组 cpu 上的线程池, 相同集合的会话共用一个.
+class scheduler : public boost::noncopyable
+{
+public:
+	enum { default_priority = 100 };
+
+	static scheduler& instance();
+
+	// 设置全局的核预算, 以及预计同时运行的会话数, 线程池随预算增减线程.
+	// 已经打开的编码器线程数不会变, 只影响之后分配的编码线程.
+	void configure(int core_budget, int expected_sessions);
+
+	int core_budget() const;
+
+	// 注册一个会话, 返回会话号. 优先级越高分到的核越多.
+	// cpus 不为空时, 会话的工作都放到绑定在这组 cpu 上的线程池里.
+	int register_session(int priority, const cpu_set& cpus = cpu_set());
+	void unregister_session(int session);
+
+	// 会话的编码线程数, 打开编码器时取一次: 按当前所有会话的优先级算出份额,
+	// 不超过预算里还没被别的会话占用的部分, 至少 1 个. 取过之后这些线程算作被这个会话占用, 注销时归还.
+	int session_threads(int session);
+
+	// 会话绑定的 cpu 集合, 没有绑定时为空.
+	cpu_set session_cpus(int session) const;
+
+	// 会话所用线程池的 io_service.
+	boost::asio::io_service& io_service(int session);
+
+	// 把 [0, count) 切成若干段放到会话的线程池上并行执行, 等全部完成再返回.
+	// 每段至少 grain 个元素, 在线程池内部调用时直接串行执行.
+	void parallel_for(int session, int count, int grain, const boost::function<void(int, int)>& fn);
+
+private:
+	struct pool : public boost::noncopyable
+	{
+		pool(const cpu_set& cpus, int threads);
+		~pool();
+
+		void run();
+		// 增减线程, 多出来的线程做完手上的任务后退出.
+		void resize(int count);
+		int thread_count() const;
+		bool contains_current_thread() const;
+
+		cpu_set cpus;
+		boost::asio::io_service io_service;
+		boost::scoped_ptr<boost::asio::io_service::work> work;
+		mutable boost::mutex threads_mutex;
+		boost::thread_group threads;
+		std::vector<boost::thread::id> thread_ids;
+		// 已经通知退出还没退出的线程数.
+		int leaving;
+		// 使用这个线程池的会话数, 由调度器的锁保护.
+		int sessions;
+	};
+
+	scheduler();
+	~scheduler();
+
+	pool* session_pool(int session) const;
+	static void delete_pool(pool* p);
+	// 线程池的线程数不超过预算.
+	int pool_size(const cpu_set& cpus) const;
+
+private:
+	pool* m_default_pool;
+	std::map<std::string, pool*> m_pinned_pools;
+
+	mutable boost::mutex m_mutex;
+	int m_core_budget;
+	int m_expected_sessions;
+	int m_next_session;
+	int m_total_priority;
+
+	struct session_info
+	{
+		int priority;
+		// session_threads 分出去的线程数, 还没取过时为 0.
+		int threads;
+		pool* workers;
+	};
+	std::map<int, session_info> m_sessions;
+};
+
+}
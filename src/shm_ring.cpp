@@ -0,0 +1,397 @@
+﻿
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/chrono.hpp>
+#include <boost/static_assert.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// 老的 glibc 没有 memfd 封口的定义.
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#endif
+
+#include "shm_ring.hpp"
+
+namespace libencoder {
+
+namespace {
+
+const uint32_t ring_magic = 0x4D485345; // "ESHM"
+const uint32_t ring_version = 1;
+const uint32_t max_slots = 1024;
+const std::size_t page_size = 4096;
+
+std::size_t round_up(std::size_t size)
+{
+	return (size + page_size - 1) / page_size * page_size;
+}
+
+}
+
+// futex 直接等在共享内存里的计数上, 要求 atomic 和 uint32_t 一样大, 不加锁.
+BOOST_STATIC_ASSERT(sizeof(boost::atomic<uint32_t>) == sizeof(uint32_t));
+
+struct shm_ring::header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slot_bytes;
+	uint32_t data_offset;
+	uint32_t reserved[11];
+
+	// 两个计数分在不同的缓存行上.
+	boost::atomic<uint32_t> write_seq;
+	uint32_t pad0[15];
+	boost::atomic<uint32_t> read_seq;
+	uint32_t pad1[15];
+	boost::atomic<uint32_t> closed;
+};
+
+shm_ring::shm_ring()
+	: m_owner(false)
+	, m_fd(-1)
+#ifdef _WIN32
+	, m_mapping(NULL)
+	, m_write_event(NULL)
+	, m_read_event(NULL)
+#endif
+	, m_base(NULL)
+	, m_size(0)
+	, m_header(NULL)
+	, m_slots(NULL)
+	, m_slot_count(0)
+	, m_slot_bytes(0)
+	, m_data_offset(0)
+	, m_write(0)
+	, m_read(0)
+{
+}
+
+shm_ring::~shm_ring()
+{
+#ifdef _WIN32
+	if (m_base)
+		UnmapViewOfFile(m_base);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_write_event)
+		CloseHandle(m_write_event);
+	if (m_read_event)
+		CloseHandle(m_read_event);
+#elif defined(__linux__)
+	if (m_base)
+		munmap(m_base, m_size);
+	if (m_fd >= 0)
+		::close(m_fd);
+	if (m_owner && !m_name.empty())
+		shm_unlink(m_name.c_str());
+#endif
+}
+
+void shm_ring::map(std::size_t size, bool create)
+{
+#ifdef _WIN32
+	if (m_name.empty())
+		throw std::runtime_error("shared memory ring needs a name on Windows");
+
+	std::string base = "Local\\libencoder-" + m_name;
+	if (create)
+		m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), base.c_str());
+	else
+		m_mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, base.c_str());
+	if (!m_mapping)
+		throw std::runtime_error("could not open shared memory " + m_name);
+
+	m_base = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+	if (!m_base)
+		throw std::runtime_error("could not map shared memory " + m_name);
+	if (!create)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		VirtualQuery(m_base, &info, sizeof(info));
+		size = info.RegionSize;
+	}
+
+	m_write_event = CreateEventA(NULL, FALSE, FALSE, (base + "-w").c_str());
+	m_read_event = CreateEventA(NULL, FALSE, FALSE, (base + "-r").c_str());
+	if (!m_write_event || !m_read_event)
+		throw std::runtime_error("could not create events for shared memory " + m_name);
+#elif defined(__linux__)
+	if (m_fd < 0)
+	{
+		if (!m_name.empty())
+			m_fd = shm_open(m_name.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+#ifdef SYS_memfd_create
+		else if (create)
+			m_fd = static_cast<int>(syscall(SYS_memfd_create, "libencoder-shm", 3 /* MFD_CLOEXEC | MFD_ALLOW_SEALING */));
+#endif
+		if (m_fd < 0)
+			throw std::runtime_error("could not open shared memory " + m_name + ": " + strerror(errno));
+		m_owner = create;
+	}
+
+	if (create)
+	{
+		if (ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+			throw std::runtime_error(std::string("could not size shared memory: ") + strerror(errno));
+		// memfd 封住大小, 拿到描述符的一方不能再 ftruncate 让对方访问映射时收到 SIGBUS.
+		if (m_name.empty() && fcntl(m_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+			throw std::runtime_error(std::string("could not seal shared memory: ") + strerror(errno));
+	}
+	else
+	{
+		struct stat st;
+		if (fstat(m_fd, &st) != 0)
+			throw std::runtime_error(std::string("could not stat shared memory: ") + strerror(errno));
+		size = static_cast<std::size_t>(st.st_size);
+	}
+	if (size < sizeof(header))
+		throw std::runtime_error("shared memory is too small");
+
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (p == MAP_FAILED)
+		throw std::runtime_error(std::string("could not map shared memory: ") + strerror(errno));
+	m_base = static_cast<uint8_t*>(p);
+#else
+	(void)create;
+	throw std::runtime_error("shared memory ring is not supported on this platform");
+#endif
+	m_size = size;
+	m_header = reinterpret_cast<header*>(m_base);
+}
+
+void shm_ring::attach()
+{
+	// 对方给的参数只在这里读一次, 校验后用自己的副本.
+	m_slot_count = m_header->slot_count;
+	m_slot_bytes = m_header->slot_bytes;
+	m_data_offset = m_header->data_offset;
+
+	if (m_header->magic != ring_magic || m_header->version != ring_version)
+		throw std::runtime_error("shared memory is not a libencoder frame ring");
+	if (m_slot_count == 0 || m_slot_count > max_slots || m_slot_bytes == 0
+		|| m_data_offset < sizeof(header) + m_slot_count * sizeof(encoder_shm_frame)
+		|| m_data_offset + static_cast<uint64_t>(m_slot_count) * m_slot_bytes > m_size)
+		throw std::runtime_error("shared memory frame ring has a bad layout");
+
+	m_slots = reinterpret_cast<encoder_shm_frame*>(m_base + sizeof(header));
+	m_write = m_header->write_seq.load(boost::memory_order_acquire);
+	m_read = m_header->read_seq.load(boost::memory_order_acquire);
+}
+
+shm_ring* shm_ring::create(const std::string& name, int slots, int slot_bytes)
+{
+	if (slots <= 0 || static_cast<uint32_t>(slots) > max_slots || slot_bytes <= 0)
+		throw std::runtime_error("bad shared memory ring size");
+
+	std::size_t data_offset = round_up(sizeof(header) + slots * sizeof(encoder_shm_frame));
+	std::size_t slot_size = round_up(slot_bytes);
+	if (slot_size > UINT_MAX || data_offset + static_cast<uint64_t>(slots) * slot_size > UINT_MAX)
+		throw std::runtime_error("shared memory ring is too large");
+
+	shm_ring* ring = new shm_ring;
+	try
+	{
+		ring->m_name = name;
+		ring->map(data_offset + slots * slot_size, true);
+
+		header* h = ring->m_header;
+		h->magic = 0;
+		memset(h->reserved, 0, sizeof(h->reserved));
+		memset(h->pad0, 0, sizeof(h->pad0));
+		memset(h->pad1, 0, sizeof(h->pad1));
+		h->write_seq.store(0, boost::memory_order_relaxed);
+		h->read_seq.store(0, boost::memory_order_relaxed);
+		h->closed.store(0, boost::memory_order_relaxed);
+		h->slot_count = slots;
+		h->slot_bytes = static_cast<uint32_t>(slot_size);
+		h->data_offset = static_cast<uint32_t>(data_offset);
+		h->version = ring_version;
+		// magic 最后写, 对方看到 magic 时其余字段已经写好.
+		boost::atomic_thread_fence(boost::memory_order_release);
+		h->magic = ring_magic;
+
+		ring->attach();
+	}
+	catch (...)
+	{
+		delete ring;
+		throw;
+	}
+	return ring;
+}
+
+shm_ring* shm_ring::open(const std::string& name)
+{
+	shm_ring* ring = new shm_ring;
+	try
+	{
+		ring->m_name = name;
+		ring->map(0, false);
+		ring->attach();
+	}
+	catch (...)
+	{
+		delete ring;
+		throw;
+	}
+	return ring;
+}
+
+shm_ring* shm_ring::open_fd(int fd)
+{
+	shm_ring* ring = new shm_ring;
+	try
+	{
+#ifdef __linux__
+		// 描述符由调用方关闭, 自己留一份.
+		ring->m_fd = dup(fd);
+		if (ring->m_fd < 0)
+			throw std::runtime_error(std::string("bad shared memory descriptor: ") + strerror(errno));
+		// 大小没有封住的描述符, 对方随时可以截短, 不用.
+		int seals = fcntl(ring->m_fd, F_GET_SEALS);
+		if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW))
+			throw std::runtime_error("shared memory descriptor is not sealed");
+#else
+		(void)fd;
+#endif
+		ring->map(0, false);
+		ring->attach();
+	}
+	catch (...)
+	{
+		delete ring;
+		throw;
+	}
+	return ring;
+}
+
+void shm_ring::wait(boost::atomic<uint32_t>& word, uint32_t value, int timeout_ms, bool read_side)
+{
+#ifdef _WIN32
+	(void)word;
+	(void)value;
+	WaitForSingleObject(read_side ? m_read_event : m_write_event, timeout_ms < 0 ? INFINITE : timeout_ms);
+#elif defined(__linux__)
+	(void)read_side;
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	// 不带 FUTEX_PRIVATE_FLAG, 另一个进程映射的是同一个页.
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+#endif
+}
+
+void shm_ring::wake(boost::atomic<uint32_t>& word, bool read_side)
+{
+#ifdef _WIN32
+	(void)word;
+	SetEvent(read_side ? m_read_event : m_write_event);
+#elif defined(__linux__)
+	(void)read_side;
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+// 剩余的等待时间, timeout_ms 小于 0 时一直是 -1.
+static int remaining_ms(int timeout_ms, boost::chrono::steady_clock::time_point start)
+{
+	if (timeout_ms < 0)
+		return -1;
+	boost::chrono::milliseconds elapsed = boost::chrono::duration_cast<boost::chrono::milliseconds>(boost::chrono::steady_clock::now() - start);
+	return std::max(0, timeout_ms - static_cast<int>(elapsed.count()));
+}
+
+uint8_t* shm_ring::begin_write(int timeout_ms)
+{
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+
+	for (;;)
+	{
+		if (m_header->closed.load(boost::memory_order_acquire))
+			return NULL;
+
+		uint32_t read = m_header->read_seq.load(boost::memory_order_acquire);
+		if (m_write - read < m_slot_count)
+			return m_base + m_data_offset + static_cast<std::size_t>(m_write % m_slot_count) * m_slot_bytes;
+
+		int left = remaining_ms(timeout_ms, start);
+		if (left == 0)
+			return NULL;
+		wait(m_header->read_seq, read, left, true);
+	}
+}
+
+void shm_ring::commit(const encoder_shm_frame& frame)
+{
+	memcpy(&m_slots[m_write % m_slot_count], &frame, sizeof(frame));
+	m_header->write_seq.store(++m_write, boost::memory_order_release);
+	wake(m_header->write_seq, false);
+}
+
+void shm_ring::close()
+{
+	m_header->closed.store(1, boost::memory_order_release);
+	wake(m_header->write_seq, false);
+	wake(m_header->read_seq, true);
+}
+
+int shm_ring::wait_readable(int timeout_ms)
+{
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+
+	for (;;)
+	{
+		// 先看 closed 再看计数, 关闭之前提交的槽一定能读到.
+		bool closed = m_header->closed.load(boost::memory_order_acquire) != 0;
+		uint32_t write = m_header->write_seq.load(boost::memory_order_acquire);
+		if (write != m_read)
+		{
+			if (write - m_read > m_slot_count)
+				throw std::runtime_error("shared memory frame ring is corrupted");
+			return static_cast<int>(write - m_read);
+		}
+		if (closed)
+			return -1;
+
+		int left = remaining_ms(timeout_ms, start);
+		if (left == 0)
+			return 0;
+		wait(m_header->write_seq, write, left, false);
+	}
+}
+
+const uint8_t* shm_ring::front(encoder_shm_frame& frame) const
+{
+	memcpy(&frame, &m_slots[m_read % m_slot_count], sizeof(frame));
+	return m_base + m_data_offset + static_cast<std::size_t>(m_read % m_slot_count) * m_slot_bytes;
+}
+
+void shm_ring::pop()
+{
+	m_header->read_seq.store(++m_read, boost::memory_order_release);
+	wake(m_header->read_seq, true);
+}
+
+}
@@ -0,0 +1,76 @@
+﻿
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <libencoder_api.hpp>
+
+namespace libencoder {
+
+// 跨进程的单生产者单消费者帧环, 放在共享内存里.
+// 开头是环的头和每个槽的描述 (encoder_shm_frame), 后面是按页对齐的槽.
+// 两边各自维护自己的计数, 通过头里的 write_seq / read_seq 交接, 等待用 futex (Windows 上用命名事件).
+// 生产者可能不可信, 消费者只用自己打开时校验过的几何参数, 每个槽的描述先拷出来再检查.
+class shm_ring : public boost::noncopyable
+{
+public:
+	// 出错抛出 std::runtime_error. name 为空时 Linux 上用 memfd.
+	static shm_ring* create(const std::string& name, int slots, int slot_bytes);
+	static shm_ring* open(const std::string& name);
+	static shm_ring* open_fd(int fd);
+	~shm_ring();
+
+	int fd() const { return m_fd; }
+	int slot_bytes() const { return static_cast<int>(m_slot_bytes); }
+
+	// 生产者: 等一个空槽, 超时或者已关闭时返回 NULL.
+	uint8_t* begin_write(int timeout_ms);
+	void commit(const encoder_shm_frame& frame);
+	void close();
+
+	// 消费者: 等到有提交的槽, 返回可读的槽数, 超时返回 0, 已关闭并且读完返回 -1.
+	// 计数对不上 (生产者写坏了头) 时抛出 std::runtime_error.
+	int wait_readable(int timeout_ms);
+	// 最早提交的槽, 描述拷到 frame 里.
+	const uint8_t* front(encoder_shm_frame& frame) const;
+	void pop();
+
+private:
+	struct header;
+
+	shm_ring();
+	void map(std::size_t size, bool create);
+	void attach();
+
+	// word 还等于 value 时最多等 timeout_ms, 被唤醒或者超时返回.
+	void wait(boost::atomic<uint32_t>& word, uint32_t value, int timeout_ms, bool read_side);
+	void wake(boost::atomic<uint32_t>& word, bool read_side);
+
+private:
+	std::string m_name;
+	bool m_owner;
+	int m_fd;
+#ifdef _WIN32
+	void* m_mapping;
+	void* m_write_event;
+	void* m_read_event;
+#endif
+	uint8_t* m_base;
+	std::size_t m_size;
+
+	header* m_header;
+	encoder_shm_frame* m_slots;
+	uint32_t m_slot_count;
+	uint32_t m_slot_bytes;
+	uint32_t m_data_offset;
+
+	// 生产者写到的位置, 消费者读到的位置.
+	uint32_t m_write;
+	uint32_t m_read;
+};
+
+}
@@ -0,0 +1,131 @@
+﻿
+#include <algorithm>
+#include <cstdio>
+
+#include <boost/thread/tss.hpp>
+
+extern "C"
+{
+#include "libavutil/time.h"
+}
+
+#include "trace.hpp"
+
+namespace libencoder {
+
+boost::atomic<bool> trace_ring::s_enabled(false);
+
+static const char* const stage_names[trace_stage_count] =
+{
+	"clip", "convert", "overlay", "compose", "video_encode", "audio_encode", "mux_write",
+};
+
+const char* trace_stage_name(int stage)
+{
+	return stage >= 0 && stage < trace_stage_count ? stage_names[stage] : "unknown";
+}
+
+trace_ring& trace_ring::instance()
+{
+	// 和 log_ring 一样故意不析构, 线程池里的线程退出前还可能在记录.
+	static trace_ring* ring = new trace_ring;
+	return *ring;
+}
+
+trace_ring::trace_ring()
+	: m_next(0)
+	, m_first(0)
+{
+	for (int i = 0; i < slot_count; i++)
+		m_slots[i].seq = 0;
+}
+
+void trace_ring::enable(bool on)
+{
+	if (on)
+	{
+		trace_ring& ring = instance();
+		ring.m_first.store(ring.m_next.load(boost::memory_order_relaxed), boost::memory_order_relaxed);
+	}
+	s_enabled.store(on, boost::memory_order_release);
+}
+
+int64_t trace_ring::now()
+{
+	return av_gettime_relative();
+}
+
+// Chrome trace 里用的线程号, 按第一次记录的顺序从 1 开始编.
+static uint32_t current_tid()
+{
+	static boost::atomic<uint32_t> next_tid(1);
+	static boost::thread_specific_ptr<uint32_t> tid;
+
+	uint32_t* p = tid.get();
+	if (!p)
+	{
+		p = new uint32_t(next_tid.fetch_add(1, boost::memory_order_relaxed));
+		tid.reset(p);
+	}
+	return *p;
+}
+
+void trace_ring::record(int stage, int64_t arg, int64_t begin, int64_t end)
+{
+	uint32_t tid = current_tid();
+
+	uint64_t n = m_next.fetch_add(1, boost::memory_order_relaxed);
+	slot& s = m_slots[n % slot_count];
+
+	s.seq.store(n * 2 + 1, boost::memory_order_relaxed);
+	boost::atomic_thread_fence(boost::memory_order_release);
+
+	s.begin = begin;
+	s.end = end;
+	s.arg = arg;
+	s.tid = tid;
+	s.stage = stage;
+
+	s.seq.store(n * 2 + 2, boost::memory_order_release);
+}
+
+std::string trace_ring::dump_json() const
+{
+	std::string out = "{\"traceEvents\":[";
+
+	uint64_t end = m_next.load(boost::memory_order_acquire);
+	uint64_t begin = std::max(m_first.load(boost::memory_order_relaxed),
+		end > static_cast<uint64_t>(slot_count) ? end - slot_count : 0);
+
+	bool first = true;
+	char line[256];
+	for (uint64_t n = begin; n < end; n++)
+	{
+		const slot& s = m_slots[n % slot_count];
+
+		uint64_t seq = s.seq.load(boost::memory_order_acquire);
+		if (seq != n * 2 + 2)
+			continue;
+		int64_t span_begin = s.begin;
+		int64_t span_end = s.end;
+		int64_t arg = s.arg;
+		uint32_t tid = s.tid;
+		int stage = s.stage;
+		boost::atomic_thread_fence(boost::memory_order_acquire);
+		if (s.seq.load(boost::memory_order_relaxed) != seq)
+			continue;
+
+		snprintf(line, sizeof(line),
+			"%s\n{\"name\":\"%s\",\"cat\":\"libencoder\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%u,\"args\":{\"ts\":%lld}}",
+			first ? "" : ",", trace_stage_name(stage),
+			static_cast<long long>(span_begin), static_cast<long long>(span_end - span_begin),
+			tid, static_cast<long long>(arg));
+		out += line;
+		first = false;
+	}
+
+	out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+	return out;
+}
+
+}
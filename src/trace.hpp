@@ -0,0 +1,104 @@
+﻿
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+// 用 -DLIBENCODER_USDT=ON 编译时每个阶段的开始和结束各放一个 USDT 探针
+// (libencoder:stage_begin / libencoder:stage_end, 参数是阶段号和帧时间戳),
+// 没有 perf / bpftrace 挂上来时只是一条 nop.
+#if defined(LIBENCODER_USDT) && defined(__linux__)
+#	include <sys/sdt.h>
+#	define LIBENCODER_PROBE(name, stage, arg) DTRACE_PROBE2(libencoder, name, stage, arg)
+#else
+#	define LIBENCODER_PROBE(name, stage, arg) ((void)0)
+#endif
+
+namespace libencoder {
+
+enum trace_stage
+{
+	trace_clip,
+	trace_convert,
+	trace_overlay,
+	trace_compose,
+	trace_video_encode,
+	trace_audio_encode,
+	trace_mux_write,
+	trace_stage_count
+};
+
+const char* trace_stage_name(int stage);
+
+// 各阶段的耗时记录, 固定大小的环形缓冲, 写入不加锁也不分配内存.
+// 没有打开时只多一次 relaxed 读, 缓冲区在第一次打开时才分配.
+class trace_ring : public boost::noncopyable
+{
+public:
+	enum { slot_count = 16384 };
+
+	static trace_ring& instance();
+
+	static bool enabled() { return s_enabled.load(boost::memory_order_relaxed); }
+
+	// 打开时丢掉之前的记录, 关闭时保留, 之后还能导出.
+	static void enable(bool on);
+
+	// 时间用 av_gettime_relative 的微秒.
+	static int64_t now();
+
+	void record(int stage, int64_t arg, int64_t begin, int64_t end);
+
+	// 导出成 Chrome trace 的 JSON (chrome://tracing 或者 Perfetto 直接打开), 正在被覆盖的槽跳过.
+	std::string dump_json() const;
+
+private:
+	trace_ring();
+
+	struct slot
+	{
+		// 偶数表示写完了第 seq / 2 - 1 条, 奇数表示正在写.
+		boost::atomic<uint64_t> seq;
+		int64_t begin;
+		int64_t end;
+		int64_t arg;
+		uint32_t tid;
+		int stage;
+	};
+
+	static boost::atomic<bool> s_enabled;
+
+	boost::atomic<uint64_t> m_next;
+	boost::atomic<uint64_t> m_first;
+	slot m_slots[slot_count];
+};
+
+// 记录一个阶段从构造到析构的耗时, arg 一般是帧的时间戳.
+class trace_span : public boost::noncopyable
+{
+public:
+	trace_span(trace_stage stage, int64_t arg)
+		: m_stage(stage)
+		, m_arg(arg)
+		, m_begin(trace_ring::enabled() ? trace_ring::now() : -1)
+	{
+		LIBENCODER_PROBE(stage_begin, m_stage, m_arg);
+	}
+
+	~trace_span()
+	{
+		LIBENCODER_PROBE(stage_end, m_stage, m_arg);
+		if (m_begin >= 0)
+			trace_ring::instance().record(m_stage, m_arg, m_begin, trace_ring::now());
+	}
+
+private:
+	int m_stage;
+	int64_t m_arg;
+	int64_t m_begin;
+};
+
+}
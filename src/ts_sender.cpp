@@ -0,0 +1,391 @@
+﻿
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#endif
+
+#include <boost/bind.hpp>
+
+#include "ts_sender.hpp"
+
+namespace libencoder {
+
+static const char udp_scheme[] = "paced-udp://";
+static const char unix_scheme[] = "paced-unix://";
+
+// 发送比 PCR 晚这么多, 这样插值时后一个 PCR 一般已经写出来了.
+static const int64_t pace_delay_us = 100000;
+// 到点前这么多以内的数据报并到同一批里发.
+static const int64_t batch_window_us = 1000;
+// 落后或者超前太多 (编码器卡住, 时钟跳变) 时不再追, 重新对时.
+static const int64_t max_late_us = 500000;
+static const int64_t max_early_us = 2000000;
+// PCR 倒退或者一下子跳过这么多算作跳变.
+static const int64_t max_pcr_gap_us = 1000000;
+
+static int64_t now_us()
+{
+	return boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef _WIN32
+typedef SOCKET native_socket;
+static void close_socket(intptr_t s) { closesocket(static_cast<SOCKET>(s)); }
+#else
+typedef int native_socket;
+static void close_socket(intptr_t s) { ::close(static_cast<int>(s)); }
+#endif
+static const intptr_t invalid_socket = static_cast<intptr_t>(static_cast<native_socket>(-1));
+
+bool ts_sender::is_url(const std::string& url)
+{
+	return url.compare(0, sizeof(udp_scheme) - 1, udp_scheme) == 0
+		|| url.compare(0, sizeof(unix_scheme) - 1, unix_scheme) == 0;
+}
+
+ts_sender::ts_sender(const std::string& url)
+	: m_socket(invalid_socket)
+	, m_offset(0)
+	, m_epoch(0)
+	, m_last_pcr(-1)
+	, m_rate(0)
+	, m_slots(slot_count)
+	, m_head(0)
+	, m_tail(0)
+	, m_closing(false)
+	, m_datagrams_sent(0)
+	, m_batches_sent(0)
+	, m_send_errors(0)
+{
+	if (url.compare(0, sizeof(udp_scheme) - 1, udp_scheme) == 0)
+		open_udp(url.substr(sizeof(udp_scheme) - 1));
+	else if (url.compare(0, sizeof(unix_scheme) - 1, unix_scheme) == 0)
+		open_unix(url.substr(sizeof(unix_scheme) - 1));
+	else
+		throw std::runtime_error("not a paced output url: " + url);
+
+	m_pending.reserve(datagram_size);
+	m_thread = boost::thread(boost::bind(&ts_sender::send_thread, this));
+}
+
+ts_sender::~ts_sender()
+{
+	close();
+	if (m_socket != invalid_socket)
+		close_socket(m_socket);
+}
+
+void ts_sender::open_udp(const std::string& address)
+{
+	// host:port, IPv6 地址写在方括号里: [::1]:5000.
+	std::string host, port;
+	std::string::size_type colon = address.rfind(':');
+	if (colon == std::string::npos || colon + 1 == address.size())
+		throw std::runtime_error("paced-udp needs host:port: " + address);
+	host = address.substr(0, colon);
+	port = address.substr(colon + 1);
+	if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr(1, host.size() - 2);
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	addrinfo* result = NULL;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result)
+		throw std::runtime_error("paced-udp: cannot resolve " + address);
+
+	for (addrinfo* ai = result; ai; ai = ai->ai_next)
+	{
+		native_socket s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (static_cast<intptr_t>(s) == invalid_socket)
+			continue;
+		// connect 之后不用每次都带地址, sendmmsg 也更省事.
+		if (connect(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0)
+		{
+			m_socket = static_cast<intptr_t>(s);
+			break;
+		}
+		close_socket(static_cast<intptr_t>(s));
+	}
+	freeaddrinfo(result);
+
+	if (m_socket == invalid_socket)
+		throw std::runtime_error("paced-udp: cannot connect to " + address);
+
+	// 发送缓冲开大一点, 一批数据报不会因为缓冲满而丢.
+	int buffer = 1024 * 1024;
+	setsockopt(static_cast<native_socket>(m_socket), SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&buffer), sizeof(buffer));
+}
+
+void ts_sender::open_unix(const std::string& path)
+{
+#ifdef _WIN32
+	throw std::runtime_error("paced-unix is not supported on this platform: " + path);
+#else
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("paced-unix: bad socket path: " + path);
+	memcpy(addr.sun_path, path.c_str(), path.size());
+
+	int s = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (s < 0)
+		throw std::runtime_error("paced-unix: cannot create socket");
+	if (connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		::close(s);
+		throw std::runtime_error("paced-unix: cannot connect to " + path);
+	}
+	m_socket = s;
+#endif
+}
+
+int ts_sender::avio_write(void* opaque, uint8_t* buf, int size)
+{
+	static_cast<ts_sender*>(opaque)->write(buf, size);
+	return size;
+}
+
+void ts_sender::write(const uint8_t* data, int size)
+{
+	while (size > 0)
+	{
+		int n = std::min<int>(size, datagram_size - static_cast<int>(m_pending.size()));
+		std::size_t before = m_pending.size();
+		m_pending.insert(m_pending.end(), data, data + n);
+		data += n;
+		size -= n;
+
+		// 每凑满一个 TS 包看一次 PCR.
+		for (std::size_t p = before / ts_packet_size * ts_packet_size; p + ts_packet_size <= m_pending.size(); p += ts_packet_size)
+			scan_packet(&m_pending[p]);
+
+		if (m_pending.size() == static_cast<std::size_t>(datagram_size))
+			push_datagram();
+	}
+}
+
+void ts_sender::scan_packet(const uint8_t* p)
+{
+	// 有 adaptation field, 长度够, 并且 PCR_flag 置位.
+	if (p[0] != 0x47 || !(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+		return;
+
+	int64_t base = (static_cast<int64_t>(p[6]) << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+	int64_t ext = ((p[10] & 1) << 8) | p[11];
+	int64_t pcr = (base * 300 + ext) / 27;
+
+	if (m_last_pcr >= 0 && (pcr < m_last_pcr || pcr - m_last_pcr > max_pcr_gap_us))
+		m_epoch++;
+	m_last_pcr = pcr;
+
+	int64_t offset = m_offset + static_cast<int64_t>(p - &m_pending[0]);
+	pcr_anchor a = { offset, pcr, m_epoch };
+
+	boost::mutex::scoped_lock l(m_mutex);
+	m_anchors.push_back(a);
+}
+
+void ts_sender::push_datagram()
+{
+	int size = static_cast<int>(m_pending.size());
+	m_offset += size;
+
+	boost::mutex::scoped_lock l(m_mutex);
+	while (m_tail - m_head >= static_cast<uint64_t>(slot_count))
+		m_cond.wait(l);
+
+	// 槽只由发送线程在发完之后释放, 这里写的时候没有人读.
+	datagram& d = m_slots[m_tail % slot_count];
+	memcpy(d.data, &m_pending[0], size);
+	d.size = size;
+	d.offset = m_offset;
+	d.queued = now_us();
+	m_tail++;
+	m_pending.clear();
+	m_cond.notify_all();
+}
+
+void ts_sender::close()
+{
+	if (!m_thread.joinable())
+		return;
+
+	if (!m_pending.empty())
+		push_datagram();
+
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		m_closing = true;
+		m_cond.notify_all();
+	}
+	m_thread.join();
+}
+
+ts_sender::time_result ts_sender::datagram_time(int64_t offset, int64_t& time, int& epoch)
+{
+	// 用不到的旧 PCR 扔掉, 保留数据报之前的最后一个.
+	while (m_anchors.size() >= 2 && m_anchors[1].offset <= offset)
+		m_anchors.pop_front();
+	if (m_anchors.empty() || m_anchors[0].offset > offset)
+		return time_none;
+
+	const pcr_anchor& a = m_anchors[0];
+	epoch = a.epoch;
+	time = a.time;
+	if (m_anchors.size() >= 2 && m_anchors[1].epoch == a.epoch && m_anchors[1].time > a.time)
+	{
+		// 两个 PCR 之间按字节位置均匀摊开.
+		const pcr_anchor& b = m_anchors[1];
+		m_rate = static_cast<double>(b.offset - a.offset) / (b.time - a.time);
+		time += (b.time - a.time) * (offset - a.offset) / (b.offset - a.offset);
+	}
+	else if (m_rate > 0)
+	{
+		// 后一个 PCR 还没写出来, 按之前的码率往后推.
+		time += static_cast<int64_t>((offset - a.offset) / m_rate);
+	}
+	else
+	{
+		// 流刚开始, 不知道码率, 不等下一个 PCR 的话第一帧会一起发出去.
+		return time_pending;
+	}
+	return time_ok;
+}
+
+void ts_sender::send_thread()
+{
+	bool based = false;
+	int base_epoch = 0;
+	int64_t base_wall = 0;
+	int64_t base_time = 0;
+
+	const datagram* batch[max_batch];
+
+	boost::mutex::scoped_lock l(m_mutex);
+	for (;;)
+	{
+		while (m_head == m_tail && !m_closing)
+			m_cond.wait(l);
+		if (m_head == m_tail)
+			break;
+
+		// 找出到点的一批.
+		int count = 0;
+		int64_t now = now_us();
+		int64_t wait_until = -1;
+		for (uint64_t i = m_head; i < m_tail && count < max_batch; i++)
+		{
+			const datagram& d = m_slots[i % slot_count];
+
+			int64_t time;
+			int epoch;
+			int64_t deadline = now;
+			time_result result = datagram_time(d.offset, time, epoch);
+			if (result == time_pending)
+			{
+				// 下一个 PCR 一直不来时, 最多等到发送延迟用完.
+				deadline = d.queued + pace_delay_us;
+			}
+			else if (result == time_ok)
+			{
+				if (!based || epoch != base_epoch)
+				{
+					based = true;
+					base_epoch = epoch;
+					base_wall = now + pace_delay_us;
+					base_time = time;
+				}
+				deadline = base_wall + (time - base_time);
+				if (deadline < now - max_late_us || deadline > now + max_early_us)
+				{
+					base_wall = now;
+					base_time = time;
+					deadline = now;
+				}
+			}
+
+			// 关闭时剩下的也照样按时发, 不在最后突发.
+			if (deadline > now + batch_window_us)
+			{
+				if (count == 0)
+					wait_until = deadline;
+				break;
+			}
+			batch[count++] = &d;
+		}
+
+		if (count == 0)
+		{
+			// 等到点; 新的数据报 (可能带着下一个 PCR) 进来或者关闭时重新算.
+			m_cond.wait_for(l, boost::chrono::microseconds(wait_until - now));
+			continue;
+		}
+
+		l.unlock();
+		send_batch(batch, count);
+		l.lock();
+
+		m_head += count;
+		m_cond.notify_all();
+	}
+}
+
+void ts_sender::send_batch(const datagram* const* batch, int count)
+{
+#if defined(__linux__)
+	mmsghdr msgs[max_batch];
+	iovec iov[max_batch];
+	memset(msgs, 0, sizeof(mmsghdr) * count);
+	for (int i = 0; i < count; i++)
+	{
+		iov[i].iov_base = const_cast<uint8_t*>(batch[i]->data);
+		iov[i].iov_len = batch[i]->size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int sent = 0;
+	while (sent < count)
+	{
+		int n = sendmmsg(static_cast<int>(m_socket), msgs + sent, count - sent, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			// 对端没在收 (ECONNREFUSED) 之类的错误, 丢掉这一个接着发.
+			++m_send_errors;
+			n = 1;
+		}
+		else
+		{
+			m_datagrams_sent += n;
+		}
+		sent += n;
+	}
+#else
+	for (int i = 0; i < count; i++)
+	{
+		if (send(static_cast<native_socket>(m_socket), reinterpret_cast<const char*>(batch[i]->data), batch[i]->size, 0) < 0)
+			++m_send_errors;
+		else
+			++m_datagrams_sent;
+	}
+#endif
+	++m_batches_sent;
+}
+
+}
@@ -0,0 +1,102 @@
+﻿
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace libencoder {
+
+// 把 MPEG-TS 按 7 个 TS 包一个数据报发到 UDP 地址或者 Unix 数据报套接字,
+// 按 PCR 把数据报均匀地摊开发送, 不会一帧的包一下子全涌出去.
+// 地址写成 "paced-udp://host:port" 或者 "paced-unix:///path/to/socket".
+//
+// write 在复用线程里调用, 只负责拼数据报和记下 PCR; 发送线程晚 pace_delay 之后,
+// 按相邻两个 PCR 之间的字节位置插值出每个数据报的发送时刻, 到点的数据报用 sendmmsg 一次发出.
+// 发送队列满了 write 会等, 复用线程慢下来, 自适应码率可以据此降码率.
+class ts_sender : public boost::noncopyable
+{
+public:
+	enum { ts_packet_size = 188, packets_per_datagram = 7, datagram_size = ts_packet_size * packets_per_datagram };
+	enum { slot_count = 1024, max_batch = 32 };
+
+	static bool is_url(const std::string& url);
+
+	// 打不开时抛出 std::runtime_error.
+	explicit ts_sender(const std::string& url);
+	~ts_sender();
+
+	void write(const uint8_t* data, int size);
+	// 把攒着的不满一个数据报的部分发出去, 等队列里的全部按时发完, 停掉发送线程.
+	void close();
+
+	// 给 avio_alloc_context 用的写回调, opaque 是 ts_sender.
+	static int avio_write(void* opaque, uint8_t* buf, int size);
+
+	int64_t datagrams_sent() const { return m_datagrams_sent; }
+	int64_t batches_sent() const { return m_batches_sent; }
+	int64_t send_errors() const { return m_send_errors; }
+
+private:
+	struct datagram
+	{
+		uint8_t data[datagram_size];
+		int size;
+		// 数据报末尾在整个流里的字节位置.
+		int64_t offset;
+		// 进队列的时刻 (微秒).
+		int64_t queued;
+	};
+
+	// 一个 PCR 所在 TS 包的字节位置和时刻 (微秒), PCR 跳变之后 epoch 加一, 发送时重新对时.
+	struct pcr_anchor
+	{
+		int64_t offset;
+		int64_t time;
+		int epoch;
+	};
+
+	void open_udp(const std::string& address);
+	void open_unix(const std::string& path);
+	// 检查刚拼好的一个 TS 包里有没有 PCR.
+	void scan_packet(const uint8_t* p);
+	void push_datagram();
+
+	void send_thread();
+	// 按 PCR 插值出数据报的时刻. 调用时持有 m_mutex.
+	enum time_result { time_none, time_pending, time_ok };
+	// 还没有 PCR 返回 time_none; 只有前一个 PCR, 也还不知道码率时返回 time_pending, 要等下一个 PCR.
+	time_result datagram_time(int64_t offset, int64_t& time, int& epoch);
+	void send_batch(const datagram* const* batch, int count);
+
+private:
+	intptr_t m_socket;
+
+	// 复用线程拼了一半的数据报, 以及流里已经写了的字节数.
+	std::vector<uint8_t> m_pending;
+	int64_t m_offset;
+	int m_epoch;
+	int64_t m_last_pcr;
+	// 发送线程最近算出的码率, 字节每微秒.
+	double m_rate;
+
+	boost::mutex m_mutex;
+	boost::condition_variable m_cond;
+	std::vector<datagram> m_slots;
+	uint64_t m_head;
+	uint64_t m_tail;
+	std::deque<pcr_anchor> m_anchors;
+	bool m_closing;
+	boost::thread m_thread;
+
+	boost::atomic<int64_t> m_datagrams_sent;
+	boost::atomic<int64_t> m_batches_sent;
+	boost::atomic<int64_t> m_send_errors;
+};
+
+}
@@ -7,10 +7,21 @@
 #endif
 
 #include <cstdlib>
+#include <cstddef>
+#include <cstring>
 #include <sstream>
+#include <stdexcept>
 #include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/tss.hpp>
 #include "libencoder_api.hpp"
 #include "encoder.hpp"
+#include "batch.hpp"
+#include "codec_pool.hpp"
+#include "log_ring.hpp"
+#include "trace.hpp"
+#include "shm_ring.hpp"
 
 
 extern "C"
@@ -34,6 +45,187 @@ extern "C"
 
 using namespace libencoder;
 
+// 调用方的 encoder_config 是否包含某个字段, 老版本的结构体比较短.
+#define CONFIG_HAS(config, field) \
+	(offsetof(encoder_config, field) + sizeof(((encoder_config*)0)->field) <= static_cast<std::size_t>((config)->struct_size))
+
+// create_encoder_ex 失败的原因, 每个线程一份.
+static boost::thread_specific_ptr<std::string> last_error;
+
+static void set_last_error(const std::string& error)
+{
+	if (!last_error.get())
+		last_error.reset(new std::string);
+	*last_error = error;
+}
+
+static boost::once_flag ffmpeg_once = BOOST_ONCE_INIT;
+static boost::once_flag network_once = BOOST_ONCE_INIT;
+static boost::atomic<bool> network_started(false);
+
+static void init_ffmpeg()
+{
+	av_register_all();
+	avcodec_register_all();
+	install_log_callback();
+#ifdef WIN32
+	auto user32_model =  GetModuleHandleW(L"user32");
+	auto addr = GetProcAddress(user32_model, "SetProcessDPIAware");
+
+	if (addr)
+		reinterpret_cast<void (WINAPI *) ()>(addr)();
+#endif
+}
+
+static void init_network()
+{
+	avformat_network_init();
+	network_started = true;
+}
+
+namespace {
+
+// 进程退出时收尾, 只有真的初始化过网络才需要.
+struct network_cleanup
+{
+	~network_cleanup()
+	{
+		if (network_started)
+			avformat_network_deinit();
+	}
+} network_cleanup_at_exit;
+
+}
+
+// 第一次用到 FFmpeg 时才注册编解码器, 只有输出到网络地址时才初始化网络.
+static void ensure_ffmpeg_init(const char* url)
+{
+	boost::call_once(ffmpeg_once, &init_ffmpeg);
+
+	if (url && strstr(url, "://") && strncmp(url, "file:", 5) != 0)
+		boost::call_once(network_once, &init_network);
+}
+
+// 按 profile, 结构体字段, options 字符串的顺序填写 encoder_options, 出错抛出 std::invalid_argument.
+static void load_options(const encoder_config* config, encoder_options& options)
+{
+	if (CONFIG_HAS(config, priority) && config->priority > 0)
+		options.priority = config->priority;
+	if (CONFIG_HAS(config, cpu_set) && config->cpu_set && !options.cpus.parse(config->cpu_set))
+		throw std::invalid_argument(std::string("bad cpu_set: ") + config->cpu_set);
+	if (CONFIG_HAS(config, latency_mode))
+		options.low_latency = config->latency_mode == ENCODER_LATENCY_LOW;
+
+	if (!CONFIG_HAS(config, options))
+		return;
+
+	std::vector<std::pair<std::string, std::string> > kv;
+	if (config->options)
+		kv = split_options(config->options);
+
+	std::string profile = config->profile ? config->profile : "";
+	for (std::size_t i = 0; i < kv.size(); i++)
+	{
+		if (kv[i].first == "profile")
+			profile = kv[i].second;
+	}
+	if (!profile.empty())
+		apply_profile(options, profile, config->fps);
+
+	if (config->rc_mode < ENCODER_RC_DEFAULT || config->rc_mode > ENCODER_RC_CRF)
+		throw std::invalid_argument("unknown rc_mode");
+	if (config->rc_mode != ENCODER_RC_DEFAULT)
+		options.rc_mode = static_cast<rate_control_mode>(config->rc_mode);
+	if (config->bitrate_kbps)
+		options.bitrate = config->bitrate_kbps;
+	if (config->max_bitrate_kbps)
+		options.max_bitrate = config->max_bitrate_kbps;
+	if (config->vbv_buffer_kbits)
+		options.vbv_buffer = config->vbv_buffer_kbits;
+	if (config->crf >= 0)
+		options.crf = config->crf;
+	if (config->gop)
+		options.gop = config->gop;
+	if (config->bframes >= 0)
+		options.bframes = config->bframes;
+	if (config->lookahead >= 0)
+		options.lookahead = config->lookahead;
+	if (config->threads)
+		options.threads = config->threads;
+	if (config->preset)
+		options.preset = config->preset;
+	if (config->tune)
+		options.tune = config->tune;
+	if (config->h264_profile)
+		options.profile = config->h264_profile;
+	if (config->audio_bitrate_kbps)
+		options.audio_bitrate = config->audio_bitrate_kbps;
+	if (config->codec_options)
+	{
+		std::vector<std::pair<std::string, std::string> > codec_options = split_options(config->codec_options);
+		options.codec_options.insert(options.codec_options.end(), codec_options.begin(), codec_options.end());
+	}
+	if (CONFIG_HAS(config, scale_filter) && config->scale_filter && !parse_scale_filter(config->scale_filter, options.scale_filter))
+		throw std::invalid_argument(std::string("unknown scale_filter: ") + config->scale_filter);
+	if (CONFIG_HAS(config, mp4_fragment_ms) && config->mp4_fragment_ms)
+		options.fragment_ms = config->mp4_fragment_ms;
+	if (CONFIG_HAS(config, rotate_template))
+	{
+		if (config->rotate_size_mb)
+			options.rotate_size_mb = config->rotate_size_mb;
+		if (config->rotate_seconds)
+			options.rotate_seconds = config->rotate_seconds;
+		if (config->rotate_template)
+			options.rotate_template = config->rotate_template;
+	}
+	if (CONFIG_HAS(config, roi_auto) && config->roi_auto)
+		options.roi_auto = true;
+	if (CONFIG_HAS(config, adaptive_max_kbps))
+	{
+		if (config->adaptive_min_kbps)
+			options.adaptive_min_bitrate = config->adaptive_min_kbps;
+		if (config->adaptive_max_kbps)
+			options.adaptive_max_bitrate = config->adaptive_max_kbps;
+	}
+
+	for (std::size_t i = 0; i < kv.size(); i++)
+	{
+		if (kv[i].first != "profile")
+			apply_option(options, kv[i].first, kv[i].second);
+	}
+}
+
+static void check_config(const encoder_config* config)
+{
+	if (!config || !config->outputfilename || !CONFIG_HAS(config, clip_right))
+		throw std::invalid_argument("config is NULL, has no outputfilename or was not set up by encoder_config_init");
+}
+
+// 检查并创建编码器, 出错抛出异常. deferred 为 true 时只检查参数, 不打开输出和编码器.
+static encoder* make_encoder(const encoder_config* config, bool deferred = false)
+{
+	check_config(config);
+	ensure_ffmpeg_init(config->outputfilename);
+
+	rect clip_rect;
+	clip_rect.top = config->clip_top;
+	clip_rect.bottom = config->clip_bottom;
+	clip_rect.left = config->clip_left;
+	clip_rect.right = config->clip_right;
+
+	encoder_options options;
+	load_options(config, options);
+	validate_options(options, config->fps, config->video_width, config->video_height);
+
+	return new encoder(config->outputfilename, config->audio_channel, config->audio_sample_rate,
+		config->fps, config->video_width, config->video_height, config->keep_ratio, clip_rect, options, deferred);
+}
+
+static void notify_ready(encoder_ready_callback callback, encoder* enc, void* user, bool ok)
+{
+	callback(reinterpret_cast<encoder_t*>(enc), ok ? ENCODER_STATE_READY : ENCODER_STATE_FAILED, user);
+}
+
 extern "C" {
 
 ENCODER_API encoder_t* create_encoder(const char* outputfilename, int audio_channel, int audio_sample_rate, int fps, int video_width, int video_height, bool keep_ratio, int clip_top, int clip_bottom, int clip_left, int clip_right)
@@ -50,9 +242,226 @@ ENCODER_API encoder_t* create_encoder(const char* outputfilename, int audio_chan
 	ss << "clip size: { top: " << clip_rect.top << ", bottom: " << clip_rect.bottom << "left :" << clip_rect.left << "right; " << clip_rect.right << "};";
 	OutputDebugStringA(ss.str().c_str());
 #endif
+	ensure_ffmpeg_init(outputfilename);
 	return reinterpret_cast<encoder_t*>(new encoder(outputfilename, audio_channel, audio_sample_rate, fps, video_width, video_height, keep_ratio, clip_rect));
 }
 
+ENCODER_API void encoder_config_init(encoder_config* config)
+{
+	memset(config, 0, sizeof(encoder_config));
+	config->struct_size = sizeof(encoder_config);
+	config->audio_channel = 2;
+	config->audio_sample_rate = 48000;
+	config->fps = 15;
+	config->video_width = 1280;
+	config->video_height = 720;
+	config->keep_ratio = true;
+	config->priority = scheduler::default_priority;
+	config->crf = -1;
+	config->bframes = -1;
+	config->lookahead = -1;
+}
+
+ENCODER_API encoder_t* create_encoder_ex(const encoder_config* config)
+{
+	set_last_error("");
+
+	try
+	{
+		return reinterpret_cast<encoder_t*>(make_encoder(config));
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return NULL;
+	}
+}
+
+ENCODER_API const char* encoder_last_error()
+{
+	return last_error.get() ? last_error->c_str() : "";
+}
+
+ENCODER_API encoder_t* create_encoder_async(const encoder_config* config, encoder_ready_callback callback, void* user)
+{
+	set_last_error("");
+
+	try
+	{
+		encoder* enc = make_encoder(config, true);
+		boost::function<void(bool)> done;
+		if (callback)
+			done = boost::bind(&notify_ready, callback, enc, user, _1);
+		enc->start_async(done);
+		return reinterpret_cast<encoder_t*>(enc);
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return NULL;
+	}
+}
+
+ENCODER_API int encoder_wait_ready(encoder_t* _encoder, int timeout_ms)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	encoder::start_state state = _this->wait_started(timeout_ms);
+	if (state == encoder::state_failed)
+		set_last_error(_this->start_error());
+	return state;
+}
+
+ENCODER_API int encoder_prewarm(const encoder_config* config, int count)
+{
+	set_last_error("");
+
+	try
+	{
+		check_config(config);
+		ensure_ffmpeg_init(config->outputfilename);
+
+		encoder_options options;
+		load_options(config, options);
+		validate_options(options, config->fps, config->video_width, config->video_height);
+
+		// 线程数和会话创建时一样由调度器决定, 这里按当前的负载估一个.
+		video_config vc = encoder::make_video_config(config->fps, config->video_width, config->video_height, options);
+		if (vc.threads <= 0)
+		{
+			int session = scheduler::instance().register_session(options.priority, options.cpus);
+			vc.threads = scheduler::instance().session_threads(session);
+			scheduler::instance().unregister_session(session);
+		}
+
+		bool global_header = ffmpeg_encoder::format_needs_global_header(encoder::output_format(config->outputfilename));
+		codec_pool::instance().prewarm(vc, global_header, options.threads <= 0, options.cpus, count);
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return -1;
+	}
+}
+
+ENCODER_API void encoder_batch_input_init(encoder_batch_input* input)
+{
+	memset(input, 0, sizeof(encoder_batch_input));
+	input->struct_size = sizeof(encoder_batch_input);
+	input->raw_fps_den = 1;
+}
+
+ENCODER_API int encoder_batch_encode(const encoder_config* config, const encoder_batch_input* input, encoder_batch_result* result)
+{
+	set_last_error("");
+
+	try
+	{
+		if (!config || !input || !input->video_path || input->struct_size < static_cast<int>(offsetof(encoder_batch_input, parallel)))
+			throw std::invalid_argument("batch input is NULL, has no video_path or was not set up by encoder_batch_input_init");
+
+		batch_input in;
+		in.video_path = input->video_path;
+		in.format = static_cast<batch_video_format>(input->video_format);
+		in.width = input->raw_width;
+		in.height = input->raw_height;
+		in.fps_num = input->raw_fps_num;
+		in.fps_den = input->raw_fps_den;
+		if (input->audio_path)
+			in.audio_path = input->audio_path;
+		if (input->struct_size >= static_cast<int>(sizeof(encoder_batch_input)))
+		{
+			in.parallel = input->parallel != 0;
+			in.chunk_gops = input->chunk_gops;
+		}
+
+		ensure_ffmpeg_init(NULL);
+		batch_runner runner(in);
+		const batch_probe& probe = runner.probe();
+
+		// 没有指定的输出参数跟输入一致.
+		encoder_config cfg = encoder_config();
+		memcpy(&cfg, config, std::min<std::size_t>(sizeof(cfg), config->struct_size));
+		cfg.struct_size = std::min<int>(sizeof(cfg), config->struct_size);
+		if (cfg.video_width <= 0 || cfg.video_height <= 0)
+		{
+			cfg.video_width = probe.width;
+			cfg.video_height = probe.height;
+		}
+		if (cfg.fps <= 0)
+			cfg.fps = static_cast<int>((probe.fps_num + probe.fps_den / 2) / probe.fps_den);
+		if (probe.sample_rate > 0)
+			cfg.audio_sample_rate = probe.sample_rate;
+
+		boost::scoped_ptr<encoder> enc(make_encoder(&cfg));
+		batch_result r = runner.run(*enc, cfg.video_width, cfg.video_height, cfg.fps);
+		enc.reset();
+
+		if (result)
+		{
+			result->video_frames = r.video_frames;
+			result->audio_samples = r.audio_samples;
+			result->media_seconds = r.media_seconds;
+			result->elapsed_seconds = r.elapsed_seconds;
+			result->fps = r.elapsed_seconds > 0 ? r.video_frames / r.elapsed_seconds : 0;
+			result->speed = r.elapsed_seconds > 0 ? r.media_seconds / r.elapsed_seconds : 0;
+			result->chunks = r.chunks;
+			result->workers = r.workers;
+		}
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return -1;
+	}
+}
+
+ENCODER_API void encoder_scheduler_setup(int core_budget, int expected_sessions)
+{
+	scheduler::instance().configure(core_budget, expected_sessions);
+}
+
+ENCODER_API void encoder_set_log_level(int level)
+{
+	set_log_level(level);
+	install_log_callback();
+}
+
+ENCODER_API void encoder_set_log_sink(encoder_log_sink sink, void* user)
+{
+	set_log_sink(sink, user);
+	install_log_callback();
+}
+
+// 截断拷贝并以 0 结尾, 返回完整文本的长度.
+static int copy_text(const std::string& text, char* buffer, int size)
+{
+	if (buffer && size > 0)
+	{
+		int length = std::min<int>(size - 1, static_cast<int>(text.size()));
+		memcpy(buffer, text.data(), length);
+		buffer[length] = 0;
+	}
+	return static_cast<int>(text.size());
+}
+
+ENCODER_API int encoder_log_dump(char* buffer, int size)
+{
+	return copy_text(log_ring::instance().dump(), buffer, size);
+}
+
+ENCODER_API void encoder_trace_enable(int enable)
+{
+	trace_ring::enable(enable != 0);
+}
+
+ENCODER_API int encoder_trace_dump(char* buffer, int size)
+{
+	return copy_text(trace_ring::instance().dump_json(), buffer, size);
+}
+
 ENCODER_API void encoder_feed_audio(encoder_t* _encoder, uint8_t* data, long size, int64_t timestamp)
 {
 	encoder* _this = reinterpret_cast<encoder*>(_encoder);
@@ -67,6 +476,73 @@ ENCODER_API void encoder_feed_video_frame(encoder_t* _encoder, uint8_t* data, in
 	_this->do_video_frame(data, width, height, linesize, timestamp, flip_picture);
 }
 
+// 检查并转换成 video_input, 不合法时返回 false.
+static bool to_video_input(const encoder_video_frame* frame, video_input& input)
+{
+	if (!frame || frame->width <= 0 || frame->height <= 0 || !frame->planes[0])
+		return false;
+
+	input.width = frame->width;
+	input.height = frame->height;
+	input.timestamp = frame->timestamp;
+	input.flip = frame->flip != 0;
+	for (int i = 0; i < 3; i++)
+	{
+		input.planes[i] = frame->planes[i];
+		input.linesize[i] = frame->linesize[i];
+	}
+
+	switch (frame->format)
+	{
+	case ENCODER_PIXEL_BGR0:
+		input.format = video_input::bgr0;
+		return frame->linesize[0] >= frame->width * 4;
+	case ENCODER_PIXEL_I420:
+		input.format = video_input::i420;
+		return !frame->flip && frame->planes[1] && frame->planes[2] && frame->linesize[0] >= frame->width
+			&& frame->linesize[1] >= (frame->width + 1) / 2 && frame->linesize[2] >= (frame->width + 1) / 2;
+	default:
+		return false;
+	}
+}
+
+ENCODER_API int encoder_feed_video(encoder_t* _encoder, const encoder_video_frame* frame)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	video_input input;
+	if (!to_video_input(frame, input))
+		return ENCODER_FEED_ERROR;
+	return _this->do_video_input(input) ? ENCODER_FEED_OK : ENCODER_FEED_DROPPED;
+}
+
+static void notify_fed(encoder_feed_callback callback, void* user, bool ok)
+{
+	if (callback)
+		callback(ok ? ENCODER_FEED_OK : ENCODER_FEED_DROPPED, user);
+}
+
+ENCODER_API int encoder_feed_video_async(encoder_t* _encoder, const encoder_video_frame* frame, encoder_feed_callback callback, void* user)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	video_input input;
+	if (!to_video_input(frame, input))
+		return ENCODER_FEED_ERROR;
+	if (!_this->post_video_input(input, boost::bind(&notify_fed, callback, user, _1)))
+		return ENCODER_FEED_BUSY;
+	return ENCODER_FEED_OK;
+}
+
+ENCODER_API int encoder_feed_audio_frame(encoder_t* _encoder, const encoder_audio_frame* frame)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	if (!frame || !frame->data || frame->size <= 0)
+		return ENCODER_FEED_ERROR;
+	return _this->do_audio_frame(const_cast<uint8_t*>(frame->data), frame->size, frame->timestamp) ? ENCODER_FEED_OK : ENCODER_FEED_DROPPED;
+}
+
 ENCODER_API void encoder_flush_frames(encoder_t* _encoder)
 {
 	encoder* _this = reinterpret_cast<encoder*>(_encoder);
@@ -74,54 +550,306 @@ ENCODER_API void encoder_flush_frames(encoder_t* _encoder)
 	_this->flush_and_write_tailer();
 }
 
-ENCODER_API void destory_encoder(encoder_t* _encoder)
+ENCODER_API void encoder_pause(encoder_t* _encoder)
 {
-	delete reinterpret_cast<encoder*>(_encoder);
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	_this->pause();
 }
 
+ENCODER_API void encoder_resume(encoder_t* _encoder)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	_this->resume();
 }
 
-namespace {
+static std::vector<roi_rect> to_roi(const encoder_roi* rois, int count)
+{
+	std::vector<roi_rect> result;
+	for (int i = 0; rois && i < count; i++)
+	{
+		roi_rect r = { rois[i].left, rois[i].top, rois[i].right, rois[i].bottom, rois[i].qoffset };
+		result.push_back(r);
+	}
+	return result;
+}
 
-class ffmpeg_initor
+ENCODER_API void encoder_set_roi(encoder_t* _encoder, const encoder_roi* rois, int count)
 {
-public:
-	ffmpeg_initor();
-	~ffmpeg_initor();
-};
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
 
-#ifdef WIN32
-static void avlog_out(void*, int, const char* fmt, va_list v)
+	_this->set_roi(to_roi(rois, count));
+}
+
+ENCODER_API void encoder_set_frame_roi(encoder_t* _encoder, const encoder_roi* rois, int count)
 {
-	char buf[4096];
-	vsprintf(buf, fmt, v);
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
 
-	OutputDebugStringA(buf);
-	puts(buf);
+	_this->set_frame_roi(to_roi(rois, count));
 }
-#endif
 
-ffmpeg_initor::ffmpeg_initor()
+ENCODER_API int encoder_overlay_set_image(encoder_t* _encoder, int id, const uint8_t* bgra, int width, int height, int stride)
 {
-	av_register_all();
-	avcodec_register_all();
-	avformat_network_init();
-	av_log_set_level(AV_LOG_DEBUG);
-#ifdef WIN32
-	av_log_set_callback(avlog_out);
-	auto user32_model =  GetModuleHandleW(L"user32");
-	auto addr = GetProcAddress(user32_model, "SetProcessDPIAware");
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
 
-	if (addr)
-		reinterpret_cast<void (WINAPI *) ()>(addr)();
-#endif
+	return _this->overlay().set_image(id, bgra, stride, width, height) ? 0 : -1;
+}
+
+ENCODER_API void encoder_overlay_move(encoder_t* _encoder, int id, int x, int y, int alpha)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	_this->overlay().move(id, x, y, alpha);
 }
 
-ffmpeg_initor::~ffmpeg_initor()
+ENCODER_API void encoder_overlay_remove(encoder_t* _encoder, int id)
 {
-	avformat_network_deinit();
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	_this->overlay().remove(id);
 }
 
-ffmpeg_initor initor;
+ENCODER_API int encoder_pip_set_layout(encoder_t* _encoder, int id, const encoder_pip_layout* layout)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	if (!layout)
+		return -1;
+	pip_layout l = { layout->x, layout->y, layout->width, layout->height,
+		layout->crop_left, layout->crop_top, layout->crop_right, layout->crop_bottom };
+	return _this->pip().set_layout(id, l) ? 0 : -1;
+}
+
+ENCODER_API void encoder_pip_remove(encoder_t* _encoder, int id)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	_this->pip().remove(id);
+}
+
+ENCODER_API int encoder_pip_feed(encoder_t* _encoder, int id, const encoder_video_frame* frame)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	video_input input;
+	if (!to_video_input(frame, input))
+		return ENCODER_FEED_ERROR;
+	return _this->pip().feed(id, input) ? ENCODER_FEED_OK : ENCODER_FEED_ERROR;
+}
+
+ENCODER_API void encoder_get_stats(encoder_t* _encoder, encoder_stats* stats)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	_this->get_stats(*stats);
+}
+
+static void notify_preview(encoder_preview_callback callback, void* user, const encoder_preview& preview)
+{
+	callback(&preview, user);
+}
+
+ENCODER_API int encoder_set_preview(encoder_t* _encoder, int id, const encoder_preview_config* config, encoder_preview_callback callback, void* user)
+{
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	set_last_error("");
+
+	try
+	{
+		preview_config pc;
+		if (config)
+		{
+			pc.format = config->format;
+			pc.width = config->width;
+			pc.height = config->height;
+			pc.interval_ms = std::max(0, config->interval_ms);
+			if (config->jpeg_quality > 0)
+				pc.jpeg_quality = config->jpeg_quality;
+		}
+		if (pc.format < ENCODER_PREVIEW_I420 || pc.format > ENCODER_PREVIEW_JPEG)
+			throw std::invalid_argument("unknown preview format");
+
+		preview_callback cb;
+		if (callback)
+			cb = boost::bind(&notify_preview, callback, user, _1);
+		_this->set_preview(id, pc, cb);
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return -1;
+	}
+}
+
+ENCODER_API encoder_shm_t* encoder_shm_create(const char* name, int slots, int slot_bytes)
+{
+	set_last_error("");
+
+	try
+	{
+		return reinterpret_cast<encoder_shm_t*>(shm_ring::create(name ? name : "", slots, slot_bytes));
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return NULL;
+	}
+}
+
+ENCODER_API encoder_shm_t* encoder_shm_open(const char* name)
+{
+	set_last_error("");
+
+	try
+	{
+		return reinterpret_cast<encoder_shm_t*>(shm_ring::open(name ? name : ""));
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return NULL;
+	}
+}
+
+ENCODER_API encoder_shm_t* encoder_shm_open_fd(int fd)
+{
+	set_last_error("");
+
+	try
+	{
+		return reinterpret_cast<encoder_shm_t*>(shm_ring::open_fd(fd));
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return NULL;
+	}
+}
+
+ENCODER_API int encoder_shm_fd(encoder_shm_t* shm)
+{
+	return reinterpret_cast<shm_ring*>(shm)->fd();
+}
+
+ENCODER_API void encoder_shm_destroy(encoder_shm_t* shm)
+{
+	delete reinterpret_cast<shm_ring*>(shm);
+}
+
+ENCODER_API uint8_t* encoder_shm_begin(encoder_shm_t* shm, int timeout_ms)
+{
+	return reinterpret_cast<shm_ring*>(shm)->begin_write(timeout_ms);
+}
+
+ENCODER_API int encoder_shm_slot_bytes(encoder_shm_t* shm)
+{
+	return reinterpret_cast<shm_ring*>(shm)->slot_bytes();
+}
+
+ENCODER_API void encoder_shm_commit(encoder_shm_t* shm, const encoder_shm_frame* frame)
+{
+	reinterpret_cast<shm_ring*>(shm)->commit(*frame);
+}
+
+ENCODER_API void encoder_shm_close(encoder_shm_t* shm)
+{
+	reinterpret_cast<shm_ring*>(shm)->close();
+}
+
+// 槽的描述来自另一个进程, 越界的一律不用.
+static bool check_shm_frame(const encoder_shm_frame& f, int slot_bytes)
+{
+	if (f.kind == ENCODER_SHM_AUDIO)
+		return f.size <= static_cast<uint32_t>(slot_bytes) && f.size % 4 == 0;
+	if (f.kind != ENCODER_SHM_VIDEO || f.width <= 0 || f.height <= 0 || f.width > 16384 || f.height > 16384
+		|| f.dirty_count < 0 || f.dirty_count > ENCODER_SHM_MAX_DIRTY)
+		return false;
+
+	int planes = f.format == ENCODER_SHM_BGR0 ? 1 : (f.format == ENCODER_SHM_I420 ? 3 : 0);
+	for (int p = 0; p < planes; p++)
+	{
+		int64_t width = f.format == ENCODER_SHM_BGR0 ? f.width * 4 : (p ? (f.width + 1) / 2 : f.width);
+		int64_t height = p ? (f.height + 1) / 2 : f.height;
+		if (f.linesize[p] < width || f.offset[p] + f.linesize[p] * height > slot_bytes)
+			return false;
+	}
+	return planes != 0;
+}
+
+ENCODER_API int encoder_shm_pump(encoder_shm_t* shm, encoder_t* _encoder, int timeout_ms)
+{
+	shm_ring* ring = reinterpret_cast<shm_ring*>(shm);
+	encoder* _this = reinterpret_cast<encoder*>(_encoder);
+
+	set_last_error("");
+
+	try
+	{
+		int ready = ring->wait_readable(timeout_ms);
+		for (int i = 0; i < ready; i++)
+		{
+			encoder_shm_frame f;
+			const uint8_t* slot = ring->front(f);
+			// 裁剪区域超出对方给的画面时, 裁剪会读到槽外面去.
+			if (!check_shm_frame(f, ring->slot_bytes())
+				|| (f.kind == ENCODER_SHM_VIDEO && f.format == ENCODER_SHM_BGR0 && !_this->clip_fits(f.width, f.height)))
+			{
+				ring->pop();
+				continue;
+			}
+
+			// 数据直接从共享内存里读, 不再拷一份.
+			uint8_t* data = const_cast<uint8_t*>(slot);
+			if (f.kind == ENCODER_SHM_AUDIO)
+			{
+				_this->do_audio_frame(data, f.size, f.timestamp);
+			}
+			else
+			{
+				const video_config& vc = _this->video_settings();
+				if (f.dirty_count > 0 && _this->options().roi_auto && !f.flip && f.width == vc.width && f.height == vc.height)
+				{
+					std::vector<roi_rect> rois;
+					for (int r = 0; r < f.dirty_count; r++)
+					{
+						roi_rect roi = { f.dirty[r][0], f.dirty[r][1], f.dirty[r][2], f.dirty[r][3], _this->options().roi_dirty_qoffset };
+						rois.push_back(roi);
+					}
+					_this->set_frame_roi(rois);
+				}
+
+				if (f.format == ENCODER_SHM_BGR0)
+				{
+					_this->do_video_frame(data + f.offset[0], f.width, f.height, f.linesize[0], f.timestamp, f.flip != 0);
+				}
+				else
+				{
+					const uint8_t* planes[3] = { data + f.offset[0], data + f.offset[1], data + f.offset[2] };
+					_this->do_yuv_frame(planes, f.linesize, f.width, f.height, f.timestamp);
+				}
+			}
+			ring->pop();
+		}
+		return ready;
+	}
+	catch (std::exception& e)
+	{
+		set_last_error(e.what());
+		return -1;
+	}
+}
+
+ENCODER_API int64_t encoder_latency_bucket_limit_us(int bucket)
+{
+	return latency_bucket_limit(bucket);
+}
+
+ENCODER_API void destory_encoder(encoder_t* _encoder)
+{
+	delete reinterpret_cast<encoder*>(_encoder);
+}
 
 }
@@ -0,0 +1,104 @@
+﻿
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <libencoder_api.hpp>
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] input.y4m|input.bgr0 output.mp4\n"
+		"  -a file.wav      16 bit PCM audio\n"
+		"  -s WxH           raw BGR0 input size\n"
+		"  -r num[/den]     raw BGR0 input frame rate\n"
+		"  -S WxH           output size (default: input size)\n"
+		"  -R fps           output frame rate (default: input rate)\n"
+		"  -p profile       archive, live or low-cpu\n"
+		"  -o key=val:...   encoder options, see encoder_config::options\n"
+		"  -j gops          encode GOP chunks in parallel, gops per chunk (0: auto)\n",
+		prog);
+}
+
+static bool parse_size(const char* str, int& w, int& h)
+{
+	return sscanf(str, "%dx%d", &w, &h) == 2 && w > 0 && h > 0;
+}
+
+int main(int argc, char** argv)
+{
+	encoder_config config;
+	encoder_config_init(&config);
+	// 输出尺寸和帧率默认跟输入一致.
+	config.video_width = 0;
+	config.video_height = 0;
+	config.fps = 0;
+
+	encoder_batch_input input;
+	encoder_batch_input_init(&input);
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+	{
+		const char* opt = argv[i];
+		if (i + 1 >= argc)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		const char* val = argv[++i];
+
+		bool ok = true;
+		if (!strcmp(opt, "-a"))
+			input.audio_path = val;
+		else if (!strcmp(opt, "-s"))
+			ok = parse_size(val, input.raw_width, input.raw_height);
+		else if (!strcmp(opt, "-r"))
+			ok = sscanf(val, "%d/%d", &input.raw_fps_num, &input.raw_fps_den) >= 1;
+		else if (!strcmp(opt, "-S"))
+			ok = parse_size(val, config.video_width, config.video_height);
+		else if (!strcmp(opt, "-R"))
+			ok = (config.fps = atoi(val)) > 0;
+		else if (!strcmp(opt, "-p"))
+			config.profile = val;
+		else if (!strcmp(opt, "-o"))
+			config.options = val;
+		else if (!strcmp(opt, "-j"))
+		{
+			input.parallel = 1;
+			ok = (input.chunk_gops = atoi(val)) >= 0;
+		}
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			fprintf(stderr, "bad option %s %s\n", opt, val);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - i != 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	input.video_path = argv[i];
+	config.outputfilename = argv[i + 1];
+
+	encoder_batch_result result;
+	if (encoder_batch_encode(&config, &input, &result) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", input.video_path, encoder_last_error());
+		return 1;
+	}
+
+	printf("%lld frames, %.2f s of media in %.2f s: %.1f fps, %.2fx real time\n",
+		static_cast<long long>(result.video_frames), result.media_seconds, result.elapsed_seconds,
+		result.fps, result.speed);
+	if (result.chunks > 0)
+		printf("%d chunks on %d workers\n", result.chunks, result.workers);
+	return 0;
+}
@@ -0,0 +1,301 @@
+﻿
+// frame_scaler 快速路径的对照检查: BGR0 和 I420 在 1:1, 2:1, 4:1 下,
+// 噪声画面和逐像素的标量实现逐字节比较, 平滑画面和 swscale 比较误差.
+// 输出宽度 54 时 Y 行和色度平面都不是 SIMD 宽度的整数倍, 会走到标量收尾; 奇数宽度应当交给 swscale.
+// 通过返回 0, 失败返回 1.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C"
+{
+#include "libswscale/swscale.h"
+}
+
+#include "frame_scaler.hpp"
+
+using libencoder::frame_scaler;
+
+// 每行后面留的空白, 填固定值, 用来发现快速路径的越界写; swscale 本来就会按对齐写到行尾之后.
+static const int guard_size = 32;
+static const uint8_t guard_value = 0xCD;
+
+// 和平滑画面的 swscale 结果允许的误差: 两边的滤镜和色度位置不同, 只要求大体一致.
+static const int max_sws_diff = 4;
+static const double max_sws_mean = 1.0;
+
+enum source_kind { source_noise, source_smooth };
+
+// 一帧图像, bgr0 只用第一个平面.
+struct picture
+{
+	std::vector<uint8_t> data[3];
+	uint8_t* planes[3];
+	int linesize[3];
+	int width[3];
+	int height[3];
+	int count;
+
+	picture(bool bgr0, int w, int h)
+	{
+		count = bgr0 ? 1 : 3;
+		for (int p = 0; p < 3; p++)
+		{
+			width[p] = p ? (w + 1) / 2 : w;
+			height[p] = p ? (h + 1) / 2 : h;
+			int bytes = bgr0 ? width[p] * 4 : width[p];
+			linesize[p] = bytes + guard_size;
+			data[p].assign(p < count ? static_cast<std::size_t>(linesize[p]) * height[p] : 0, guard_value);
+			planes[p] = p < count ? &data[p][0] : NULL;
+		}
+	}
+
+	int row_bytes(int p) const { return count == 1 ? width[p] * 4 : width[p]; }
+
+	bool guards_intact() const
+	{
+		for (int p = 0; p < count; p++)
+		{
+			for (int y = 0; y < height[p]; y++)
+			{
+				const uint8_t* row = planes[p] + y * linesize[p];
+				for (int x = row_bytes(p); x < linesize[p]; x++)
+				{
+					if (row[x] != guard_value)
+						return false;
+				}
+			}
+		}
+		return true;
+	}
+};
+
+static uint32_t next_random(uint32_t& seed)
+{
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 24;
+}
+
+static void fill(picture& pic, source_kind kind)
+{
+	uint32_t seed = 12345;
+	for (int p = 0; p < pic.count; p++)
+	{
+		for (int y = 0; y < pic.height[p]; y++)
+		{
+			uint8_t* row = pic.planes[p] + y * pic.linesize[p];
+			for (int x = 0; x < pic.row_bytes(p); x++)
+			{
+				if (kind == source_noise)
+				{
+					row[x] = static_cast<uint8_t>(next_random(seed));
+					continue;
+				}
+				// 平滑画面: 每个分量是不同方向的渐变.
+				int c = pic.count == 1 ? x % 4 : p;
+				int px = pic.count == 1 ? x / 4 : x;
+				int w = pic.width[p];
+				int h = pic.height[p];
+				int value = c == 0 ? px * 255 / w : c == 1 ? y * 255 / h : c == 2 ? (px + y) * 255 / (w + h) : 0;
+				row[x] = static_cast<uint8_t>(value);
+			}
+		}
+	}
+}
+
+static int ref_y(int r, int g, int b)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static int ref_u(int r, int g, int b)
+{
+	return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+}
+
+static int ref_v(int r, int g, int b)
+{
+	return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+// 源图 factor x factor 方块的平均.
+static int box_average(const uint8_t* src, int stride, int step, int factor, int x, int y)
+{
+	int area = factor * factor;
+	int sum = 0;
+	for (int row = 0; row < factor; row++)
+	{
+		for (int col = 0; col < factor; col++)
+			sum += src[(y * factor + row) * stride + (x * factor + col) * step];
+	}
+	return (sum + area / 2) / area;
+}
+
+// 逐像素的参考实现: 先按方块缩小, 再按 2x2 平均出色度.
+static void reference(const picture& src, int factor, picture& dst)
+{
+	if (src.count == 3)
+	{
+		for (int p = 0; p < 3; p++)
+		{
+			for (int y = 0; y < dst.height[p]; y++)
+			{
+				for (int x = 0; x < dst.width[p]; x++)
+					dst.planes[p][y * dst.linesize[p] + x] = static_cast<uint8_t>(box_average(src.planes[p], src.linesize[p], 1, factor, x, y));
+			}
+		}
+		return;
+	}
+
+	for (int y = 0; y < dst.height[0]; y += 2)
+	{
+		for (int x = 0; x < dst.width[0]; x += 2)
+		{
+			int sum[3] = { 0, 0, 0 };
+			for (int i = 0; i < 4; i++)
+			{
+				int px = x + i % 2;
+				int py = y + i / 2;
+				int bgr[3];
+				for (int c = 0; c < 3; c++)
+				{
+					bgr[c] = box_average(src.planes[0] + c, src.linesize[0], 4, factor, px, py);
+					sum[c] += bgr[c];
+				}
+				dst.planes[0][py * dst.linesize[0] + px] = static_cast<uint8_t>(ref_y(bgr[2], bgr[1], bgr[0]));
+			}
+			int b = (sum[0] + 2) >> 2;
+			int g = (sum[1] + 2) >> 2;
+			int r = (sum[2] + 2) >> 2;
+			dst.planes[1][y / 2 * dst.linesize[1] + x / 2] = static_cast<uint8_t>(ref_u(r, g, b));
+			dst.planes[2][y / 2 * dst.linesize[2] + x / 2] = static_cast<uint8_t>(ref_v(r, g, b));
+		}
+	}
+}
+
+static bool run_scaler(frame_scaler& scaler, const picture& src, picture& dst)
+{
+	if (src.count == 1)
+	{
+		return scaler.scale_bgr0(src.planes[0], src.linesize[0], src.width[0], src.height[0],
+			dst.planes, dst.linesize, dst.width[0], dst.height[0]);
+	}
+	const uint8_t* planes[3] = { src.planes[0], src.planes[1], src.planes[2] };
+	return scaler.scale_yuv420(planes, src.linesize, src.width[0], src.height[0],
+		dst.planes, dst.linesize, dst.width[0], dst.height[0]);
+}
+
+static bool run_swscale(const picture& src, picture& dst)
+{
+	AVPixelFormat format = src.count == 1 ? AV_PIX_FMT_BGR0 : AV_PIX_FMT_YUV420P;
+	SwsContext* sws = sws_getContext(src.width[0], src.height[0], format, dst.width[0], dst.height[0],
+		AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+	if (!sws)
+		return false;
+	const uint8_t* planes[4] = { src.planes[0], src.planes[1], src.planes[2], NULL };
+	int linesize[4] = { src.linesize[0], src.linesize[1], src.linesize[2], 0 };
+	sws_scale(sws, planes, linesize, 0, src.height[0], dst.planes, dst.linesize);
+	sws_freeContext(sws);
+	return true;
+}
+
+// 三个平面的最大误差和平均误差.
+static void compare(const picture& a, const picture& b, int& max_diff, double& mean_diff)
+{
+	max_diff = 0;
+	int64_t total = 0;
+	int64_t samples = 0;
+	for (int p = 0; p < 3; p++)
+	{
+		for (int y = 0; y < a.height[p]; y++)
+		{
+			for (int x = 0; x < a.width[p]; x++)
+			{
+				int d = std::abs(a.planes[p][y * a.linesize[p] + x] - b.planes[p][y * b.linesize[p] + x]);
+				max_diff = std::max(max_diff, d);
+				total += d;
+				samples++;
+			}
+		}
+	}
+	mean_diff = samples ? static_cast<double>(total) / samples : 0;
+}
+
+static const char* path_name(frame_scaler::path p)
+{
+	switch (p)
+	{
+	case frame_scaler::path_identity: return "identity";
+	case frame_scaler::path_box2: return "box2";
+	case frame_scaler::path_box4: return "box4";
+	case frame_scaler::path_swscale: return "swscale";
+	default: return "none";
+	}
+}
+
+static bool check(bool bgr0, int factor, int dst_width, int dst_height)
+{
+	int width = dst_width * factor;
+	int height = dst_height * factor;
+	frame_scaler::path expected = dst_width % 2 || dst_height % 2 ? frame_scaler::path_swscale
+		: factor == 4 ? frame_scaler::path_box4 : factor == 2 ? frame_scaler::path_box2 : frame_scaler::path_identity;
+
+	frame_scaler scaler;
+	picture src(bgr0, width, height);
+	picture out(false, dst_width, dst_height);
+	picture ref(false, dst_width, dst_height);
+	bool ok = true;
+
+	// 噪声画面: 快速路径和参考实现逐字节一致.
+	int exact_diff = 0;
+	double mean_diff = 0;
+	fill(src, source_noise);
+	ok = run_scaler(scaler, src, out) && ok;
+	frame_scaler::path path = scaler.last_path();
+	bool fast = path != frame_scaler::path_swscale;
+	if (fast)
+	{
+		reference(src, factor, ref);
+		compare(out, ref, exact_diff, mean_diff);
+	}
+	bool guards = !fast || out.guards_intact();
+
+	// 平滑画面: 和 swscale 的结果大体一致.
+	int sws_diff = 0;
+	double sws_mean = 0;
+	fill(src, source_smooth);
+	ok = run_scaler(scaler, src, out) && ok;
+	ok = run_swscale(src, ref) && ok;
+	compare(out, ref, sws_diff, sws_mean);
+	guards = guards && (!fast || out.guards_intact());
+
+	printf("%s %dx%d -> %dx%d: %s, max diff %d against scalar, %d (mean %.2f) against swscale%s\n",
+		bgr0 ? "bgr0" : "i420", width, height, dst_width, dst_height, path_name(path),
+		exact_diff, sws_diff, sws_mean, guards ? "" : ", wrote past the row");
+
+	ok = ok && path == expected && exact_diff == 0 && guards && sws_diff <= max_sws_diff && sws_mean <= max_sws_mean;
+	if (!ok)
+		printf("  FAILED\n");
+	return ok;
+}
+
+int main()
+{
+	// 64 宽时都是整块的 SIMD, 54 宽时 Y 行剩 6 个, 色度 27 宽是奇数; 53 宽不能走快速路径.
+	static const int sizes[][2] = { { 64, 36 }, { 54, 30 }, { 53, 30 } };
+	static const int factors[] = { 1, 2, 4 };
+
+	bool ok = true;
+	for (int f = 0; f < 2; f++)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			for (int s = 0; s < 3; s++)
+				ok = check(f == 0, factors[i], sizes[s][0], sizes[s][1]) && ok;
+		}
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+﻿
+// paced-udp:// 和 paced-unix:// 输出的回环检查: 按帧一次性写入带 PCR 的 TS,
+// 在本机收下来, 检查数据报都是 7 个 TS 包, 并且是均匀发出的, 不是每帧一串.
+// 通过返回 0, 失败返回 1.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include "ts_sender.hpp"
+
+using libencoder::ts_sender;
+
+static const int bitrate = 8000000;
+static const int fps = 25;
+static const int frames = 50;
+
+static int64_t now_us()
+{
+	return boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 一个 TS 包, pcr 为真时带上 time_us 对应的 PCR.
+static void make_packet(uint8_t* p, bool pcr, int64_t time_us)
+{
+	memset(p, 0xff, ts_sender::ts_packet_size);
+	p[0] = 0x47;
+	p[1] = 0x01;
+	p[2] = 0x00;
+	if (!pcr)
+	{
+		p[3] = 0x10;
+		return;
+	}
+
+	int64_t value = time_us * 27;
+	int64_t base = value / 300;
+	int64_t ext = value % 300;
+	p[3] = 0x30;
+	p[4] = 7;
+	p[5] = 0x10;
+	p[6] = static_cast<uint8_t>(base >> 25);
+	p[7] = static_cast<uint8_t>(base >> 17);
+	p[8] = static_cast<uint8_t>(base >> 9);
+	p[9] = static_cast<uint8_t>(base >> 1);
+	p[10] = static_cast<uint8_t>(((base & 1) << 7) | 0x7e | (ext >> 8));
+	p[11] = static_cast<uint8_t>(ext);
+}
+
+struct received
+{
+	std::vector<int64_t> times;
+	std::vector<int> sizes;
+	int bad_sync;
+};
+
+// 用内核收到数据报的时间戳, 不受接收线程调度的影响.
+static void receive(int fd, received* r)
+{
+	uint8_t buffer[4096];
+	char control[256];
+	for (;;)
+	{
+		iovec iov = { buffer, sizeof(buffer) };
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		int n = static_cast<int>(recvmsg(fd, &msg, 0));
+		if (n <= 0)
+			break;
+		int64_t time = now_us();
+		for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+		{
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMP)
+			{
+				timeval tv;
+				memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+				time = tv.tv_sec * 1000000LL + tv.tv_usec;
+			}
+		}
+		r->times.push_back(time);
+		r->sizes.push_back(n);
+		for (int i = 0; i < n; i += ts_sender::ts_packet_size)
+		{
+			if (buffer[i] != 0x47)
+				r->bad_sync++;
+		}
+	}
+}
+
+static bool run(const std::string& url, int fd)
+{
+	// 收完最后一个数据报之后 500ms 没有新数据就结束.
+	struct timeval tv = { 0, 500000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	int buffer = 8 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+
+	received r;
+	r.bad_sync = 0;
+	boost::thread receiver(boost::bind(&receive, fd, &r));
+
+	int packets_per_frame = bitrate / 8 / fps / ts_sender::ts_packet_size;
+	int frame_datagrams = packets_per_frame / ts_sender::packets_per_datagram;
+	int64_t written = 0;
+	ts_sender* sender = NULL;
+	try
+	{
+		sender = new ts_sender(url);
+
+		// 每帧一次写完, 和复用器写出一帧的包一样是一串.
+		std::vector<uint8_t> frame(packets_per_frame * ts_sender::ts_packet_size);
+		int64_t start = now_us();
+		for (int f = 0; f < frames; f++)
+		{
+			int64_t due = start + f * 1000000LL / fps;
+			while (now_us() < due)
+				boost::this_thread::sleep_for(boost::chrono::microseconds(500));
+
+			for (int i = 0; i < packets_per_frame; i++)
+				make_packet(&frame[i * ts_sender::ts_packet_size], i == 0, 1000000 + f * 1000000LL / fps);
+			// 按 avio 的缓冲大小分几次写.
+			for (std::size_t off = 0; off < frame.size(); off += ts_sender::datagram_size)
+				sender->write(&frame[off], static_cast<int>(std::min<std::size_t>(ts_sender::datagram_size, frame.size() - off)));
+			written += frame.size();
+		}
+		sender->close();
+	}
+	catch (std::exception& e)
+	{
+		fprintf(stderr, "%s: %s\n", url.c_str(), e.what());
+		delete sender;
+		shutdown(fd, SHUT_RDWR);
+		receiver.join();
+		return false;
+	}
+	receiver.join();
+
+	int64_t sent = sender->datagrams_sent();
+	int64_t errors = sender->send_errors();
+	delete sender;
+
+	int64_t bytes = 0;
+	int odd_sizes = 0;
+	for (std::size_t i = 0; i < r.sizes.size(); i++)
+	{
+		bytes += r.sizes[i];
+		// 只有最后一个可以不满 7 个包.
+		if (r.sizes[i] % ts_sender::ts_packet_size != 0 || (r.sizes[i] != ts_sender::datagram_size && i + 1 != r.sizes.size()))
+			odd_sizes++;
+	}
+
+	// 相邻数据报间隔的中位数; 偶尔被调度耽误后追赶的一小段不影响结果.
+	std::vector<int64_t> gaps;
+	for (std::size_t i = 1; i < r.times.size(); i++)
+		gaps.push_back(r.times[i] - r.times[i - 1]);
+	int64_t gap = 0;
+	if (!gaps.empty())
+	{
+		std::nth_element(gaps.begin(), gaps.begin() + gaps.size() / 2, gaps.end());
+		gap = gaps[gaps.size() / 2];
+	}
+	int64_t span = r.times.empty() ? 0 : r.times.back() - r.times.front();
+	int64_t duration = (frames - 1) * 1000000LL / fps;
+	int64_t even_gap = 1000000 / fps / frame_datagrams;
+
+	printf("%s: sent %lld, received %d datagrams (%lld bytes), send errors %lld\n",
+		url.c_str(), static_cast<long long>(sent), static_cast<int>(r.sizes.size()), static_cast<long long>(bytes), static_cast<long long>(errors));
+	printf("  non-7x188 datagrams %d, bad sync bytes %d, span %lld ms, median gap %lld us (even pacing is %lld us)\n",
+		odd_sizes, r.bad_sync, static_cast<long long>(span / 1000), static_cast<long long>(gap), static_cast<long long>(even_gap));
+
+	bool ok = bytes == written && odd_sizes == 0 && r.bad_sync == 0 && errors == 0
+		// 一帧的包一起发出去时大部分间隔只有几微秒.
+		&& gap >= even_gap / 4 && span >= duration * 9 / 10;
+	if (!ok)
+		printf("  FAILED\n");
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+
+	int udp = socket(AF_INET, SOCK_DGRAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (udp < 0 || bind(udp, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+		|| getsockname(udp, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+	{
+		perror("udp");
+		return 1;
+	}
+	ok = run("paced-udp://127.0.0.1:" + boost::lexical_cast<std::string>(ntohs(addr.sin_port)), udp) && ok;
+	close(udp);
+
+	std::string path = "/tmp/ts_sender_check-" + boost::lexical_cast<std::string>(getpid()) + ".sock";
+	int local = socket(AF_UNIX, SOCK_DGRAM, 0);
+	sockaddr_un un;
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strncpy(un.sun_path, path.c_str(), sizeof(un.sun_path) - 1);
+	if (local < 0 || bind(local, reinterpret_cast<sockaddr*>(&un), sizeof(un)) != 0)
+	{
+		perror("unix");
+		return 1;
+	}
+	ok = run("paced-unix://" + path, local) && ok;
+	close(local);
+	unlink(path.c_str());
+
+	return ok ? 0 : 1;
+}